@@ -3,7 +3,15 @@
 #include <array>
 #include <thread>
 #include <iostream>
+#include <cctype>
 #include <cstring>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+#ifdef CHAT_ZSTD
+#include <zstd.h>
+#endif
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
 #include <chrono>
@@ -26,16 +34,20 @@ public:
     Client(const std::string& username,
             boost::asio::io_service& io_service,
             tcp::resolver::iterator endpoint_iterator) :
-            service_(io_service), socket_(io_service), username_(username) {
+            service_(io_service), socket_(io_service), retry_(io_service), endpoints_(endpoint_iterator), username_(username) {
 
-        boost::asio::async_connect(socket_, endpoint_iterator, boost::bind(&Client::start, this, _1));
+        connect();
     }
 
     /**
      * @brief Closes the connection.
      */
     void close() {
-            service_.post(boost::bind(&Client::closeSocket, this));
+            service_.post([this] {
+                closing_ = true;
+                retry_.cancel();
+                closeSocket();
+            });
     }
     /**
      * @brief Sends a message to the server.
@@ -46,41 +58,242 @@ public:
     }
 
 private:
+    /**
+     * @brief Connects to the server.
+     */
+    void connect() {
+        boost::asio::async_connect(socket_, endpoints_, boost::bind(&Client::start, this, _1));
+    }
      /**
      * @brief Starts the client after a successful connection.
+     * A client that already saw messages of the room asks to resume after the last one.
+     * A client built with zstd asks for compressed payloads, naming the dictionary it has.
      * @param error The error code.
      */
     void start(const boost::system::error_code& error) {
         if (!error) {
+            handshake_ = last_seq_ > 0 ? "RESUME " + std::to_string(last_seq_) + ' ' + username_ + '\n' : username_ + '\n';
+#ifdef CHAT_ZSTD
+            handshake_ = "ZSTD " + std::to_string(dictionary_id_) + ' ' + handshake_;
+#endif
             boost::asio::async_write(socket_,
-                                     boost::asio::buffer(username_ + '\n', username_.size() + 1),
-                                     boost::bind(&Client::reader, this, _1));
+                                     boost::asio::buffer(handshake_),
+                                     [this](const boost::system::error_code& error, std::size_t) {
+                                         if (!error) {
+                                             // Lines typed while disconnected go out now.
+                                             connected_ = true;
+                                             if (!write_message_.empty()) {
+                                                 async_write();
+                                             }
+                                         }
+                                         read(error);
+                                     });
+            return;
+        }
+        closeSocket();
+    }
+    /**
+     * @brief Starts reading the next line from the server.
+     * @param error The error code.
+     */
+    void read(const boost::system::error_code& error)
+    {
+        if (!error) {
+            boost::asio::async_read_until(socket_,
+                                          boost::asio::dynamic_buffer(read_message_, max_line), "\n",
+                                          boost::bind(&Client::reader, this, _1, _2));
+            return;
         }
+        closeSocket();
     }
     /**
      * @brief Handles reading from the server.
      * @param error The error code.
+     * @param length Length of the received line.
      */
-    void reader(const boost::system::error_code& error)
+    void reader(const boost::system::error_code& error, std::size_t length)
     { 
         if (!error) {   
-            std::cout << read_message_ << std::endl;
-            read_message_.clear();
-            boost::asio::async_read_until(socket_,
-                                          boost::asio::dynamic_buffer(read_message_, 1024), "\n",
-                                          boost::bind(&Client::reader, this, _1));
+            std::string line = read_message_.substr(0, length);
+            read_message_.erase(0, length);
+#ifdef CHAT_ZSTD
+            if (line[0] == '~' && std::isdigit(static_cast<unsigned char>(line[1]))) {
+                // "~<seq> <sender id> <time ms> <size>" is followed by a compressed payload.
+                std::istringstream fields(line.substr(1));
+                std::uint64_t seq;
+                std::uint32_t sender;
+                std::int64_t sent_ms;
+                std::size_t size;
+                if (fields >> seq >> sender >> sent_ms >> size) {
+                    readBytes(size, [this, seq, sender](const std::string& payload) {
+                        std::string text = decompress(payload);
+                        show(seq, sender, text);
+                    });
+                    return;
+                }
+            } else if (line[0] == 'Z' && std::isdigit(static_cast<unsigned char>(line[1]))) {
+                // "Z<size>" is followed by replayed history, compressed as one stream of lines.
+                std::size_t size = std::stoull(line.substr(1));
+                readBytes(size, [this](const std::string& stream) {
+                    std::istringstream lines(decompressStream(stream));
+                    std::string bundled;
+                    while (std::getline(lines, bundled)) {
+                        handleLine(bundled + '\n');
+                    }
+                });
+                return;
+            } else if (line.rfind("ZSTD ", 0) == 0) {
+                // The server compresses: "ZSTD <dictionary id> <size>" and the dictionary, unless we have it.
+                std::istringstream fields(line.substr(5));
+                std::uint32_t id;
+                std::size_t size;
+                if (fields >> id >> size) {
+                    readBytes(size, [this, id](const std::string& dictionary) {
+                        if (!dictionary.empty() || id != dictionary_id_) {
+                            dictionary_id_ = id;
+                            ddict_.reset(ZSTD_createDDict(dictionary.data(), dictionary.size()));
+                        }
+                    });
+                    return;
+                }
+            }
+#endif
+            handleLine(line);
+            read(error);
             return;
         }
         closeSocket();
         
     }
+    /**
+     * @brief Handles one line from the server.
+     * @param line The line, including the trailing newline.
+     */
+    void handleLine(const std::string& line) {
+        if (line == "PING\n") {
+            // Heartbeat from the server, answered without showing it.
+            writeLine("PONG\n");
+        } else if (line == "RESYNC\n") {
+            std::cout << "(some messages were missed while disconnected)" << std::endl;
+        } else if (line[0] == '@' && std::isdigit(static_cast<unsigned char>(line[1]))) {
+            // "@<id> <username>" names a sender before its first message.
+            std::istringstream fields(line.substr(1));
+            std::uint32_t id;
+            std::string name;
+            if (fields >> id >> name) {
+                senders_[id] = name;
+            }
+        } else if (line[0] == '#' && std::isdigit(static_cast<unsigned char>(line[1]))) {
+            // Room messages are "#<seq> <sender id> <time ms> <text>".
+            std::istringstream fields(line.substr(1));
+            std::uint64_t seq;
+            std::uint32_t sender;
+            std::int64_t sent_ms;
+            if (fields >> seq >> sender >> sent_ms) {
+                fields.get();
+                std::string text;
+                std::getline(fields, text);
+                show(seq, sender, text);
+            } else {
+                std::cout << line << std::flush;
+            }
+        } else if (line[0] == '?' && std::isdigit(static_cast<unsigned char>(line[1]))) {
+            // Search results are "?<seq> <text>", shown without touching the resume point.
+            std::size_t space = line.find(' ');
+            if (space != std::string::npos) {
+                std::cout << "  #" << line.substr(1, space - 1) << ": " << line.substr(space + 1) << std::flush;
+            } else {
+                std::cout << line << std::flush;
+            }
+        } else {
+            std::cout << line << std::flush;
+        }
+    }
+
+    /**
+     * @brief Shows a room message, its sequence number is remembered to resume after a reconnect.
+     * @param seq Sequence number.
+     * @param sender Sender id.
+     * @param text Payload.
+     */
+    void show(std::uint64_t seq, std::uint32_t sender, const std::string& text) {
+        last_seq_ = seq;
+        std::cout << '[' << senders_[sender] << "] " << text << std::endl;
+    }
+#ifdef CHAT_ZSTD
+    /**
+     * @brief Takes the next bytes of the stream, then goes back to reading lines.
+     * @param size Number of bytes.
+     * @param handler Receives the bytes.
+     */
+    void readBytes(std::size_t size, std::function<void(const std::string&)> handler) {
+        auto done = [this, size, handler](const boost::system::error_code& error, std::size_t) {
+            if (error) {
+                closeSocket();
+                return;
+            }
+            handler(read_message_.substr(0, size));
+            read_message_.erase(0, size);
+            read(error);
+        };
+        if (read_message_.size() >= size) {
+            done({}, 0);
+            return;
+        }
+        boost::asio::async_read(socket_, boost::asio::dynamic_buffer(read_message_),
+                                boost::asio::transfer_exactly(size - read_message_.size()), done);
+    }
+    /**
+     * @brief Decompresses a payload with the server's dictionary.
+     * @param payload Compressed bytes.
+     * @return std::string The text, or a placeholder if it cannot be decompressed.
+     */
+    std::string decompress(const std::string& payload) {
+        if (!dctx_) {
+            dctx_.reset(ZSTD_createDCtx());
+        }
+        unsigned long long size = ZSTD_getFrameContentSize(payload.data(), payload.size());
+        if (!ddict_ || size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR || size > max_line) {
+            return "(unreadable message)";
+        }
+        std::string text(size, '\0');
+        std::size_t n = ZSTD_decompress_usingDDict(dctx_.get(), text.data(), text.size(), payload.data(), payload.size(), ddict_.get());
+        return ZSTD_isError(n) ? "(unreadable message)" : text;
+    }
+    /**
+     * @brief Decompresses a bulk stream, which uses a long window and no dictionary.
+     * @param stream Compressed bytes.
+     * @return std::string The lines it holds, empty if it cannot be decompressed.
+     */
+    std::string decompressStream(const std::string& stream) {
+        std::unique_ptr<ZSTD_DCtx, FreeDCtx> dctx(ZSTD_createDCtx());
+        ZSTD_DCtx_setParameter(dctx.get(), ZSTD_d_windowLogMax, 27);
+        std::string out;
+        std::string chunk(ZSTD_DStreamOutSize(), '\0');
+        ZSTD_inBuffer in = {stream.data(), stream.size(), 0};
+        while (true) {
+            ZSTD_outBuffer buffer = {chunk.data(), chunk.size(), 0};
+            std::size_t result = ZSTD_decompressStream(dctx.get(), &buffer, &in);
+            if (ZSTD_isError(result)) {
+                std::cout << "(unreadable history)" << std::endl;
+                return {};
+            }
+            out.append(chunk.data(), buffer.pos);
+            // Done at the end of the frame, or when the input is used up and all output flushed.
+            if (result == 0 || (in.pos == in.size && buffer.pos < buffer.size)) {
+                break;
+            }
+        }
+        return out;
+    }
+#endif
 
     /**
      * @brief Initiates an asynchronous write operation.
      */
     void async_write() {
         boost::asio::async_write(socket_,
-                                     boost::asio::buffer("[" + username_ + "] " + write_message_.front() + '\n', write_message_.front().size() + 4 + username_.size()),
+                                     boost::asio::buffer(write_message_.front()),
                                      boost::bind(&Client::writer, this, _1));
     }
 
@@ -104,24 +317,67 @@ private:
      * @param msg The message to write.
      */
     void writeSocket(const std::string& msg) {
+        writeLine(msg + '\n');
+    }
+    /**
+     * @brief Queues a complete protocol line for sending.
+     * @param line The line to send, including the trailing newline.
+     */
+    void writeLine(const std::string& line) {
         auto write_in_progress = !write_message_.empty();
-        write_message_.push_back(msg);
-        if (!write_in_progress) {
+        write_message_.push_back(line);
+        if (!write_in_progress && connected_) {
             async_write();
         }
     }
     /**
-     * @brief Closes the socket connection.
+     * @brief Closes the socket connection and reconnects after a second unless the user quit.
+     * Lines typed meanwhile stay queued and are sent after the reconnect.
      */
     void closeSocket() {
-        socket_.close();
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+        connected_ = false;
+        read_message_.clear();
+        if (closing_) {
+            return;
+        }
+        retry_.expires_after(std::chrono::seconds(1));
+        retry_.async_wait([this](const boost::system::error_code& error) {
+            if (!error && !closing_) {
+                connect();
+            }
+        });
     }
 
     boost::asio::io_service& service_;
     tcp::socket socket_;
+    boost::asio::steady_timer retry_;
+    tcp::resolver::iterator endpoints_;
+    // Sequence number of the last room message shown.
+    std::uint64_t last_seq_ = 0;
+    // Usernames of the senders by id, as announced by the server.
+    std::unordered_map<std::uint32_t, std::string> senders_;
+#ifdef CHAT_ZSTD
+    struct FreeDDict {
+        void operator()(ZSTD_DDict* ddict) const { ZSTD_freeDDict(ddict); }
+    };
+    struct FreeDCtx {
+        void operator()(ZSTD_DCtx* dctx) const { ZSTD_freeDCtx(dctx); }
+    };
+    // Dictionary shipped by the server, kept across reconnects.
+    std::uint32_t dictionary_id_ = 0;
+    std::unique_ptr<ZSTD_DDict, FreeDDict> ddict_;
+    std::unique_ptr<ZSTD_DCtx, FreeDCtx> dctx_;
+#endif
+    // Longest line or message accepted from the server.
+    static constexpr std::size_t max_line = 65536;
+    bool connected_ = false;
+    bool closing_ = false;
     std::string read_message_;
     std::deque<std::string> write_message_;
     std::string username_;
+    std::string handshake_;
 };
 /**
  * @brief The main function.
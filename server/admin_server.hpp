@@ -0,0 +1,80 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <functional>
+#include <iostream>
+#include <string>
+
+using boost::asio::awaitable;
+using boost::asio::co_spawn;
+using boost::asio::detached;
+using boost::asio::use_awaitable;
+using boost::asio::local::stream_protocol;
+
+// Answers one command line of the admin console.
+using AdminHandler = std::function<awaitable<std::string>(std::string)>;
+
+/**
+ * @brief Serve one admin connection: every line is a command, answered before the next is read.
+ * @param socket Accepted connection.
+ * @param handle Produces the answer to a command.
+ * @return Awaitable<void>
+ */
+inline awaitable<void> admin_connection(stream_protocol::socket socket, AdminHandler handle) {
+    try {
+        std::string input;
+        while (true) {
+            std::size_t n = co_await boost::asio::async_read_until(socket, boost::asio::dynamic_buffer(input, 4096), "\n", use_awaitable);
+            std::string line = input.substr(0, n - 1);
+            input.erase(0, n);
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (line == "quit") {
+                break;
+            }
+            std::string answer = co_await handle(std::move(line));
+            co_await boost::asio::async_write(socket, boost::asio::buffer(answer), use_awaitable);
+        }
+    } catch (boost::system::system_error& e) {
+        if (e.code() != boost::asio::error::eof) {
+            std::cerr << "Admin connection error: " << e.what() << std::endl;
+        }
+    }
+}
+
+/**
+ * @brief Open the admin socket, replacing a stale one, readable by the owner only.
+ * @param io_context Event loop serving the console.
+ * @param path Filesystem path of the socket.
+ * @return stream_protocol::acceptor Listening acceptor.
+ */
+inline stream_protocol::acceptor open_admin_socket(boost::asio::io_context& io_context, const std::string& path) {
+    ::unlink(path.c_str());
+    stream_protocol::acceptor acceptor(io_context, stream_protocol());
+    // Created owner-only by bind itself: a chmod afterwards leaves a moment anyone may connect in.
+    boost::system::error_code ec;
+    mode_t mask = ::umask(0177);
+    acceptor.bind(stream_protocol::endpoint(path), ec);
+    ::umask(mask);
+    if (ec) {
+        throw boost::system::system_error(ec, "Cannot bind " + path);
+    }
+    acceptor.listen();
+    return acceptor;
+}
+
+/**
+ * @brief Accept admin connections on a Unix domain socket.
+ * @param acceptor Listening acceptor.
+ * @param handle Produces the answer to a command.
+ * @return Awaitable<void>
+ */
+inline awaitable<void> admin_server(stream_protocol::acceptor acceptor, AdminHandler handle) {
+    while (true) {
+        stream_protocol::socket socket = co_await acceptor.async_accept(use_awaitable);
+        co_spawn(acceptor.get_executor(), admin_connection(std::move(socket), handle), detached);
+    }
+}
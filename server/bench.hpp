@@ -0,0 +1,383 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config.hpp"
+#include "intern_table.hpp"
+#include "message.hpp"
+#include "mpsc_queue.hpp"
+#include "room_snapshot.hpp"
+#include "shm_ring.hpp"
+
+/**
+ * @brief Push messages from many threads into one queue while a single thread drains it.
+ * @param producers Number of producer threads.
+ * @param per_producer Messages pushed by every producer.
+ * @param push Appends a message.
+ * @param pop Takes a message, returns false if none is ready.
+ * @return double Messages per second.
+ */
+inline double bench_queue(std::size_t producers, std::size_t per_producer,
+                          const std::function<void(const MessagePtr&)>& push,
+                          const std::function<bool(MessagePtr&)>& pop) {
+    MessagePtr message = make_message("benchmark message");
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < producers; ++i) {
+        threads.emplace_back([&]{
+            while (!go.load()) {
+                std::this_thread::yield();
+            }
+            for (std::size_t j = 0; j < per_producer; ++j) {
+                push(message);
+            }
+        });
+    }
+    auto started = std::chrono::steady_clock::now();
+    go.store(true);
+    MessagePtr received;
+    for (std::size_t left = producers * per_producer; left > 0;) {
+        if (pop(received)) {
+            --left;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return static_cast<double>(producers * per_producer) / elapsed.count();
+}
+
+/**
+ * @brief Session inbox contention: the lock-free MPSC queue against a mutex-protected deque.
+ */
+inline void bench_inbox() {
+    constexpr std::size_t producers = 32;
+    constexpr std::size_t per_producer = 100000;
+    MpscQueue<MessagePtr> inbox;
+    double lock_free = bench_queue(producers, per_producer,
+        [&](const MessagePtr& message) { inbox.push(message); },
+        [&](MessagePtr& message) { return inbox.pop(message); });
+
+    std::mutex mutex;
+    std::deque<MessagePtr> locked;
+    double with_mutex = bench_queue(producers, per_producer,
+        [&](const MessagePtr& message) {
+            std::lock_guard<std::mutex> lock(mutex);
+            locked.push_back(message);
+        },
+        [&](MessagePtr& message) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (locked.empty()) {
+                return false;
+            }
+            message = std::move(locked.front());
+            locked.pop_front();
+            return true;
+        });
+    std::cout << "inbox, " << producers << " producers x " << per_producer << " messages\n"
+              << "  mpsc queue:    " << lock_free / 1e6 << " M msg/s\n"
+              << "  mutex + deque: " << with_mutex / 1e6 << " M msg/s\n";
+}
+
+/**
+ * @brief Burst in a few hot rooms: members that only count their deliveries join real rooms,
+ * each homed on a shard of its own, and every room fans its messages out through the
+ * work-stealing pool as it does when serving. Prints how evenly the busy time spread over the
+ * workers. Defined in main.cpp, next to the rooms.
+ * @param settings Server settings, --fanout-workers and --fanout-slice apply.
+ */
+void bench_fanout(const ServerConfig& settings);
+
+/**
+ * @brief A chat server started from this executable for the length of a benchmark, with one room
+ * reachable over TCP loopback and a Unix domain socket.
+ */
+class BenchServer {
+    public:
+        BenchServer() : dir_("/tmp/chat_bench_" + std::to_string(::getpid())) {
+            {
+                // A port nobody listens on right now.
+                boost::asio::io_context io_context;
+                boost::asio::ip::tcp::acceptor probe(io_context, {boost::asio::ip::address_v4::loopback(), 0});
+                port_ = probe.local_endpoint().port();
+            }
+            ::mkdir(dir_.c_str(), 0700);
+            std::string room = std::to_string(port_);
+            std::string sockets = "--unix-socket-dir=" + dir_;
+            pid_ = ::fork();
+            if (pid_ == 0) {
+                int null = ::open("/dev/null", O_WRONLY);
+                ::dup2(null, STDOUT_FILENO);
+                ::dup2(null, STDERR_FILENO);
+                ::execl("/proc/self/exe", "chat_server", room.c_str(), sockets.c_str(), static_cast<char*>(nullptr));
+                ::_exit(127);
+            }
+        }
+        BenchServer(const BenchServer&) = delete;
+        BenchServer& operator=(const BenchServer&) = delete;
+        ~BenchServer() {
+            if (pid_ > 0) {
+                ::kill(pid_, SIGTERM);
+                ::waitpid(pid_, nullptr, 0);
+            }
+            ::unlink(unix_path().c_str());
+            ::rmdir(dir_.c_str());
+        }
+        unsigned short port() const {
+            return port_;
+        }
+        std::string unix_path() const {
+            return dir_ + "/" + std::to_string(port_) + ".sock";
+        }
+        /**
+         * @brief Connect a socket to the server, retrying while it starts.
+         * @return bool False if the server did not answer within five seconds.
+         */
+        template <typename Socket, typename Endpoint>
+        static bool connect(Socket& socket, const Endpoint& endpoint) {
+            for (int attempt = 0; attempt < 100; ++attempt) {
+                boost::system::error_code ec;
+                socket.connect(endpoint, ec);
+                if (!ec) {
+                    return true;
+                }
+                socket.close(ec);
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            }
+            return false;
+        }
+    private:
+        std::string dir_;
+        unsigned short port_ = 0;
+        pid_t pid_ = -1;
+};
+
+/**
+ * @brief Read from a session's socket until some room messages arrived.
+ * @param socket Socket of the session.
+ * @param pending Bytes of an incomplete line, kept between calls.
+ * @return std::size_t Number of room messages, the lines starting with '#', read this time.
+ */
+template <typename Socket>
+std::size_t read_room_messages(Socket& socket, std::string& pending) {
+    char buffer[1 << 16];
+    std::size_t messages = 0;
+    while (messages == 0) {
+        pending.append(buffer, socket.read_some(boost::asio::buffer(buffer)));
+        std::size_t start = 0;
+        for (std::size_t end; (end = pending.find('\n', start)) != std::string::npos; start = end + 1) {
+            messages += pending[start] == '#';
+        }
+        pending.erase(0, start);
+    }
+    return messages;
+}
+
+/**
+ * @brief Stream chat lines through one session of the server and bounce one line through it.
+ * The session is the only member of its room, so every line comes back to it as a room message
+ * after its reader, the room and its writer handled it.
+ * @param socket Socket of the session, past the handshake.
+ * @param send Sends one line, through the socket or a shared ring.
+ * @param lines Lines to stream.
+ * @param round_trips Lines to bounce.
+ * @return std::pair<double, double> Lines per second, and microseconds per round trip.
+ */
+template <typename Socket>
+std::pair<double, double> bench_session(Socket& socket, const std::function<void(const std::string&)>& send,
+                                        std::size_t lines, std::size_t round_trips) {
+    const std::string line = std::string(63, 'x') + '\n';
+    std::string pending;
+    auto started = std::chrono::steady_clock::now();
+    std::thread sender([&]{
+        for (std::size_t sent = 0; sent < lines; ++sent) {
+            send(line);
+        }
+    });
+    for (std::size_t received = 0; received < lines;) {
+        received += read_room_messages(socket, pending);
+    }
+    sender.join();
+    std::chrono::duration<double> streaming = std::chrono::steady_clock::now() - started;
+
+    started = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < round_trips; ++i) {
+        send(line);
+        read_room_messages(socket, pending);
+    }
+    std::chrono::duration<double, std::micro> bouncing = std::chrono::steady_clock::now() - started;
+    return {static_cast<double>(lines) / streaming.count(), bouncing.count() / static_cast<double>(round_trips)};
+}
+
+/**
+ * @brief Chat lines through a session of a real server over TCP loopback, a Unix domain socket
+ * and a shared ring, the local transports.
+ */
+inline void bench_transports() {
+    constexpr std::size_t lines = 1000000;
+    constexpr std::size_t round_trips = 20000;
+    BenchServer server;
+    boost::asio::io_context io_context;
+    auto report = [](const char* name, std::pair<double, double> result) {
+        std::cout << "  " << name << result.first / 1e6 << " M lines/s, "
+                  << result.first * 64 / 1e6 << " MB/s, round trip " << result.second << " us\n";
+    };
+    std::cout << "transports, " << lines << " lines of 64 bytes, " << round_trips << " round trips\n";
+    {
+        using boost::asio::ip::tcp;
+        tcp::socket socket(io_context);
+        if (!BenchServer::connect(socket, tcp::endpoint(boost::asio::ip::address_v4::loopback(), server.port()))) {
+            std::cerr << "The server did not start\n";
+            return;
+        }
+        socket.set_option(tcp::no_delay(true));
+        boost::asio::write(socket, boost::asio::buffer(std::string("tcp\n")));
+        report("tcp loopback: ", bench_session(socket, [&](const std::string& line) {
+            boost::asio::write(socket, boost::asio::buffer(line));
+        }, lines, round_trips));
+    }
+    {
+        using boost::asio::local::stream_protocol;
+        stream_protocol::socket socket(io_context);
+        if (!BenchServer::connect(socket, stream_protocol::endpoint(server.unix_path()))) {
+            std::cerr << "No Unix domain socket at " << server.unix_path() << '\n';
+            return;
+        }
+        boost::asio::write(socket, boost::asio::buffer(std::string("unix\n")));
+        report("unix socket:  ", bench_session(socket, [&](const std::string& line) {
+            boost::asio::write(socket, boost::asio::buffer(line));
+        }, lines, round_trips));
+    }
+    {
+        // Lines go into the ring, the room messages come back over the socket it was passed on.
+        using boost::asio::local::stream_protocol;
+        stream_protocol::socket socket(io_context);
+        if (!BenchServer::connect(socket, stream_protocol::endpoint(server.unix_path()))) {
+            return;
+        }
+        boost::asio::write(socket, boost::asio::buffer(std::string("SHM ring\n")));
+        std::string answer;
+        auto ring = ShmRing::receive(socket.native_handle(), answer);
+        if (!ring) {
+            std::cerr << "No shared ring: " << answer << '\n';
+            return;
+        }
+        report("shared ring:  ", bench_session(socket, [&](const std::string& line) {
+            std::string_view text(line.data(), line.size() - 1);
+            while (!ring->push(text)) {
+                std::this_thread::yield();
+            }
+        }, lines, round_trips));
+    }
+}
+
+/**
+ * @brief Startup from a snapshot of a million rooms: map the file, then restore every room the
+ * way the server builds it, looking it up and rebuilding its history.
+ */
+inline void bench_snapshot() {
+    constexpr std::size_t rooms = 1000000;
+    constexpr std::size_t history = 10;
+    const std::string path = "/tmp/chat_bench_" + std::to_string(::getpid()) + ".snapshot";
+    std::vector<RoomState> states(rooms);
+    for (std::size_t i = 0; i < rooms; ++i) {
+        states[i].name = std::to_string(10000000 + i);
+        states[i].last_seq = 1000 + i;
+        if (i % 4 == 0) {
+            states[i].index_roots = {1, 16385};
+        }
+        // Most rooms are quiet, a few keep a full history.
+        for (std::size_t m = 0; m < (i % 7 == 0 ? history : i % 3); ++m) {
+            states[i].history.push_back({states[i].last_seq - m, "user" + std::to_string(i % 5000), 1760000000000,
+                                         "message " + std::to_string(m) + " of room " + states[i].name});
+        }
+    }
+    auto started = std::chrono::steady_clock::now();
+    if (!RoomSnapshot::write(path, states)) {
+        std::cerr << "Cannot write " << path << '\n';
+        return;
+    }
+    std::chrono::duration<double, std::milli> writing = std::chrono::steady_clock::now() - started;
+    states.clear();
+    states.shrink_to_fit();
+
+    started = std::chrono::steady_clock::now();
+    auto snapshot = RoomSnapshot::open(path);
+    std::chrono::duration<double, std::milli> mapping = std::chrono::steady_clock::now() - started;
+    if (!snapshot) {
+        std::cerr << "Cannot map " << path << '\n';
+        std::remove(path.c_str());
+        return;
+    }
+    InternTable names;
+    std::size_t restored = 0, messages = 0, roots = 0;
+    started = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < rooms; ++i) {
+        auto room = snapshot->find(std::to_string(10000000 + i));
+        if (!room) {
+            continue;
+        }
+        restored += snapshot->last_seq(*room) > 0;
+        roots += snapshot->index_roots(*room).size();
+        std::deque<MessagePtr> recent;
+        snapshot->for_each_message(*room, [&](const RoomSnapshot::MessageView& view) {
+            auto message = std::make_shared<Message>();
+            message->text = view.text;
+            message->seq = view.seq;
+            message->sender = names.acquire(view.sender);
+            message->sent_ms = view.sent_ms;
+            recent.push_back(std::move(message));
+        });
+        messages += recent.size();
+    }
+    std::chrono::duration<double, std::milli> restoring = std::chrono::steady_clock::now() - started;
+    struct stat st{};
+    ::stat(path.c_str(), &st);
+    std::remove(path.c_str());
+    std::cout << "snapshot, " << restored << " rooms, " << messages << " history messages, " << roots << " index segments, "
+              << static_cast<double>(st.st_size) / 1e6 << " MB\n"
+              << "  write:          " << writing.count() << " ms\n"
+              << "  map and check:  " << mapping.count() << " ms\n"
+              << "  restore rooms:  " << restoring.count() << " ms, "
+              << restoring.count() * 1e6 / rooms << " ns per room\n"
+              << "  startup total:  " << mapping.count() + restoring.count() << " ms\n";
+}
+
+/**
+ * @brief Run the benchmark named by --bench.
+ * @param config Server settings.
+ * @return int Exit code.
+ */
+inline int run_bench(const ServerConfig& config) {
+    std::map<std::string, std::function<void()>> benches = {
+        {"inbox", bench_inbox},
+        {"fanout", [&config]{ bench_fanout(config); }},
+        {"transports", bench_transports},
+        {"snapshot", bench_snapshot},
+    };
+    auto bench = benches.find(config.bench);
+    if (bench == benches.end()) {
+        std::cerr << "Unknown benchmark: " << config.bench << '\n';
+        return 1;
+    }
+    bench->second();
+    return 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/**
+ * @brief Pool of reusable byte buffers shared by the sessions of one event loop.
+ * Idle sessions return their buffers here, so memory follows active connections.
+ */
+class BufferPool {
+    public:
+        /**
+         * @brief Constructor for buffer pool.
+         * @param buffer_size Capacity reserved for every buffer handed out.
+         * @param max_pooled Maximum number of free buffers kept.
+         */
+        BufferPool(std::size_t buffer_size, std::size_t max_pooled) :
+            buffer_size_(buffer_size), max_pooled_(max_pooled) {}
+        /**
+         * @brief Take an empty buffer from the pool.
+         * @return std::string Buffer with reserved capacity.
+         */
+        std::string acquire() {
+            if (free_.empty()) {
+                std::string buffer;
+                buffer.reserve(buffer_size_);
+                return buffer;
+            }
+            std::string buffer = std::move(free_.back());
+            free_.pop_back();
+            return buffer;
+        }
+        /**
+         * @brief Give a buffer back to the pool.
+         * Buffers that grew far beyond the nominal size are freed instead.
+         * @param buffer Buffer to return.
+         */
+        void release(std::string&& buffer) {
+            if (free_.size() >= max_pooled_ || buffer.capacity() > 4 * buffer_size_) {
+                std::string().swap(buffer);
+                return;
+            }
+            buffer.clear();
+            free_.push_back(std::move(buffer));
+        }
+        /**
+         * @brief Number of free buffers currently held.
+         */
+        std::size_t pooled() const {
+            return free_.size();
+        }
+    private:
+        std::size_t buffer_size_;
+        std::size_t max_pooled_;
+        std::vector<std::string> free_;
+};
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#ifdef CHAT_ZSTD
+
+#include <zdict.h>
+#include <zstd.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+/**
+ * @brief Compresses message payloads with zstd and a dictionary trained on chat traffic.
+ * Chat messages are too short for plain zstd to find much to reuse; the dictionary supplies
+ * the common words and phrases. The digested dictionary is read-only and shared by all
+ * threads, each thread compresses with a context of its own.
+ */
+class MessageCompressor {
+    public:
+        /**
+         * @brief Load a dictionary file.
+         * @param path Dictionary written by train_dictionary().
+         * @param level zstd compression level.
+         */
+        MessageCompressor(const std::string& path, int level) {
+            std::ifstream in(path, std::ios::binary);
+            dictionary_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            if (!in.is_open() || dictionary_.empty()) {
+                throw std::runtime_error("Cannot read zstd dictionary " + path);
+            }
+            level_ = level;
+            id_ = ZDICT_getDictID(dictionary_.data(), dictionary_.size());
+            cdict_.reset(ZSTD_createCDict(dictionary_.data(), dictionary_.size(), level));
+            if (!cdict_) {
+                throw std::runtime_error("Invalid zstd dictionary " + path);
+            }
+        }
+        /**
+         * @brief Dictionary id, clients that already have this dictionary are not sent it again.
+         */
+        std::uint32_t id() const {
+            return id_;
+        }
+        /**
+         * @brief Raw dictionary shipped to clients that ask for compression.
+         */
+        const std::string& dictionary() const {
+            return dictionary_;
+        }
+        /**
+         * @brief Compress a payload, callable from any thread.
+         * @param text Payload.
+         * @return std::string Compressed payload, empty if compression would not make it smaller.
+         */
+        std::string compress(std::string_view text) const {
+            thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> context(ZSTD_createCCtx(), &ZSTD_freeCCtx);
+            std::string out(ZSTD_compressBound(text.size()), '\0');
+            std::size_t size = ZSTD_compress_usingCDict(context.get(), out.data(), out.size(), text.data(), text.size(), cdict_.get());
+            if (ZSTD_isError(size) || size >= text.size()) {
+                return {};
+            }
+            out.resize(size);
+            return out;
+        }
+        /**
+         * @brief Compress a bulk transfer as one stream with a long window, callable from any thread.
+         * Repeats far apart, like names and phrases recurring over thousands of messages, are
+         * found too. Needs no dictionary, the stream is long enough to build its own.
+         * @param text Everything to transfer.
+         * @return std::string One zstd frame, empty on failure.
+         */
+        std::string compress_stream(std::string_view text) const {
+            thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> context(ZSTD_createCCtx(), &ZSTD_freeCCtx);
+            ZSTD_CCtx_reset(context.get(), ZSTD_reset_session_and_parameters);
+            ZSTD_CCtx_setParameter(context.get(), ZSTD_c_compressionLevel, level_);
+            ZSTD_CCtx_setParameter(context.get(), ZSTD_c_windowLog, stream_window_log);
+            ZSTD_CCtx_setParameter(context.get(), ZSTD_c_enableLongDistanceMatching, 1);
+            std::string out(ZSTD_compressBound(text.size()), '\0');
+            std::size_t size = ZSTD_compress2(context.get(), out.data(), out.size(), text.data(), text.size());
+            if (ZSTD_isError(size)) {
+                return {};
+            }
+            out.resize(size);
+            return out;
+        }
+        // Window of bulk streams, clients must accept it when decompressing.
+        static constexpr int stream_window_log = 27;
+    private:
+        struct FreeCDict {
+            void operator()(ZSTD_CDict* cdict) const {
+                ZSTD_freeCDict(cdict);
+            }
+        };
+        std::string dictionary_;
+        std::uint32_t id_ = 0;
+        int level_ = 3;
+        std::unique_ptr<ZSTD_CDict, FreeCDict> cdict_;
+};
+
+/**
+ * @brief Train a dictionary on a corpus of chat messages, one message per line.
+ * @param corpus Path of the corpus.
+ * @param path Dictionary file to write.
+ * @param capacity Maximum dictionary size in bytes.
+ * @return int Exit code.
+ */
+inline int train_dictionary(const std::string& corpus, const std::string& path, std::size_t capacity) {
+    std::ifstream in(corpus);
+    std::string samples, line;
+    std::vector<std::size_t> sizes;
+    while (std::getline(in, line)) {
+        if (!line.empty()) {
+            samples += line;
+            sizes.push_back(line.size());
+        }
+    }
+    std::string dictionary(capacity, '\0');
+    std::size_t size = ZDICT_trainFromBuffer(dictionary.data(), dictionary.size(), samples.data(), sizes.data(),
+                                             static_cast<unsigned>(sizes.size()));
+    if (ZDICT_isError(size)) {
+        std::cerr << "Cannot train a dictionary on " << sizes.size() << " messages: " << ZDICT_getErrorName(size) << std::endl;
+        return 1;
+    }
+    std::ofstream out(path, std::ios::binary);
+    out.write(dictionary.data(), static_cast<std::streamsize>(size));
+    if (!out) {
+        std::cerr << "Cannot write dictionary " << path << std::endl;
+        return 1;
+    }
+    std::cerr << "Trained a " << size << " byte dictionary on " << sizes.size() << " messages" << std::endl;
+    return 0;
+}
+
+#else
+
+#include <iostream>
+
+// Built without CHAT_ZSTD: messages are never compressed.
+class MessageCompressor {
+    public:
+        MessageCompressor(const std::string&, int) {}
+        std::uint32_t id() const {
+            return 0;
+        }
+        const std::string& dictionary() const {
+            static const std::string none;
+            return none;
+        }
+        std::string compress(std::string_view) const {
+            return {};
+        }
+        std::string compress_stream(std::string_view) const {
+            return {};
+        }
+};
+
+inline int train_dictionary(const std::string&, const std::string&, std::size_t) {
+    std::cerr << "Built without CHAT_ZSTD, cannot train a dictionary" << std::endl;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Runtime settings of the chat server.
+ */
+struct ServerConfig {
+    // Listening TCP ports, one chat room per port.
+    std::vector<unsigned short> ports;
+    // Maximum length of a single incoming line.
+    std::size_t max_message_size = 1024;
+    // Sessions quiet for this long give their buffers back to the pool.
+    std::chrono::milliseconds hibernate_after{30000};
+    // Resolution of the timer wheel.
+    std::chrono::milliseconds timer_tick{100};
+    // A PING is sent after this long without anything received.
+    std::chrono::milliseconds heartbeat_interval{30000};
+    // Sessions that do not answer a PING within this time are dropped.
+    std::chrono::milliseconds heartbeat_timeout{10000};
+    // Sessions that send no chat message for this long are dropped, 0 disables.
+    std::chrono::milliseconds idle_timeout{0};
+    // Time a new connection has to send its username.
+    std::chrono::milliseconds handshake_timeout{10000};
+    // Messages every room keeps for new members and for clients that resume.
+    std::size_t room_history = 10;
+    // Upper bound of buffers kept by the shared pool.
+    std::size_t buffer_pool_size = 1024;
+    // Rate limits of one session, and of the senders of a room on one shard, 0 is unlimited.
+    // Every shard has its own room bucket: with N shards a room accepts up to N times the rate.
+    double session_messages_per_sec = 0;
+    double session_bytes_per_sec = 0;
+    double room_shard_messages_per_sec = 0;
+    double room_shard_bytes_per_sec = 0;
+    // Seconds worth of traffic a bucket lets through in a burst.
+    double rate_burst = 1.0;
+    // Messages a reader may handle in a row before yielding to other handlers, 0 never yields.
+    std::size_t reader_budget = 16;
+    // Rooms with at least this many members fan out in slices that yield to the event loop.
+    std::size_t fanout_threshold = 1024;
+    // Members served per fan-out slice.
+    std::size_t fanout_slice = 256;
+    // Threads fanning out large rooms, 0 slices the fan-out on the event loop instead.
+    std::size_t fanout_workers = 0;
+    // Number of shards (event loop threads), 0 means one per CPU.
+    std::size_t shards = 1;
+    // Bind every shard thread to its own CPU.
+    bool pin_shards = false;
+    // Port of the HTTP endpoint serving Prometheus metrics on localhost, 0 disables it.
+    unsigned short metrics_port = 0;
+    // How often every shard measures how late its event loop runs a timer.
+    std::chrono::milliseconds lag_probe_interval{100};
+    // A lag probe overdue by this much is a stall and gets a backtrace, 0 disables the watchdog.
+    std::chrono::milliseconds stall_threshold{250};
+    // Chrome trace file written on shutdown, empty disables tracing (needs a CHAT_TRACING build).
+    std::string trace_file;
+    // One message or connection out of this many is traced.
+    std::size_t trace_sample = 1000;
+    // Directory of the mailboxes of offline users, empty keeps no mailboxes.
+    std::string mailbox_dir;
+    // Directory of the search index segments of every room, empty disables /search.
+    std::string index_dir;
+    // Messages per search index segment, a full segment is written out and memory-mapped.
+    std::size_t index_segment_size = 16384;
+    // zstd dictionary for clients that negotiate compression, empty disables it (needs a CHAT_ZSTD build).
+    std::string zstd_dict;
+    int zstd_level = 3;
+    // History replays of at least this many messages go to compressing clients as one zstd stream, 0 disables.
+    std::size_t bulk_threshold = 64;
+    // Train zstd_dict on this corpus of messages, one per line, instead of serving.
+    std::string zstd_train;
+    // Largest dictionary to train, in bytes.
+    std::size_t zstd_dict_size = 32768;
+    // Directory of a Unix domain socket per room, <port>.sock, for local clients; empty disables them.
+    std::string unix_socket_dir;
+    // Bytes of the shared ring a local publisher may ask for on a Unix domain socket, 0 refuses rings.
+    std::size_t shm_ring_size = 1 << 20;
+    // Unix domain socket of hot restarts: a new process started with the same path takes over
+    // the listening sockets and sessions of the running one. Empty disables hot restarts.
+    std::string handoff_socket;
+    // Snapshot of every room's sequence counter, recent history and search index segments,
+    // loaded on startup and rewritten periodically and on shutdown; empty disables snapshots.
+    std::string snapshot_file;
+    // How often the snapshot is rewritten while serving, 0 only writes it on shutdown.
+    std::chrono::milliseconds snapshot_interval{60000};
+    // Directory idle rooms are written to, <port>.room, when they are evicted; empty keeps every room loaded.
+    std::string room_cache_dir;
+    // Rooms each shard keeps loaded however idle they are, the least recently used idle ones beyond are evicted.
+    std::size_t room_cache_size = 1024;
+    // A room without members that has not been used for this long is idle.
+    std::chrono::milliseconds room_idle{60000};
+    // Most distinct usernames the server keeps ids for, connections with new usernames beyond are refused.
+    std::size_t max_names = 1 << 20;
+    // Path of the Unix domain socket of the admin console, empty disables it.
+    std::string admin_socket;
+    // Run the named benchmark instead of serving.
+    std::string bench;
+};
+
+/**
+ * @brief Parse the server command line.
+ * Positional arguments are ports, options look like --name=value.
+ * @param argc Number of arguments.
+ * @param argv Arguments.
+ * @return ServerConfig Parsed settings.
+ */
+inline ServerConfig parse_config(int argc, char* argv[]) {
+    ServerConfig config;
+    auto millis = [](std::chrono::milliseconds& field) {
+        return [&field](const std::string& value) { field = std::chrono::milliseconds(std::stoll(value)); };
+    };
+    auto size = [](std::size_t& field) {
+        return [&field](const std::string& value) { field = std::stoull(value); };
+    };
+    auto number = [](double& field) {
+        return [&field](const std::string& value) { field = std::stod(value); };
+    };
+    std::map<std::string, std::function<void(const std::string&)>> options = {
+        {"max-message-size", size(config.max_message_size)},
+        {"hibernate-after-ms", millis(config.hibernate_after)},
+        {"timer-tick-ms", millis(config.timer_tick)},
+        {"heartbeat-interval-ms", millis(config.heartbeat_interval)},
+        {"heartbeat-timeout-ms", millis(config.heartbeat_timeout)},
+        {"idle-timeout-ms", millis(config.idle_timeout)},
+        {"handshake-timeout-ms", millis(config.handshake_timeout)},
+        {"buffer-pool-size", size(config.buffer_pool_size)},
+        {"room-history", size(config.room_history)},
+        {"session-messages-per-sec", number(config.session_messages_per_sec)},
+        {"session-bytes-per-sec", number(config.session_bytes_per_sec)},
+        {"room-shard-messages-per-sec", number(config.room_shard_messages_per_sec)},
+        {"room-shard-bytes-per-sec", number(config.room_shard_bytes_per_sec)},
+        {"rate-burst", number(config.rate_burst)},
+        {"reader-budget", size(config.reader_budget)},
+        {"fanout-threshold", size(config.fanout_threshold)},
+        {"fanout-slice", size(config.fanout_slice)},
+        {"fanout-workers", size(config.fanout_workers)},
+        {"shards", size(config.shards)},
+        {"pin-shards", [&config](const std::string& value) { config.pin_shards = value != "0"; }},
+        {"metrics-port", [&config](const std::string& value) {
+            config.metrics_port = static_cast<unsigned short>(std::stoul(value));
+        }},
+        {"lag-probe-interval-ms", millis(config.lag_probe_interval)},
+        {"stall-threshold-ms", millis(config.stall_threshold)},
+        {"trace-file", [&config](const std::string& value) { config.trace_file = value; }},
+        {"trace-sample", size(config.trace_sample)},
+        {"mailbox-dir", [&config](const std::string& value) { config.mailbox_dir = value; }},
+        {"index-dir", [&config](const std::string& value) { config.index_dir = value; }},
+        {"index-segment-size", size(config.index_segment_size)},
+        {"zstd-dict", [&config](const std::string& value) { config.zstd_dict = value; }},
+        {"zstd-level", [&config](const std::string& value) { config.zstd_level = std::stoi(value); }},
+        {"bulk-threshold", size(config.bulk_threshold)},
+        {"zstd-train", [&config](const std::string& value) { config.zstd_train = value; }},
+        {"zstd-dict-size", size(config.zstd_dict_size)},
+        {"unix-socket-dir", [&config](const std::string& value) { config.unix_socket_dir = value; }},
+        {"shm-ring-size", size(config.shm_ring_size)},
+        {"handoff-socket", [&config](const std::string& value) { config.handoff_socket = value; }},
+        {"snapshot-file", [&config](const std::string& value) { config.snapshot_file = value; }},
+        {"snapshot-interval-ms", millis(config.snapshot_interval)},
+        {"room-cache-dir", [&config](const std::string& value) { config.room_cache_dir = value; }},
+        {"room-cache-size", size(config.room_cache_size)},
+        {"room-idle-ms", millis(config.room_idle)},
+        {"max-names", size(config.max_names)},
+        {"admin-socket", [&config](const std::string& value) { config.admin_socket = value; }},
+        {"bench", [&config](const std::string& value) { config.bench = value; }},
+    };
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            config.ports.push_back(static_cast<unsigned short>(std::atoi(arg.c_str())));
+            continue;
+        }
+        auto eq = arg.find('=');
+        std::string name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+        std::string value = eq == std::string::npos ? "1" : arg.substr(eq + 1);
+        auto option = options.find(name);
+        if (option == options.end()) {
+            throw std::invalid_argument("Unknown option: " + arg);
+        }
+        option->second(value);
+    }
+    return config;
+}
+
+/**
+ * @brief Path of the Unix domain socket of a room.
+ * @param config Server configuration with unix_socket_dir set.
+ * @param room_id Index of the room's port.
+ * @return std::string <unix_socket_dir>/<port>.sock
+ */
+inline std::string unix_socket_path(const ServerConfig& config, std::size_t room_id) {
+    return config.unix_socket_dir + "/" + std::to_string(config.ports[room_id]) + ".sock";
+}
+
+/**
+ * @brief File an evicted room is written to.
+ * @param config Server configuration with room_cache_dir set.
+ * @param room_id Index of the room's port.
+ * @return std::string <room_cache_dir>/<port>.room
+ */
+inline std::string room_cache_path(const ServerConfig& config, std::size_t room_id) {
+    return config.room_cache_dir + "/" + std::to_string(config.ports[room_id]) + ".room";
+}
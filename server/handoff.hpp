@@ -0,0 +1,350 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief A message queued for a client or kept in a room's history, as passed to the next process.
+ * Senders are passed by name: interned ids are private to a process.
+ */
+struct HandoffMessage {
+    std::uint64_t seq = 0;
+    // Empty for server notices.
+    std::string sender;
+    std::int64_t sent_ms = 0;
+    std::string text;
+};
+
+/**
+ * @brief A client connection and everything the next process needs to carry on serving it.
+ */
+struct HandoffSession {
+    int fd = -1;
+    unsigned short port = 0;
+    std::string username;
+    // Input read but not handled yet, a partial line.
+    std::string pending;
+    // Newest room message the client was sent or has queued.
+    std::uint64_t last_seq = 0;
+    bool compress = false;
+    // Id of the dictionary the client decompresses with, if compress is set.
+    std::uint32_t dictionary = 0;
+    // Messages not yet written to the client, in order.
+    std::vector<HandoffMessage> queued;
+};
+
+/**
+ * @brief Sequence counter and recent history of a room.
+ */
+struct HandoffRoom {
+    unsigned short port = 0;
+    std::uint64_t last_seq = 0;
+    std::vector<HandoffMessage> history;
+};
+
+/**
+ * @brief A listening socket passed to the next process.
+ */
+struct HandoffListener {
+    enum class Kind : std::uint8_t {
+        tcp,
+        unix_socket,
+        metrics,
+    };
+    Kind kind = Kind::tcp;
+    unsigned short port = 0;
+    int fd = -1;
+};
+
+/**
+ * @brief Everything a hot restart passes from the old process to the new one.
+ */
+struct HandoffState {
+    std::vector<HandoffListener> listeners;
+    std::vector<HandoffSession> sessions;
+    std::vector<HandoffRoom> rooms;
+    // The old process sent everything; a truncated handoff still serves what arrived.
+    bool complete = false;
+};
+
+/**
+ * @brief Packets of a hot restart over a SOCK_SEQPACKET Unix domain socket.
+ * Every listener and session is one packet carrying its file descriptor (SCM_RIGHTS), a
+ * packet boundary keeps the descriptor with its state. Queued and history messages follow
+ * the session or room they belong to, one packet each, and an end packet closes the handoff.
+ * Integers are little-endian, strings have a 4-byte length.
+ */
+class HandoffChannel {
+    public:
+        /**
+         * @brief Constructor for handoff channel.
+         * @param fd Connected SOCK_SEQPACKET socket, owned by the caller.
+         * @param timeout Longest wait for the peer to make room for a packet, sending fails after it.
+         */
+        explicit HandoffChannel(int fd, std::chrono::milliseconds timeout = std::chrono::seconds(5)) : fd_(fd), timeout_(timeout) {}
+        bool send(const HandoffListener& listener) {
+            std::string packet(1, 'L');
+            put(packet, static_cast<std::uint64_t>(listener.kind));
+            put(packet, listener.port);
+            return write(packet, listener.fd);
+        }
+        bool send(const HandoffSession& session) {
+            std::string packet(1, 'S');
+            put(packet, session.port);
+            put(packet, session.last_seq);
+            put(packet, session.compress);
+            put_string(packet, session.username);
+            put_string(packet, session.pending);
+            put(packet, session.dictionary);
+            if (!write(packet, session.fd)) {
+                return false;
+            }
+            for (auto& message : session.queued) {
+                if (!send_message('Q', message)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        bool send(const HandoffRoom& room) {
+            std::string packet(1, 'R');
+            put(packet, room.port);
+            put(packet, room.last_seq);
+            if (!write(packet, -1)) {
+                return false;
+            }
+            for (auto& message : room.history) {
+                if (!send_message('H', message)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        bool send_end() {
+            return write("E", -1);
+        }
+        /**
+         * @brief Read packets until the end packet, or until the old process stops sending.
+         * @param state Receives the listeners, sessions and rooms.
+         */
+        void receive(HandoffState& state) {
+            std::vector<char> buffer(max_packet);
+            while (true) {
+                int fd = -1;
+                ssize_t n = read(buffer, fd);
+                if (n <= 0) {
+                    return;
+                }
+                std::string_view packet(buffer.data(), static_cast<std::size_t>(n));
+                char type = packet.front();
+                packet.remove_prefix(1);
+                if (type == 'E') {
+                    state.complete = true;
+                    return;
+                }
+                if (type == 'L') {
+                    HandoffListener listener;
+                    listener.kind = static_cast<HandoffListener::Kind>(get<std::uint64_t>(packet));
+                    listener.port = get<unsigned short>(packet);
+                    listener.fd = fd;
+                    state.listeners.push_back(listener);
+                } else if (type == 'S') {
+                    HandoffSession session;
+                    session.port = get<unsigned short>(packet);
+                    session.last_seq = get<std::uint64_t>(packet);
+                    session.compress = get<std::uint8_t>(packet) != 0;
+                    session.username = get_string(packet);
+                    session.pending = get_string(packet);
+                    // Read as 0 from the shorter packets of older versions.
+                    session.dictionary = get<std::uint32_t>(packet);
+                    session.fd = fd;
+                    state.sessions.push_back(std::move(session));
+                } else if (type == 'Q' && !state.sessions.empty()) {
+                    state.sessions.back().queued.push_back(get_message(packet));
+                } else if (type == 'R') {
+                    HandoffRoom room;
+                    room.port = get<unsigned short>(packet);
+                    room.last_seq = get<std::uint64_t>(packet);
+                    state.rooms.push_back(std::move(room));
+                } else if (type == 'H' && !state.rooms.empty()) {
+                    state.rooms.back().history.push_back(get_message(packet));
+                } else if (fd >= 0) {
+                    ::close(fd);
+                }
+            }
+        }
+    private:
+        // Largest packet: a message, its sender and the framing, or a session with its pending input.
+        static constexpr std::size_t max_packet = 1 << 20;
+
+        template <typename T>
+        static void put(std::string& out, T value) {
+            out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+        static void put_string(std::string& out, std::string_view text) {
+            put(out, static_cast<std::uint32_t>(text.size()));
+            out += text;
+        }
+        template <typename T>
+        static T get(std::string_view& in) {
+            T value{};
+            if (in.size() >= sizeof(value)) {
+                std::memcpy(&value, in.data(), sizeof(value));
+                in.remove_prefix(sizeof(value));
+            }
+            return value;
+        }
+        static std::string get_string(std::string_view& in) {
+            // Read the length before looking at what is left of the packet.
+            std::size_t size = get<std::uint32_t>(in);
+            size = std::min(size, in.size());
+            std::string text(in.substr(0, size));
+            in.remove_prefix(size);
+            return text;
+        }
+        static HandoffMessage get_message(std::string_view& in) {
+            HandoffMessage message;
+            message.seq = get<std::uint64_t>(in);
+            message.sent_ms = get<std::int64_t>(in);
+            message.sender = get_string(in);
+            message.text = get_string(in);
+            return message;
+        }
+        bool send_message(char type, const HandoffMessage& message) {
+            std::string packet(1, type);
+            put(packet, message.seq);
+            put(packet, message.sent_ms);
+            put_string(packet, message.sender);
+            put_string(packet, message.text);
+            return write(packet, -1);
+        }
+        /**
+         * @brief Send one packet, with a file descriptor if fd is not -1.
+         */
+        bool write(std::string_view packet, int fd) {
+            iovec io{const_cast<char*>(packet.data()), packet.size()};
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+            msghdr message{};
+            message.msg_iov = &io;
+            message.msg_iovlen = 1;
+            if (fd >= 0) {
+                message.msg_control = control;
+                message.msg_controllen = sizeof(control);
+                cmsghdr* c = CMSG_FIRSTHDR(&message);
+                c->cmsg_level = SOL_SOCKET;
+                c->cmsg_type = SCM_RIGHTS;
+                c->cmsg_len = CMSG_LEN(sizeof(int));
+                std::memcpy(CMSG_DATA(c), &fd, sizeof(int));
+            }
+            while (true) {
+                if (::sendmsg(fd_, &message, MSG_NOSIGNAL) >= 0) {
+                    return true;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    // A new process that stopped reading must not hang the old one.
+                    pollfd wait{fd_, POLLOUT, 0};
+                    if (::poll(&wait, 1, static_cast<int>(timeout_.count())) == 0) {
+                        return false;
+                    }
+                } else if (errno != EINTR) {
+                    return false;
+                }
+            }
+        }
+        /**
+         * @brief Receive one packet and the file descriptor it carries, if any.
+         */
+        ssize_t read(std::vector<char>& buffer, int& fd) {
+            iovec io{buffer.data(), buffer.size()};
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+            msghdr message{};
+            message.msg_iov = &io;
+            message.msg_iovlen = 1;
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            ssize_t n;
+            do {
+                n = ::recvmsg(fd_, &message, MSG_CMSG_CLOEXEC);
+            } while (n < 0 && errno == EINTR);
+            for (cmsghdr* c = n > 0 ? CMSG_FIRSTHDR(&message) : nullptr; c; c = CMSG_NXTHDR(&message, c)) {
+                if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+                    std::memcpy(&fd, CMSG_DATA(c), sizeof(int));
+                }
+            }
+            return n;
+        }
+
+        int fd_;
+        std::chrono::milliseconds timeout_;
+};
+
+/**
+ * @brief Take over from a running server that listens on the handoff socket, if there is one.
+ * @param path Filesystem path of the handoff socket.
+ * @param timeout Longest wait for the old process between two packets.
+ * @return HandoffState What the old process passed on, empty if none is running.
+ */
+inline HandoffState receive_handoff(const std::string& path, std::chrono::milliseconds timeout) {
+    HandoffState state;
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        return state;
+    }
+    std::memcpy(address.sun_path, path.data(), path.size());
+    int fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return state;
+    }
+    // Nobody listening, or a stale socket of a process that is gone: a cold start.
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        ::close(fd);
+        return state;
+    }
+    timeval wait{static_cast<time_t>(timeout.count() / 1000), static_cast<suseconds_t>(timeout.count() % 1000 * 1000)};
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+    HandoffChannel(fd).receive(state);
+    ::close(fd);
+    if (!state.complete) {
+        std::cerr << "Handoff interrupted, serving the " << state.sessions.size() << " sessions received" << std::endl;
+    }
+    return state;
+}
+
+// Listens for the next process, SOCK_SEQPACKET has no acceptor type of its own.
+using HandoffAcceptor = boost::asio::basic_socket_acceptor<boost::asio::generic::seq_packet_protocol>;
+
+/**
+ * @brief Open the handoff socket, replacing a stale one, usable by the owner only.
+ * @param io_context Event loop serving it.
+ * @param path Filesystem path of the socket.
+ * @return HandoffAcceptor Listening acceptor.
+ */
+inline HandoffAcceptor open_handoff_socket(boost::asio::io_context& io_context, const std::string& path) {
+    ::unlink(path.c_str());
+    boost::asio::generic::seq_packet_protocol::endpoint endpoint(boost::asio::local::stream_protocol::endpoint{path});
+    HandoffAcceptor acceptor(io_context, endpoint.protocol());
+    // Created owner-only by bind itself: whoever connects in between would receive every session.
+    boost::system::error_code ec;
+    mode_t mask = ::umask(0177);
+    acceptor.bind(endpoint, ec);
+    ::umask(mask);
+    if (ec) {
+        throw boost::system::system_error(ec, "Cannot bind " + path);
+    }
+    acceptor.listen();
+    return acceptor;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief High dynamic range histogram of nanosecond durations from 1ns to about an hour.
+ * Buckets are log-linear: every power of two is split into 64 equal sub-buckets, so any
+ * recorded value is known to within 1/64 (about 1.6%) whatever its magnitude.
+ * Recording is one relaxed atomic increment; readers on other threads may merge a copy
+ * at any time and see a slightly stale, never torn, picture.
+ */
+class LatencyHistogram {
+    public:
+        static constexpr unsigned sub_bits = 7;
+        static constexpr std::uint64_t sub_count = std::uint64_t(1) << sub_bits;
+        static constexpr std::uint64_t half_count = sub_count / 2;
+        // Values are clamped below 2^max_bits ns (about 73 minutes).
+        static constexpr unsigned max_bits = 42;
+        static constexpr std::size_t bucket_count = sub_count + (max_bits - sub_bits) * half_count;
+
+        /**
+         * @brief Plain copy of the counts, used to merge and query.
+         */
+        struct Snapshot {
+            std::vector<std::uint64_t> counts = std::vector<std::uint64_t>(bucket_count);
+            std::uint64_t total = 0;
+            std::uint64_t sum = 0;
+            std::uint64_t max = 0;
+
+            /**
+             * @brief Add the counts of a histogram.
+             */
+            void merge(const LatencyHistogram& histogram) {
+                for (std::size_t i = 0; i < bucket_count; ++i) {
+                    std::uint64_t count = histogram.counts_[i].load(std::memory_order_relaxed);
+                    counts[i] += count;
+                    total += count;
+                }
+                sum += histogram.sum_.load(std::memory_order_relaxed);
+                max = std::max(max, histogram.max_.load(std::memory_order_relaxed));
+            }
+            /**
+             * @brief Value below or at which the given share of the samples lie.
+             * @param quantile Share between 0 and 1.
+             * @return std::uint64_t Highest value of the bucket holding that sample, capped at max.
+             */
+            std::uint64_t quantile(double quantile) const {
+                if (total == 0) {
+                    return 0;
+                }
+                auto rank = static_cast<std::uint64_t>(std::ceil(quantile * static_cast<double>(total)));
+                rank = std::clamp<std::uint64_t>(rank, 1, total);
+                std::uint64_t seen = 0;
+                for (std::size_t i = 0; i < bucket_count; ++i) {
+                    seen += counts[i];
+                    if (seen >= rank) {
+                        return std::min(highest(i), max);
+                    }
+                }
+                return max;
+            }
+        };
+
+        /**
+         * @brief Record one duration, must be called by the owning thread only.
+         * @param value Duration in nanoseconds.
+         */
+        void record(std::uint64_t value) {
+            counts_[index(value)].fetch_add(1, std::memory_order_relaxed);
+            sum_.fetch_add(value, std::memory_order_relaxed);
+            if (value > max_.load(std::memory_order_relaxed)) {
+                max_.store(value, std::memory_order_relaxed);
+            }
+        }
+        /**
+         * @brief Bucket of a value.
+         */
+        static std::size_t index(std::uint64_t value) {
+            value = std::min(value, (std::uint64_t(1) << max_bits) - 1);
+            if (value < sub_count) {
+                return static_cast<std::size_t>(value);
+            }
+            unsigned shift = static_cast<unsigned>(std::bit_width(value)) - sub_bits;
+            return static_cast<std::size_t>(sub_count + (shift - 1) * half_count + ((value >> shift) - half_count));
+        }
+        /**
+         * @brief Highest value that falls into a bucket.
+         */
+        static std::uint64_t highest(std::size_t index) {
+            if (index < sub_count) {
+                return index;
+            }
+            std::uint64_t shift = (index - sub_count) / half_count + 1;
+            std::uint64_t sub = (index - sub_count) % half_count + half_count;
+            return ((sub + 1) << shift) - 1;
+        }
+    private:
+        std::array<std::atomic<std::uint64_t>, bucket_count> counts_{};
+        std::atomic<std::uint64_t> sum_{0};
+        std::atomic<std::uint64_t> max_{0};
+};
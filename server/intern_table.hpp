@@ -0,0 +1,236 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class NameRef;
+
+/**
+ * @brief Server-wide table giving usernames and room names small ids, shared by all shards.
+ * Ids start at 1; 0 stands for the server. Every name is stored once and does not move while
+ * it is referenced, so sessions, history and metrics keep the id or a view instead of a copy,
+ * and compare ids instead of strings. A name is held by the NameRefs of its sessions and
+ * messages and released with the last of them; its id is then given to the next new name, so
+ * the table holds at most a fixed number of names at once and refuses new ones beyond. Looking
+ * a name up by id takes no lock: the slots live in fixed-size chunks published before the id is.
+ */
+class InternTable {
+    public:
+        // Most names any table can hold.
+        static constexpr std::size_t max_capacity = (std::size_t(1) << 28) - 1;
+
+        /**
+         * @brief Constructor for intern table.
+         * @param capacity Most names to hold at once, at most max_capacity.
+         */
+        explicit InternTable(std::size_t capacity = max_capacity) : capacity_(std::min(capacity, max_capacity)) {}
+        InternTable(const InternTable&) = delete;
+        InternTable& operator=(const InternTable&) = delete;
+        /**
+         * @brief Reference to the id of a name, assigned if the name is not held yet, callable from any thread.
+         * @param name Name to look up.
+         * @return NameRef Holds the name until it is gone, null if the name is new and the table is full.
+         */
+        NameRef acquire(std::string_view name);
+        /**
+         * @brief Id of a name held for as long as the table, for names that never go away such as rooms.
+         * @param name Name to look up.
+         * @return std::uint32_t Its id, 0 if the name is new and the table is full.
+         */
+        std::uint32_t intern(std::string_view name) {
+            return reference(name);
+        }
+        /**
+         * @brief Id of a name without assigning one or holding it, callable from any thread.
+         * @param name Name to look up.
+         * @return std::uint32_t Its id, 0 if nobody holds the name.
+         */
+        std::uint32_t find(std::string_view name) const {
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            auto it = ids_.find(name);
+            return it == ids_.end() ? 0 : it->second;
+        }
+        /**
+         * @brief Name of an id, lock-free and callable from any thread.
+         * @param id Id held by the caller, through a NameRef or intern().
+         * @return std::string_view The name, valid while the id is held; empty for 0 or an unknown id.
+         */
+        std::string_view name(std::uint32_t id) const {
+            if (id == 0 || id > count_.load(std::memory_order_acquire)) {
+                return {};
+            }
+            return slot(id).name;
+        }
+        /**
+         * @brief How many names an id has stood for, so that whoever caches the name of an id sees it change.
+         * @param id Id held by the caller.
+         */
+        std::uint32_t generation(std::uint32_t id) const {
+            if (id == 0 || id > count_.load(std::memory_order_acquire)) {
+                return 0;
+            }
+            return slot(id).generation.load(std::memory_order_relaxed);
+        }
+        /**
+         * @brief Number of names held right now.
+         */
+        std::size_t size() const {
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            return live_;
+        }
+    private:
+        friend class NameRef;
+        static constexpr std::size_t chunk_size = 4096;
+
+        struct Slot {
+            std::string name;
+            std::atomic<std::uint32_t> refs{0};
+            std::atomic<std::uint32_t> generation{0};
+        };
+
+        Slot& slot(std::uint32_t id) const {
+            return chunks_[id / chunk_size].load(std::memory_order_relaxed)[id % chunk_size];
+        }
+        /**
+         * @brief Take a reference to a name, assigning it an id if nobody holds it.
+         * @return std::uint32_t Its id, 0 if the name is new and the table is full.
+         */
+        std::uint32_t reference(std::string_view name) {
+            {
+                std::shared_lock<std::shared_mutex> lock(mutex_);
+                auto it = ids_.find(name);
+                if (it != ids_.end()) {
+                    // Under the lock, so that release() sees the name in use again before it frees it.
+                    slot(it->second).refs.fetch_add(1, std::memory_order_relaxed);
+                    return it->second;
+                }
+            }
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            auto it = ids_.find(name);
+            if (it != ids_.end()) {
+                slot(it->second).refs.fetch_add(1, std::memory_order_relaxed);
+                return it->second;
+            }
+            if (live_ >= capacity_) {
+                return 0;
+            }
+            std::uint32_t id;
+            if (!free_.empty()) {
+                id = free_.back();
+                free_.pop_back();
+            } else {
+                id = count_.load(std::memory_order_relaxed) + 1;
+                std::size_t chunk = id / chunk_size;
+                if (!chunks_[chunk].load(std::memory_order_relaxed)) {
+                    owned_.push_back(std::make_unique<Slot[]>(chunk_size));
+                    chunks_[chunk].store(owned_.back().get(), std::memory_order_relaxed);
+                }
+            }
+            Slot& entry = slot(id);
+            entry.name.assign(name);
+            entry.refs.store(1, std::memory_order_relaxed);
+            entry.generation.fetch_add(1, std::memory_order_relaxed);
+            ids_.emplace(entry.name, id);
+            ++live_;
+            if (id > count_.load(std::memory_order_relaxed)) {
+                // Publishes the slot and its chunk to lock-free readers.
+                count_.store(id, std::memory_order_release);
+            }
+            return id;
+        }
+        /**
+         * @brief Add a reference to an id the caller already holds.
+         */
+        void retain(std::uint32_t id) {
+            slot(id).refs.fetch_add(1, std::memory_order_relaxed);
+        }
+        /**
+         * @brief Drop a reference, freeing the name and its id with the last one.
+         */
+        void release(std::uint32_t id) {
+            Slot& entry = slot(id);
+            if (entry.refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+                return;
+            }
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            // Looked up again meanwhile, or already freed by another release that also saw zero. The
+            // load acquires the last release, whose thread may have read the name after this one's.
+            auto it = ids_.find(entry.name);
+            if (entry.refs.load(std::memory_order_acquire) != 0 || it == ids_.end() || it->second != id) {
+                return;
+            }
+            ids_.erase(it);
+            entry.name.clear();
+            entry.name.shrink_to_fit();
+            free_.push_back(id);
+            --live_;
+        }
+
+        std::size_t capacity_;
+        mutable std::shared_mutex mutex_;
+        std::unordered_map<std::string_view, std::uint32_t> ids_;
+        // Slots by id, in chunks that never move once allocated.
+        std::array<std::atomic<Slot*>, 1 << 16> chunks_{};
+        std::deque<std::unique_ptr<Slot[]>> owned_;
+        // Ids whose names were released, given out again before new ones.
+        std::vector<std::uint32_t> free_;
+        std::size_t live_ = 0;
+        // Highest id handed out.
+        std::atomic<std::uint32_t> count_{0};
+};
+
+/**
+ * @brief Counted reference to an interned name, keeping its id from going to another name.
+ * Copies share the name; the last one to go releases it.
+ */
+class NameRef {
+    public:
+        NameRef() = default;
+        NameRef(const NameRef& other) : table_(other.table_), id_(other.id_) {
+            if (table_) {
+                table_->retain(id_);
+            }
+        }
+        NameRef(NameRef&& other) noexcept :
+            table_(std::exchange(other.table_, nullptr)), id_(std::exchange(other.id_, 0)) {}
+        NameRef& operator=(NameRef other) noexcept {
+            std::swap(table_, other.table_);
+            std::swap(id_, other.id_);
+            return *this;
+        }
+        ~NameRef() {
+            if (table_) {
+                table_->release(id_);
+            }
+        }
+        /**
+         * @brief Id of the name, 0 if null.
+         */
+        std::uint32_t id() const {
+            return id_;
+        }
+        explicit operator bool() const {
+            return id_ != 0;
+        }
+    private:
+        friend class InternTable;
+        NameRef(InternTable* table, std::uint32_t id) : table_(id ? table : nullptr), id_(id) {}
+
+        InternTable* table_ = nullptr;
+        std::uint32_t id_ = 0;
+};
+
+inline NameRef InternTable::acquire(std::string_view name) {
+    return NameRef(this, reference(name));
+}
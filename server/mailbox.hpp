@@ -0,0 +1,521 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "intern_table.hpp"
+#include "message.hpp"
+#include "users.hpp"
+
+/**
+ * @brief On-disk mailboxes of offline users, one append-only file per user.
+ * A file starts with the 8-byte offset of its first undelivered record and the owner's name as a
+ * 4-byte length and its bytes, followed by records of a 4-byte length and the message text. Files
+ * live in dir/xx/yy/ named by a 64-bit hash of the username, so nothing is kept in memory per
+ * mailbox and no directory grows large; users whose names hash alike get the next of a few numbered
+ * files. A drained mailbox is deleted. The file dir/members lists the rooms every user joined, one
+ * "<room> <user>" line each. Must be used from one thread only.
+ */
+class MailStore {
+    public:
+        /**
+         * @brief Constructor for mail store.
+         * @param dir Root directory, created if missing.
+         */
+        explicit MailStore(std::string dir) : dir_(std::move(dir)) {
+            make_directory(dir_);
+        }
+        /**
+         * @brief Append a message to a mailbox, durably.
+         * @param user Owner of the mailbox.
+         * @param text Message text.
+         * @return bool False if the mailbox could not be written.
+         */
+        bool append(const std::string& user, const std::string& text) {
+            std::string file;
+            int fd = open_mailbox(user, O_WRONLY | O_APPEND | O_CREAT, file);
+            if (fd < 0) {
+                return false;
+            }
+            std::string record;
+            auto length = static_cast<std::uint32_t>(text.size());
+            record.append(reinterpret_cast<const char*>(&length), sizeof(length));
+            record += text;
+            bool ok = ::write(fd, record.data(), record.size()) == static_cast<ssize_t>(record.size()) && ::fdatasync(fd) == 0;
+            ::close(fd);
+            return ok;
+        }
+        /**
+         * @brief Read the next batch of undelivered messages of a mailbox.
+         * A mailbox with nothing left to read is deleted.
+         * @param user Owner of the mailbox.
+         * @param batch Most messages to read.
+         * @param messages Receives the messages, left empty if there are none.
+         * @return std::uint64_t Offset after the batch, to commit once the batch was delivered.
+         */
+        std::uint64_t read(const std::string& user, std::size_t batch, std::vector<std::string>& messages) {
+            std::string file;
+            int fd = open_mailbox(user, O_RDONLY, file);
+            if (fd < 0) {
+                return 0;
+            }
+            std::uint64_t offset = 0;
+            struct stat st;
+            if (::pread(fd, &offset, sizeof(offset), 0) != sizeof(offset) || ::fstat(fd, &st) != 0) {
+                ::close(fd);
+                return 0;
+            }
+            auto end = static_cast<std::uint64_t>(st.st_size);
+            while (offset < end && messages.size() < batch) {
+                std::uint32_t length;
+                // A torn record from a crash while appending, nothing after it is readable.
+                if (end - offset < sizeof(length) ||
+                    ::pread(fd, &length, sizeof(length), static_cast<off_t>(offset)) != sizeof(length) ||
+                    length > end - offset - sizeof(length)) {
+                    break;
+                }
+                std::string text(length, '\0');
+                if (::pread(fd, text.data(), length, static_cast<off_t>(offset + sizeof(length))) != static_cast<ssize_t>(length)) {
+                    break;
+                }
+                messages.push_back(std::move(text));
+                offset += sizeof(length) + length;
+            }
+            ::close(fd);
+            if (messages.empty()) {
+                ::unlink(file.c_str());
+            }
+            return offset;
+        }
+        /**
+         * @brief Save that the messages of a mailbox before an offset were delivered.
+         * A batch is committed only after it reached the user, so it is never lost and never
+         * handed over twice. A mailbox delivered to its end is deleted.
+         * @param user Owner of the mailbox.
+         * @param offset Offset returned by read().
+         */
+        void commit(const std::string& user, std::uint64_t offset) {
+            std::string file;
+            int fd = open_mailbox(user, O_RDWR, file);
+            if (fd < 0) {
+                return;
+            }
+            struct stat st;
+            bool written = ::pwrite(fd, &offset, sizeof(offset), 0) == sizeof(offset) && ::fdatasync(fd) == 0;
+            if (written && ::fstat(fd, &st) == 0 && offset >= static_cast<std::uint64_t>(st.st_size)) {
+                ::unlink(file.c_str());
+            }
+            ::close(fd);
+        }
+        /**
+         * @brief Record durably that a user joined a room.
+         * @param room Name of the room.
+         * @param user Username.
+         * @return bool False if the list could not be written.
+         */
+        bool add_member(const std::string& room, const std::string& user) {
+            std::string file = dir_ + "/members";
+            int fd = ::open(file.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_EXCL, 0600);
+            bool created = fd >= 0;
+            if (!created) {
+                fd = ::open(file.c_str(), O_WRONLY | O_APPEND);
+            }
+            if (fd < 0) {
+                return false;
+            }
+            std::string line = room + ' ' + user + '\n';
+            bool ok = ::write(fd, line.data(), line.size()) == static_cast<ssize_t>(line.size()) && ::fdatasync(fd) == 0;
+            ::close(fd);
+            if (created) {
+                sync_directory(dir_);
+            }
+            return ok;
+        }
+        /**
+         * @brief Rooms every user joined, as recorded by add_member().
+         * @return std::vector<std::pair<std::string, std::string>> Room and username pairs.
+         */
+        std::vector<std::pair<std::string, std::string>> members() const {
+            std::vector<std::pair<std::string, std::string>> members;
+            std::ifstream in(dir_ + "/members");
+            std::string line;
+            while (std::getline(in, line)) {
+                auto space = line.find(' ');
+                // The last line may be torn by a crash.
+                if (space != std::string::npos && !in.eof()) {
+                    members.emplace_back(line.substr(0, space), line.substr(space + 1));
+                }
+            }
+            return members;
+        }
+    private:
+        // Numbered files tried for users whose names hash alike.
+        static constexpr int slots = 4;
+
+        /**
+         * @brief Create a directory if missing, durably.
+         */
+        static void make_directory(const std::string& dir) {
+            if (::mkdir(dir.c_str(), 0700) == 0) {
+                sync_directory(parent(dir));
+            }
+        }
+        static std::string parent(const std::string& file) {
+            auto slash = file.find_last_of('/');
+            return slash == std::string::npos ? "." : file.substr(0, slash);
+        }
+        /**
+         * @brief Make the entries of a directory durable, after a file was created or renamed in it.
+         */
+        static void sync_directory(const std::string& dir) {
+            int fd = ::open(dir.empty() ? "/" : dir.c_str(), O_RDONLY | O_DIRECTORY);
+            if (fd >= 0) {
+                ::fsync(fd);
+                ::close(fd);
+            }
+        }
+        /**
+         * @brief Owner of a mailbox file, empty if its header cannot be read.
+         */
+        static std::string owner(int fd) {
+            std::uint32_t length;
+            struct stat st;
+            if (::pread(fd, &length, sizeof(length), sizeof(std::uint64_t)) != sizeof(length) || ::fstat(fd, &st) != 0 ||
+                length > static_cast<std::uint64_t>(st.st_size) - sizeof(std::uint64_t) - sizeof(length)) {
+                return {};
+            }
+            std::string name(length, '\0');
+            if (::pread(fd, name.data(), length, sizeof(std::uint64_t) + sizeof(length)) != static_cast<ssize_t>(length)) {
+                return {};
+            }
+            return name;
+        }
+        /**
+         * @brief Open the mailbox file of a user, passing over files of others whose names hash alike.
+         * @param user Owner of the mailbox.
+         * @param flags Flags for open(), with O_CREAT a missing mailbox is created with its header.
+         * @param file Receives the path of the file.
+         * @return int File descriptor, -1 if there is no mailbox and none was created.
+         */
+        int open_mailbox(const std::string& user, int flags, std::string& file) const {
+            bool create = flags & O_CREAT;
+            std::string base = path(user, create);
+            std::string vacant;
+            for (int slot = 0; slot < slots; ++slot) {
+                std::string candidate = slot == 0 ? base : base + "." + std::to_string(slot);
+                int fd = ::open(candidate.c_str(), O_RDONLY);
+                if (fd < 0) {
+                    if (vacant.empty()) {
+                        vacant = candidate;
+                    }
+                    continue;
+                }
+                if (owner(fd) == user) {
+                    ::close(fd);
+                    file = candidate;
+                    return ::open(candidate.c_str(), flags & ~O_CREAT);
+                }
+                ::close(fd);
+            }
+            if (!create || vacant.empty()) {
+                return -1;
+            }
+            // The header is written under another name first, so a crash never leaves a mailbox without owner.
+            std::string temporary = vacant + ".new";
+            int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            if (fd < 0) {
+                return -1;
+            }
+            std::string header;
+            std::uint64_t start = sizeof(std::uint64_t) + sizeof(std::uint32_t) + user.size();
+            auto length = static_cast<std::uint32_t>(user.size());
+            header.append(reinterpret_cast<const char*>(&start), sizeof(start));
+            header.append(reinterpret_cast<const char*>(&length), sizeof(length));
+            header += user;
+            bool ok = ::write(fd, header.data(), header.size()) == static_cast<ssize_t>(header.size()) && ::fdatasync(fd) == 0;
+            ::close(fd);
+            if (!ok || ::rename(temporary.c_str(), vacant.c_str()) != 0) {
+                ::unlink(temporary.c_str());
+                return -1;
+            }
+            sync_directory(parent(vacant));
+            file = vacant;
+            return ::open(vacant.c_str(), flags & ~O_CREAT);
+        }
+        /**
+         * @brief First file of a mailbox.
+         * @param user Owner of the mailbox.
+         * @param create Create the parent directories.
+         */
+        std::string path(const std::string& user, bool create) const {
+            // FNV-1a.
+            std::uint64_t hash = 14695981039346656037ull;
+            for (unsigned char c : user) {
+                hash = (hash ^ c) * 1099511628211ull;
+            }
+            char name[17];
+            std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+            std::string first = dir_ + "/" + std::string(name, 2);
+            std::string second = first + "/" + std::string(name + 2, 2);
+            if (create) {
+                make_directory(first);
+                make_directory(second);
+            }
+            return second + "/" + name;
+        }
+
+        std::string dir_;
+};
+
+/**
+ * @brief Directory of online users and store-and-forward delivery for offline ones.
+ * Messages addressed to an online user go straight into its session's inbox; others are
+ * appended to its mailbox, which is drained into the session when the user connects again.
+ * Only users who logged in before get a mailbox, and a room message only reaches the mailbox
+ * of a user who joined that room.
+ * Disk access runs on a thread of its own, so event loops never wait for the disk. The
+ * directory lock is held while queueing disk work, which orders every append before or
+ * after the drain of a reconnecting user, never in between.
+ */
+class Mailboxes {
+    public:
+        /**
+         * @brief Runs a function on the thread that owns a session.
+         */
+        using Post = std::function<void(std::function<void()>)>;
+        /**
+         * @brief Outcome of sending to a user.
+         */
+        enum class Delivery {
+            // The user is online, the message went to its session.
+            delivered,
+            // The user is offline, the message went to its mailbox.
+            stored,
+            // The user is offline and there are no mailboxes, or none for this user.
+            offline,
+        };
+
+        /**
+         * @brief Constructor for mailboxes.
+         * @param dir Directory of the mailbox files, empty keeps no mailboxes.
+         * @param names Interned usernames, users are known by their id.
+         */
+        Mailboxes(const std::string& dir, const InternTable& names) : names_(names) {
+            if (!dir.empty()) {
+                store_ = std::make_unique<MailStore>(dir);
+                for (auto& [room, user] : store_->members()) {
+                    members_[std::move(user)].insert(std::move(room));
+                }
+                thread_ = std::thread([this]{ run(); });
+            }
+        }
+        Mailboxes(const Mailboxes&) = delete;
+        Mailboxes& operator=(const Mailboxes&) = delete;
+        ~Mailboxes() {
+            if (thread_.joinable()) {
+                {
+                    std::lock_guard<std::mutex> lock(queue_mutex_);
+                    stopping_ = true;
+                }
+                wakeup_.notify_one();
+                thread_.join();
+            }
+        }
+        bool persistent() const {
+            return store_ != nullptr;
+        }
+        /**
+         * @brief Register an online user and deliver its stored messages, callable from any thread.
+         * A second login under the same name takes over the deliveries.
+         * @param user Interned id of the username.
+         * @param room Name of the room the user joined.
+         * @param session Session of the user.
+         * @param post Runs a function on the thread of the session, stored messages are delivered there.
+         */
+        void connect(std::uint32_t user, std::string_view room, const std::shared_ptr<Users>& session, Post post) {
+            std::lock_guard<std::mutex> lock(directory_mutex_);
+            online_[user] = session;
+            if (store_) {
+                if (members_[std::string(names_.name(user))].emplace(room).second) {
+                    submit([this, room = std::string(room), name = std::string(names_.name(user))]{
+                        if (!store_->add_member(room, name)) {
+                            std::cerr << "Cannot record that " << name << " joined " << room << std::endl;
+                        }
+                    });
+                }
+                std::weak_ptr<Users> recipient = session;
+                submit([this, name = std::string(names_.name(user)), recipient, post = std::move(post)]{
+                    auto [it, idle] = draining_.insert_or_assign(name, Drain{recipient, post});
+                    // A drain in flight moves on to the new session with its next batch.
+                    if (idle) {
+                        drain(it->first);
+                    }
+                });
+            }
+        }
+        /**
+         * @brief Unregister a user that went offline, callable from any thread.
+         * @param user Interned id of the username.
+         * @param session Session that ends, ignored if another login replaced it.
+         */
+        void disconnect(std::uint32_t user, const Users* session) {
+            std::lock_guard<std::mutex> lock(directory_mutex_);
+            auto it = online_.find(user);
+            if (it != online_.end() && it->second.lock().get() == session) {
+                online_.erase(it);
+            }
+        }
+        /**
+         * @brief Deliver a message to a user, or store it if the user is offline.
+         * @param user Recipient.
+         * @param message Message to deliver.
+         * @return Delivery What happened to the message, offline for a user who never logged in.
+         */
+        Delivery send(std::string_view user, const MessagePtr& message) {
+            return route(user, message, {});
+        }
+        /**
+         * @brief Store a room message for an offline user it mentions, an online user saw it in its room.
+         * @param user Mentioned user.
+         * @param room Name of the room, the user must have joined it once.
+         * @param message Message to store.
+         * @return Delivery What happened to the message.
+         */
+        Delivery mention(std::string_view user, std::string_view room, const MessagePtr& message) {
+            return route(user, message, room);
+        }
+    private:
+        /**
+         * @brief Deliver a message to an online user, or store it for an offline user known to the mailboxes.
+         * @param room Room of a mention, which is not delivered online; empty for a direct message.
+         */
+        Delivery route(std::string_view user, const MessagePtr& message, std::string_view room) {
+            std::shared_ptr<Users> session;
+            {
+                std::lock_guard<std::mutex> lock(directory_mutex_);
+                // A name nobody holds is not online.
+                auto it = online_.find(names_.find(user));
+                if (it != online_.end()) {
+                    session = it->second.lock();
+                }
+                if (!session) {
+                    if (!store_) {
+                        return Delivery::offline;
+                    }
+                    // Never a mailbox for someone who never logged in, nor a mention for someone never in the room.
+                    auto member = members_.find(std::string(user));
+                    if (member == members_.end() || (!room.empty() && !member->second.contains(std::string(room)))) {
+                        return Delivery::offline;
+                    }
+                    submit([this, user = std::string(user), message]{
+                        if (!store_->append(user, message->text)) {
+                            std::cerr << "Cannot write the mailbox of " << user << std::endl;
+                        }
+                    });
+                    return Delivery::stored;
+                }
+            }
+            if (room.empty()) {
+                session->deliver(message);
+            }
+            return Delivery::delivered;
+        }
+        void submit(std::function<void()> task) {
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex_);
+                tasks_.push_back(std::move(task));
+            }
+            wakeup_.notify_one();
+        }
+        /**
+         * @brief Read the next batch of a mailbox and hand it to the thread of its recipient, on the disk thread.
+         * The recipient is locked and released on its own thread, and the batch is committed
+         * back on the disk thread once it was delivered.
+         * @param name Owner of the mailbox.
+         */
+        void drain(const std::string& name) {
+            auto it = draining_.find(name);
+            std::vector<std::string> texts;
+            std::uint64_t offset = store_->read(name, batch, texts);
+            if (texts.empty()) {
+                draining_.erase(it);
+                return;
+            }
+            it->second.post([this, name, offset, recipient = it->second.recipient, texts = std::move(texts)]() mutable {
+                bool delivered = false;
+                if (auto session = recipient.lock()) {
+                    for (auto& text : texts) {
+                        session->deliver(make_message(std::move(text)));
+                    }
+                    delivered = true;
+                }
+                submit([this, name = std::move(name), offset, delivered]{
+                    if (delivered) {
+                        store_->commit(name, offset);
+                    }
+                    auto it = draining_.find(name);
+                    // The recipient went away: stop, unless another login took the drain over.
+                    if (!delivered && it->second.recipient.expired()) {
+                        draining_.erase(it);
+                        return;
+                    }
+                    drain(name);
+                });
+            });
+        }
+        void run() {
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            while (true) {
+                wakeup_.wait(lock, [this]{ return stopping_ || !tasks_.empty(); });
+                // Queued appends are finished before stopping, so no accepted message is lost.
+                if (tasks_.empty()) {
+                    return;
+                }
+                auto task = std::move(tasks_.front());
+                tasks_.pop_front();
+                lock.unlock();
+                task();
+                lock.lock();
+            }
+        }
+
+        // Messages handed to a session at a time while draining, one write of its writer.
+        static constexpr std::size_t batch = 64;
+        const InternTable& names_;
+        std::unique_ptr<MailStore> store_;
+        std::mutex directory_mutex_;
+        // Sessions of the online users by username id.
+        std::unordered_map<std::uint32_t, std::weak_ptr<Users>> online_;
+        // Rooms every user ever joined by username, only with a store.
+        std::unordered_map<std::string, std::unordered_set<std::string>> members_;
+        std::mutex queue_mutex_;
+        std::condition_variable wakeup_;
+        std::deque<std::function<void()>> tasks_;
+        /**
+         * @brief Mailbox being delivered to a session, owned by the disk thread.
+         */
+        struct Drain {
+            std::weak_ptr<Users> recipient;
+            Post post;
+        };
+        // Mailboxes being delivered by username, a batch of each is in flight at a time.
+        std::unordered_map<std::string, Drain> draining_;
+        bool stopping_ = false;
+        std::thread thread_;
+};
@@ -2,76 +2,672 @@
 #include <boost/asio/awaitable.hpp>
 #include <boost/asio/co_spawn.hpp>
 #include <boost/asio/detached.hpp>
+#include <algorithm>
+#include <array>
 #include <iostream>
-#include <set>
 #include <deque>
+#include <iomanip>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "admin_server.hpp"
+#include "bench.hpp"
+#include "handoff.hpp"
+#include "message.hpp"
+#include "metrics_server.hpp"
+#include "mpsc_queue.hpp"
+#include "rate_limiter.hpp"
+#include "room_snapshot.hpp"
+#include "search_index.hpp"
+#include "server_context.hpp"
+#include "shard.hpp"
+#include "shm_ring.hpp"
+#include "trace.hpp"
+#include "users.hpp"
+#include "watchdog.hpp"
 
 using boost::asio::ip::tcp;
+// Connection of a session, over TCP or a Unix domain socket.
+using stream_socket = boost::asio::generic::stream_protocol::socket;
 using boost::asio::awaitable;
 using boost::asio::co_spawn;
 using boost::asio::detached;
 using boost::asio::use_awaitable;
 
 /**
- * @brief Interface for chat users.
+ * @brief A message as passed to the next process.
+ * @param message Message to pass on.
+ * @param names Interned names of this process.
  */
-class Users {
-    public:
-        Users() = default;
-        Users(const std::string& username) : username_(username) {}
-        /**
-         * @brief Send a message to users.
-         * @param msg Message to send.
-         */
-        virtual void deliver(const std::string& msg) = 0;
-        virtual ~Users() {}
-    private:
-        std::string username_;
-};
+HandoffMessage to_handoff(const Message& message, const InternTable& names) {
+    return {message.seq, std::string(names.name(message.sender.id())), message.sent_ms, message.text};
+}
+/**
+ * @brief Rebuild a message kept in a snapshot.
+ * @param message Message in the snapshot.
+ * @param room Index of its room.
+ * @param context State of the shard that serves it.
+ */
+MessagePtr from_snapshot(const RoomSnapshot::MessageView& message, std::size_t room, ServerContext& context) {
+    if (message.sender.empty()) {
+        return make_message(std::string(message.text));
+    }
+    auto rebuilt = std::make_shared<Message>();
+    rebuilt->text = message.text;
+    rebuilt->seq = message.seq;
+    rebuilt->sender = context.names->acquire(message.sender);
+    rebuilt->room = static_cast<std::uint32_t>(room);
+    rebuilt->sent_ms = message.sent_ms;
+    if (context.compressor) {
+        rebuilt->compressed = context.compressor->compress(rebuilt->text);
+    }
+    return rebuilt;
+}
 /**
- * @brief Class for chat room.
+ * @brief Rebuild a message passed on by the previous process.
+ * @param message Message as passed on.
+ * @param room Index of its room.
+ * @param context State of the shard that serves it.
  */
-class ChatRoom {
+MessagePtr from_handoff(const HandoffMessage& message, std::size_t room, ServerContext& context) {
+    return from_snapshot({message.seq, message.sent_ms, message.sender, message.text}, room, context);
+}
+/**
+ * @brief Replica of a chat room on one shard.
+ * Every room has a home shard that owns its history and orders its messages. Replicas on
+ * other shards hold only their local members: they forward local messages to the home shard
+ * and receive each message back once, however many local members they have.
+ * Rooms above the fan-out threshold deliver each message in slices of members and
+ * yield to the event loop between slices. Broadcasts are fanned out strictly one batch
+ * after another, so every member receives them in order.
+ */
+class ChatRoom : public ShardRoom, public CachedRoom {
     public:
-        ChatRoom() = default;
+        /**
+         * @brief Constructor for chat room.
+         * @param shard Shard owning this replica.
+         * @param id Index of the room, the same on every shard.
+         * @param limit Rate limit shared by the senders of this replica.
+         */
+        ChatRoom(Shard& shard, std::size_t id, RateLimiter limit) :
+            shard_(shard), context_(shard.context()), id_(id), home_(id % shard.shard_count()), limit_(limit),
+            interested_(shard.shard_count(), false), max_recent_(shard.context().config.room_history) {
+            state_ = is_home() ? State::active : State::unsubscribed;
+            const ServerConfig& config = shard.context().config;
+            name_ = context_.names->name(context_.names->intern(std::to_string(config.ports[id_])));
+            if (is_home()) {
+                restore(context_.snapshot);
+                context_.metrics.rooms_loaded.add(1);
+                context_.room_cache.touch(this, std::chrono::steady_clock::now());
+            }
+        }
         /**
          * @brief Add a user to the chat room.
          * @param new_user New user to add.
+         * @param resume_after Last sequence number the user saw before reconnecting, if any.
          */
-        void join(std::shared_ptr<Users> new_user) {
-            users_.insert(new_user);
-            for (auto& message : recent_message_) {
-                new_user->deliver(message);
+        void join(std::shared_ptr<Users> new_user, std::optional<std::uint64_t> resume_after = std::nullopt) {
+            index_.emplace(new_user.get(), users_.size());
+            users_.push_back(new_user);
+            snapshot_.reset();
+            context_.metrics.room_members[id_].add(1);
+            if (is_home()) {
+                load_for_member();
             }
+            if (state_ != State::active) {
+                // The history arrives with the answer of the home shard.
+                waiting_.push_back({new_user, resume_after});
+                subscribe();
+                return;
+            }
+            replay(new_user, resume_after);
         }
         /**
          * @brief Remove a user from the chat room.
          * @param remove_user User to remove.
          */
         void leave(std::shared_ptr<Users> remove_user) {
-            users_.erase(remove_user);
+            auto it = index_.find(remove_user.get());
+            if (it == index_.end()) {
+                return;
+            }
+            // Leave a hole, positions must stay stable while a fan-out walks the members.
+            users_[it->second] = nullptr;
+            index_.erase(it);
+            snapshot_.reset();
+            context_.metrics.room_members[id_].add(-1);
+            std::erase_if(waiting_, [&](const auto& waiting) { return waiting.first == remove_user; });
+            compact();
+            if (is_home()) {
+                // Idle from now on if that was the last member.
+                context_.room_cache.touch(this, std::chrono::steady_clock::now());
+            }
+            if (index_.empty() && !is_home() && state_ != State::unsubscribed) {
+                state_ = State::unsubscribed;
+                recent_message_.clear();
+                shard_.send(home_, {ShardMail::Kind::unsubscribe, id_, 0, nullptr, {}, nullptr});
+            }
         }
         /**
          * @brief Deliver a message to all users.
          * @param message Message to deliver.
          */
-        void deliver(const std::string& message) {
+        void deliver(const MessagePtr& message) {
+            if (is_home()) {
+                publish(message);
+            } else {
+                shard_.send(home_, {ShardMail::Kind::publish, id_, 0, message, {}, nullptr});
+            }
+        }
+        /**
+         * @brief Let a message into the room if the room rate limit of this shard allows it now.
+         * Checks and takes the tokens in one step, so readers cannot all pass on the same tokens.
+         * @param bytes Message size.
+         * @param now Current time.
+         * @return std::chrono::steady_clock::duration Zero if the message passed, otherwise the time to wait.
+         */
+        std::chrono::steady_clock::duration admit(std::size_t bytes, std::chrono::steady_clock::time_point now) {
+            return limit_.acquire(bytes, now);
+        }
+        /**
+         * @brief Answer "/search <terms>" with the newest room messages containing every term.
+         * The index lives on the home shard, which delivers the answer to the user directly.
+         * @param query Search terms.
+         * @param user User that asked.
+         */
+        void search(std::string query, std::shared_ptr<Users> user) {
+            if (!is_home()) {
+                shard_.send(home_, {ShardMail::Kind::search, id_, 0, make_message(std::move(query)), {}, std::move(user)});
+                return;
+            }
+            if (context_.config.index_dir.empty()) {
+                user->deliver(make_message("Search is disabled"));
+                return;
+            }
+            load();
+            auto matches = search_index_->search(query, search_results);
+            std::string answer = matches.empty() ? "No messages match \"" + query + "\""
+                                                 : "Newest messages matching \"" + query + "\":";
+            for (auto& match : matches) {
+                // Its own prefix: a result is not a room message and does not move the client's resume point.
+                answer += "\n?" + std::to_string(match.seq) + ' ' + match.text;
+            }
+            user->deliver(make_message(std::move(answer)));
+        }
+        std::size_t id() const {
+            return id_;
+        }
+        /**
+         * @brief Name of the room, its port.
+         */
+        std::string_view name() const {
+            return name_;
+        }
+        bool is_home() const {
+            return home_ == shard_.id();
+        }
+        /**
+         * @brief Number of members on this shard.
+         */
+        std::size_t members() const {
+            return index_.size();
+        }
+        std::size_t history_size() const {
+            return recent_message_.size();
+        }
+        /**
+         * @brief Home shard only: the room's history and search index are on disk, not in memory.
+         */
+        bool evicted() const {
+            return evicted_;
+        }
+        std::size_t history_limit() const {
+            return max_recent_;
+        }
+        /**
+         * @brief Change how many recent messages are kept for new members.
+         * @param limit Messages to keep.
+         */
+        void resize_history(std::size_t limit) {
+            max_recent_ = limit;
+            trim_history();
+        }
+        /**
+         * @brief Home shard only: the room's sequence counter and history for the next process.
+         * The search index is written to disk first, so that the next process maps all of it.
+         */
+        HandoffRoom hand_off() {
+            load();
+            if (search_index_) {
+                search_index_->flush();
+            }
+            HandoffRoom room{context_.config.ports[id_], last_seq_, {}};
+            for (auto& message : recent_message_) {
+                room.history.push_back(to_handoff(*message, *context_.names));
+            }
+            return room;
+        }
+        /**
+         * @brief Home shard only: the room's state for a snapshot.
+         * @param flush Write the search index out first, so that the snapshot lists all of it.
+         * @return RoomState Sequence counter, history and search index segments.
+         */
+        RoomState save(bool flush) {
+            if (search_index_ && flush) {
+                search_index_->flush();
+            }
+            RoomState state{std::string(name_), last_seq_, {}, {}, {}};
+            if (evicted_) {
+                // Read by the snapshot writer, not by this event loop.
+                state.file = room_cache_path(context_.config, id_);
+                return state;
+            }
+            if (search_index_) {
+                state.index_roots = search_index_->roots();
+            }
+            for (auto& message : recent_message_) {
+                state.history.push_back(to_handoff(*message, *context_.names));
+            }
+            return state;
+        }
+        /**
+         * @brief Home shard only: continue the sequence and history of the previous process.
+         * Must be called before the shards run.
+         * @param room State passed on by the previous process.
+         */
+        void take_over(const HandoffRoom& room) {
+            last_seq_ = std::max(last_seq_, room.last_seq);
+            recent_message_.clear();
+            for (auto& message : room.history) {
+                recent_message_.push_back(from_handoff(message, id_, context_));
+            }
+            trim_history();
+        }
+        /**
+         * @brief Handle mail from the other replicas of this room.
+         * @param mail Mail to handle.
+         */
+        void on_mail(ShardMail& mail) override {
+            switch (mail.kind) {
+                case ShardMail::Kind::publish:
+                    publish(mail.message);
+                    break;
+                case ShardMail::Kind::subscribe:
+                    load_for_member();
+                    interested_[mail.from] = true;
+                    shard_.send(mail.from, {ShardMail::Kind::history, id_, 0, nullptr,
+                                            std::vector<MessagePtr>(recent_message_.begin(), recent_message_.end()), nullptr});
+                    break;
+                case ShardMail::Kind::unsubscribe:
+                    interested_[mail.from] = false;
+                    break;
+                case ShardMail::Kind::search:
+                    search(mail.message->text, std::move(mail.user));
+                    break;
+                case ShardMail::Kind::broadcast:
+                    // Broadcasts sent before the current subscription are part of the history that answers it.
+                    if (state_ == State::active) {
+                        remember(mail.message);
+                        fan_out_local(mail.message);
+                    }
+                    break;
+                case ShardMail::Kind::history:
+                    if (--subscriptions_ == 0 && state_ == State::subscribing) {
+                        state_ = State::active;
+                        recent_message_.assign(mail.history.begin(), mail.history.end());
+                        if (!recent_message_.empty()) {
+                            last_seq_ = std::max(last_seq_, recent_message_.back()->seq);
+                        }
+                        for (auto& [user, resume_after] : waiting_) {
+                            replay(user, resume_after);
+                        }
+                        waiting_.clear();
+                    }
+                    break;
+            }
+        }
+
+        /**
+         * @brief Home shard only: write an idle room out to its room cache file and free its history and index.
+         * The sequence counter stays in memory. The file is written like a one-room snapshot.
+         * @return bool False if the room has members anywhere or work in flight.
+         */
+        bool evict() override {
+            if (evicted_ || !index_.empty() || !waiting_.empty() || fanning_out_ || !pending_.empty() ||
+                std::find(interested_.begin(), interested_.end(), true) != interested_.end()) {
+                return false;
+            }
+            std::vector<RoomState> state = {save(true)};
+            std::string path = room_cache_path(context_.config, id_);
+            if (!RoomSnapshot::write(path, state)) {
+                std::cerr << "Cannot write room " << name_ << " to " << path << ", keeping it loaded" << std::endl;
+                return false;
+            }
+            std::deque<MessagePtr>().swap(recent_message_);
+            search_index_.reset();
+            std::vector<std::shared_ptr<Users>>().swap(users_);
+            std::unordered_map<Users*, std::size_t>().swap(index_);
+            snapshot_.reset();
+            evicted_ = true;
+            context_.metrics.room_evictions.add();
+            context_.metrics.rooms_loaded.add(-1);
+            return true;
+        }
+
+    private:
+        enum class State {
+            // No local members, the home shard sends nothing.
+            unsubscribed,
+            // Waiting for the history from the home shard.
+            subscribing,
+            // Receiving every message of the room.
+            active,
+        };
+        /**
+         * @brief Home shard only: build the search index and history, from a snapshot if the room is in one.
+         * @param snapshot Startup snapshot or the room's cache file, may be null.
+         */
+        void restore(const RoomSnapshot* snapshot) {
+            std::optional<std::size_t> saved;
+            if (snapshot) {
+                saved = snapshot->find(name_);
+            }
+            const ServerConfig& config = context_.config;
+            if (!config.index_dir.empty()) {
+                std::string dir = config.index_dir + "/" + std::string(name_);
+                search_index_ = saved ? std::make_unique<RoomIndex>(dir, config.index_segment_size, snapshot->index_roots(*saved),
+                                                                    context_.index_writer)
+                                      : std::make_unique<RoomIndex>(dir, config.index_segment_size, context_.index_writer);
+                // Sequence numbers continue after the indexed messages, they identify them in results.
+                last_seq_ = std::max(last_seq_, search_index_->last_seq());
+            }
+            if (saved) {
+                last_seq_ = std::max(last_seq_, snapshot->last_seq(*saved));
+                snapshot->for_each_message(*saved, [this](const RoomSnapshot::MessageView& message) {
+                    recent_message_.push_back(from_snapshot(message, id_, context_));
+                });
+                trim_history();
+            }
+        }
+        /**
+         * @brief Home shard only: make sure the history and search index are in memory, loading an evicted room.
+         * @return bool True if the room was evicted and had to be read from its file.
+         */
+        bool load() {
+            auto now = std::chrono::steady_clock::now();
+            if (!evicted_) {
+                if (context_.room_cache.enabled()) {
+                    context_.room_cache.touch(this, now);
+                }
+                return false;
+            }
+            std::string path = room_cache_path(context_.config, id_);
+            auto file = RoomSnapshot::open(path);
+            if (!file || !file->find(name_)) {
+                std::cerr << "Cannot read room " << name_ << " from " << path << ", its history is lost" << std::endl;
+            }
+            restore(file.get());
+            evicted_ = false;
+            context_.metrics.rooms_loaded.add(1);
+            context_.metrics.room_load.record(static_cast<std::uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - now).count()));
+            context_.room_cache.touch(this, now);
+            return true;
+        }
+        /**
+         * @brief Home shard only: load the room for a member joining it on any shard.
+         * The one lookup counted as a cache hit or miss, the other uses of the room only keep it recent.
+         */
+        void load_for_member() {
+            if (load()) {
+                context_.metrics.room_cache_misses.add();
+            } else if (context_.room_cache.enabled()) {
+                context_.metrics.room_cache_hits.add();
+            }
+        }
+        /**
+         * @brief Ask the home shard for the room's messages.
+         */
+        void subscribe() {
+            if (state_ == State::unsubscribed) {
+                state_ = State::subscribing;
+                ++subscriptions_;
+                shard_.send(home_, {ShardMail::Kind::subscribe, id_, 0, nullptr, {}, nullptr});
+            }
+        }
+        /**
+         * @brief Home shard only: append a message to the history and send it to every interested shard.
+         * @param message Message to publish.
+         */
+        void publish(const MessagePtr& message) {
+            load();
+            // Nobody else holds a message before it is published, so it is stamped in place.
+            auto stamped = std::const_pointer_cast<Message>(message);
+            stamped->seq = ++last_seq_;
+            if (context_.compressor) {
+                // Compressed once here, every compressing session of every shard writes the same bytes.
+                stamped->compressed = context_.compressor->compress(message->text);
+            }
+            remember(message);
+            if (search_index_) {
+                // Indexed with the sender's name, so that it can be searched for and results show it.
+                search_index_->add(message->seq, "[" + std::string(context_.names->name(message->sender.id())) + "] " + message->text);
+            }
+            for (std::size_t shard = 0; shard < interested_.size(); ++shard) {
+                if (interested_[shard]) {
+                    shard_.send(shard, {ShardMail::Kind::broadcast, id_, 0, message, {}, nullptr});
+                }
+            }
+            fan_out_local(message);
+        }
+        /**
+         * @brief Keep a message in the recent history.
+         */
+        void remember(const MessagePtr& message) {
             recent_message_.emplace_back(message);
-            
-            // Keep only the last max_recent_ messages
+            last_seq_ = std::max(last_seq_, message->seq);
+            trim_history();
+        }
+        /**
+         * @brief Keep only the last max_recent_ messages.
+         */
+        void trim_history() {
             while (recent_message_.size() > max_recent_) {
                 recent_message_.pop_front();
             }
-
-            for (auto user : users_) {
-                user->deliver(message);
+        }
+        /**
+         * @brief Send the recent history to a new member.
+         * A resuming member gets only the messages after the one it saw last. If some of them are
+         * no longer in the history, or the number is unknown to the room, it gets RESYNC and the
+         * whole history instead.
+         * @param user New member.
+         * @param resume_after Last sequence number the member saw, if it resumes.
+         */
+        void replay(const std::shared_ptr<Users>& user, std::optional<std::uint64_t> resume_after) {
+            // Messages still waiting for fan-out reach the new user through it, not through the replay.
+            std::size_t waiting = std::min(pending_.size(), recent_message_.size());
+            std::size_t begin = 0;
+            if (resume_after) {
+                std::uint64_t oldest = recent_message_.empty() ? last_seq_ + 1 : recent_message_.front()->seq;
+                if (*resume_after + 1 < oldest || *resume_after > last_seq_) {
+                    user->deliver(make_message("RESYNC"));
+                } else {
+                    auto seen = std::partition_point(recent_message_.begin(), recent_message_.end(),
+                        [&](const MessagePtr& message) { return message->seq <= *resume_after; });
+                    begin = static_cast<std::size_t>(seen - recent_message_.begin());
+                }
+            }
+            if (begin + waiting < recent_message_.size()) {
+                user->deliver_history(std::vector<MessagePtr>(recent_message_.begin() + static_cast<std::ptrdiff_t>(begin),
+                                                              recent_message_.end() - static_cast<std::ptrdiff_t>(waiting)));
+            }
+        }
+        /**
+         * @brief Deliver a message to the members on this shard.
+         */
+        void fan_out_local(const MessagePtr& message) {
+            if (fanning_out_ || index_.size() >= context_.config.fanout_threshold) {
+                pending_.push_back(message);
+                if (!fanning_out_) {
+                    fanning_out_ = true;
+                    if (context_.fanout_pool) {
+                        dispatch();
+                    } else {
+                        co_spawn(shard_.io_context(), fan_out(), detached);
+                    }
+                }
+                return;
+            }
+            TraceSpan span("fan-out", message->trace_id);
+            auto started = std::chrono::steady_clock::now();
+            for (auto& user : users_) {
+                if (user) {
+                    user->deliver(message);
+                }
+            }
+            span.end();
+            record_stall(std::chrono::steady_clock::now() - started);
+        }
+        /**
+         * @brief Coroutine fanning queued broadcasts out slice by slice.
+         * Members that join meanwhile are past the end of the current batch and got it from the replay.
+         * @return Awaitable<void>
+         */
+        awaitable<void> fan_out() {
+            const std::size_t slice = std::max<std::size_t>(context_.config.fanout_slice, 1);
+            while (!pending_.empty()) {
+                std::vector<MessagePtr> batch(pending_.begin(), pending_.end());
+                pending_.clear();
+                const std::size_t end = users_.size();
+                for (std::size_t begin = 0; begin < end; begin += slice) {
+                    TraceSpan span("fan-out", batch);
+                    auto started = std::chrono::steady_clock::now();
+                    for (std::size_t i = begin; i < std::min(end, begin + slice); ++i) {
+                        if (!users_[i]) {
+                            continue;
+                        }
+                        for (auto& message : batch) {
+                            users_[i]->deliver(message);
+                        }
+                    }
+                    span.end();
+                    record_stall(std::chrono::steady_clock::now() - started);
+                    context_.metrics.fanout_slices.add();
+                    co_await boost::asio::post(shard_.io_context(), use_awaitable);
+                }
+            }
+            fanning_out_ = false;
+            compact();
+        }
+        /**
+         * @brief Hand the queued broadcasts to the fan-out pool, one task per slice of members.
+         * Tasks of a room go to the same worker and are stolen by idle ones. The next batch is
+         * dispatched only after every task of this one finished, which keeps each member's order.
+         */
+        void dispatch() {
+            if (pending_.empty()) {
+                fanning_out_ = false;
+                compact();
+                return;
+            }
+            auto batch = std::make_shared<const std::vector<MessagePtr>>(pending_.begin(), pending_.end());
+            pending_.clear();
+            auto members = snapshot();
+            const std::size_t slice = std::max<std::size_t>(context_.config.fanout_slice, 1);
+            const std::size_t tasks = (members->size() + slice - 1) / slice;
+            if (tasks == 0) {
+                dispatch();
+                return;
+            }
+            auto remaining = std::make_shared<std::atomic<std::size_t>>(tasks);
+            for (std::size_t begin = 0; begin < members->size(); begin += slice) {
+                std::size_t end = std::min(members->size(), begin + slice);
+                context_.fanout_pool->submit([this, members, batch, remaining, begin, end]{
+                    TraceSpan span("fan-out", *batch);
+                    for (std::size_t i = begin; i < end; ++i) {
+                        for (auto& message : *batch) {
+                            (*members)[i]->deliver(message);
+                        }
+                    }
+                    span.end();
+                    if (remaining->fetch_sub(1) == 1) {
+                        boost::asio::post(shard_.io_context(), [this]{ dispatch(); });
+                    }
+                }, id_);
+            }
+            context_.metrics.fanout_slices.add(tasks);
+        }
+        /**
+         * @brief Immutable copy of the members for the fan-out pool, rebuilt after membership changes.
+         */
+        std::shared_ptr<const std::vector<std::shared_ptr<Users>>> snapshot() {
+            if (!snapshot_) {
+                auto members = std::make_shared<std::vector<std::shared_ptr<Users>>>();
+                members->reserve(index_.size());
+                for (auto& user : users_) {
+                    if (user) {
+                        members->push_back(user);
+                    }
+                }
+                snapshot_ = std::move(members);
             }
+            return snapshot_;
+        }
+        /**
+         * @brief Drop the holes left by departed users once they make up half of the members.
+         */
+        void compact() {
+            if (fanning_out_ || index_.size() * 2 > users_.size()) {
+                return;
+            }
+            std::erase(users_, nullptr);
+            for (std::size_t i = 0; i < users_.size(); ++i) {
+                index_[users_[i].get()] = i;
+            }
+        }
+        /**
+         * @brief Remember the longest time the event loop was blocked by fan-out.
+         */
+        void record_stall(std::chrono::steady_clock::duration stall) {
+            context_.metrics.fanout_max_stall_ns.raise(std::chrono::nanoseconds(stall).count());
         }
 
-    private:
-        std::set<std::shared_ptr<Users>> users_;
-        std::deque<std::string> recent_message_;
-        const int max_recent_ = 10;
+        // Matches returned by one search.
+        static constexpr std::size_t search_results = 20;
+        Shard& shard_;
+        ServerContext& context_;
+        std::size_t id_;
+        std::string_view name_;
+        std::size_t home_;
+        RateLimiter limit_;
+        // Members in join order, nullptr marks a user that left.
+        std::vector<std::shared_ptr<Users>> users_;
+        std::unordered_map<Users*, std::size_t> index_;
+        // Members as seen by the fan-out pool tasks.
+        std::shared_ptr<const std::vector<std::shared_ptr<Users>>> snapshot_;
+        // Members that joined before the history arrived from the home shard, with their resume point.
+        std::vector<std::pair<std::shared_ptr<Users>, std::optional<std::uint64_t>>> waiting_;
+        std::deque<MessagePtr> recent_message_;
+        // Broadcasts not yet handed to the sliced fan-out.
+        std::deque<MessagePtr> pending_;
+        // Home shard only: shards with members in this room.
+        std::vector<bool> interested_;
+        State state_;
+        // Subscribe requests whose history has not arrived yet.
+        std::size_t subscriptions_ = 0;
+        bool fanning_out_ = false;
+        std::size_t max_recent_;
+        // Sequence number of the newest message of the room seen by this replica.
+        std::uint64_t last_seq_ = 0;
+        // Home shard only: inverted index of every message of the room, if search is enabled.
+        std::unique_ptr<RoomIndex> search_index_;
+        // Home shard only: history and index were written to the room cache file and freed.
+        bool evicted_ = false;
 };
 /**
  * @brief Chat session for a single user.
@@ -82,40 +678,176 @@ class ChatSession : public Users, public std::enable_shared_from_this<ChatSessio
          * @brief Constructor for chat session.
          * @param socket TCP socket.
          * @param room Chat room.
+         * @param user Interned id of the name received in the handshake.
+         * @param context State shared with the other sessions of the event loop.
+         * @param pending Bytes that arrived together with the handshake.
+         * @param resume_after Last sequence number the client saw before reconnecting, if any.
+         * @param compress The client negotiated compressed payloads.
          */
-        ChatSession(tcp::socket socket, ChatRoom& room, std::string username) :
-            socket_(std::move(socket)), timer_(socket_.get_executor()), room_(room), username_(username) {
+        ChatSession(stream_socket socket, ChatRoom& room, NameRef user, ServerContext& context, std::string pending = {},
+                    std::optional<std::uint64_t> resume_after = std::nullopt, bool compress = false) :
+            socket_(std::move(socket)), timer_(socket_.get_executor()), room_(room), resume_after_(resume_after), compress_(compress),
+            user_(std::move(user)),
+            context_(context),
+            limit_(context.config.session_messages_per_sec, context.config.session_bytes_per_sec, context.config.rate_burst) {
+            last_activity_ = last_read_ = last_message_ = std::chrono::steady_clock::now();
+            if (!pending.empty()) {
+                read_message_ = std::move(pending);
+                reading_ = true;
+                hibernated_ = false;
+            }
             timer_.expires_at(std::chrono::steady_clock::time_point::max());
         }
+        ~ChatSession() {
+            if (!stopped_) {
+                unregister();
+            }
+            context_.metrics.dropped_messages.add(queued_.load(std::memory_order_relaxed) + batch_.size());
+            if (!hibernated_) {
+                context_.buffers.release(std::move(read_message_));
+            }
+        }
         /**
          * @brief Start the chat session.
+         * @param welcome Greet the user, not done for a session taken over from the previous process.
          */
-        void start() {
-            room_.join(shared_from_this());
-            deliver("Welcome to the chat, " + username_ + "!");
+        void start(bool welcome = true) {
+            id_ = context_.next_session_id();
+            context_.sessions.emplace(id_, this);
+            joined_ = std::chrono::steady_clock::now();
+            context_.metrics.connections.add(1);
+            room_.join(shared_from_this(), resume_after_);
+            if (welcome) {
+                deliver("Welcome to the chat, " + std::string(username()) + "!");
+            }
+            if (context_.mailboxes) {
+                context_.mailboxes->connect(user_.id(), room_.name(), shared_from_this(), [executor = socket_.get_executor()](std::function<void()> task) {
+                    boost::asio::post(executor, std::move(task));
+                });
+            }
             co_spawn(socket_.get_executor(), [sft = shared_from_this()]{return sft->reader();}, detached);
             co_spawn(socket_.get_executor(), [sft = shared_from_this()]{return sft->writer();}, detached);
+            if (ring_) {
+                co_spawn(socket_.get_executor(), [sft = shared_from_this()]{return sft->ring_reader();}, detached);
+            }
+            arm_housekeeping();
         }
-         /**
-         * @brief Cancel the current asynchronous operation.
+        /**
+         * @brief Stop serving the connection and pass it on to the next process, for a hot restart.
+         * A write in progress is finished first, so the client never gets half a frame, and the
+         * reader is stopped between reads, so the input it buffered is exact. The session then
+         * stops without closing the connection: the state holds a duplicate of the socket.
+         * Sessions with a shared ring are closed instead, their publishers reconnect.
+         * @param done Receives the state on the session's shard, with fd -1 if there is nothing to pass on.
          */
-        void cancel() {
-            boost::system::error_code ec;
-            // Cancels one asynchronous operation that is waiting on the timer.
-            std::size_t num_cancelled = timer_.cancel_one(ec);
-            if (ec) {
-                std::cout << "Cancel error: " << ec.message() << std::endl;
-            } else {
-                std::cout << "Number of cancelled operations: " << num_cancelled << std::endl;
+        void hand_off(std::function<void(HandoffSession)> done) {
+            handoff_ = std::move(done);
+            handing_off_ = true;
+            // Wakes a sleeping writer; a busy one sees the request after its write.
+            timer_.cancel();
+        }
+        /**
+         * @brief Take the messages of this user from a shared ring as well as from the socket.
+         * Must be called before start().
+         * @param ring Ring created in the handshake.
+         */
+        void attach(std::unique_ptr<ShmRing> ring) {
+            int fd = ::dup(ring->event_fd());
+            if (fd < 0) {
+                throw std::system_error(errno, std::generic_category(), "Cannot watch a shared ring");
             }
+            ring_wakeup_.emplace(socket_.get_executor(), fd);
+            ring_ = std::move(ring);
         }
         /**
-         * @brief Deliver a message to this user.
+         * @brief Wake the writer waiting on the timer.
+         */
+        void cancel() {
+            boost::system::error_code ignored;
+            timer_.cancel_one(ignored);
+        }
+        /**
+         * @brief Deliver a message to this user, callable from any thread.
          * @param message Message to deliver.
          */
-        void deliver(const std::string& message) {
-            write_message_.push_back(message);
-            cancel();
+        void deliver(const MessagePtr& message) override {
+            TraceSpan span("enqueue", message->trace_id);
+            queued_.fetch_add(1, std::memory_order_relaxed);
+            write_message_.push(message);
+            // Only the producer that finds the writer asleep wakes it, on the session's own thread.
+            if (writer_sleeping_.exchange(false)) {
+                boost::asio::post(socket_.get_executor(), [sft = shared_from_this()]{ sft->cancel(); });
+            }
+        }
+        /**
+         * @brief Deliver replayed history, as one compressed bundle to a compressing connection.
+         * @param messages Messages in order.
+         */
+        void deliver_history(std::vector<MessagePtr> messages) override {
+            const std::size_t threshold = context_.config.bulk_threshold;
+            if (!compress_ || threshold == 0 || messages.size() < threshold) {
+                Users::deliver_history(std::move(messages));
+                return;
+            }
+            auto bundle = std::make_shared<Message>();
+            bundle->bundle = std::move(messages);
+            deliver(bundle);
+        }
+        /**
+         * @brief Deliver a server notice to this user only.
+         * @param text Notice text.
+         */
+        void deliver(std::string text) {
+            deliver(make_message(std::move(text)));
+        }
+        /**
+         * @brief Name of the user, valid as long as the server runs.
+         */
+        std::string_view username() const {
+            return context_.names->name(user_.id());
+        }
+        /**
+         * @brief State of a session shown by the admin console.
+         */
+        struct Stats {
+            std::uint64_t id;
+            std::string_view username;
+            std::size_t room;
+            std::chrono::steady_clock::duration age;
+            // Messages waiting in the inbox or the current batch.
+            std::size_t queued;
+            std::uint64_t messages_in;
+            std::uint64_t bytes_in;
+            std::uint64_t messages_out;
+            std::uint64_t bytes_out;
+            double messages_per_sec_limit;
+            double bytes_per_sec_limit;
+            bool throttled;
+        };
+        /**
+         * @brief Take a snapshot of the session, must be called on its shard.
+         * @param now Current time.
+         */
+        Stats stats(std::chrono::steady_clock::time_point now) const {
+            return {id_, username(), room_.id(), now - joined_,
+                    queued_.load(std::memory_order_relaxed) + batch_.size(),
+                    messages_in_, bytes_in_, messages_out_, bytes_out_,
+                    limit_.messages_per_sec(), limit_.bytes_per_sec(), throttled_};
+        }
+        /**
+         * @brief Disconnect the session on behalf of the admin console.
+         */
+        void kick() {
+            std::cerr << "Kicked: " << username() << std::endl;
+            stop();
+        }
+        /**
+         * @brief Replace the rate limit of this session.
+         * @param messages_per_sec Message rate, 0 is unlimited.
+         * @param bytes_per_sec Byte rate, 0 is unlimited.
+         */
+        void throttle(double messages_per_sec, double bytes_per_sec) {
+            limit_ = RateLimiter(messages_per_sec, bytes_per_sec, context_.config.rate_burst);
         }
     private:
         /**
@@ -124,18 +856,259 @@ class ChatSession : public Users, public std::enable_shared_from_this<ChatSessio
          */
         awaitable<void> reader() {
             try {
-                std::string read_message;
-                while(true) {
-                    size_t n = co_await boost::asio::async_read_until(socket_, boost::asio::dynamic_buffer(read_message, 1024), "\n", use_awaitable);
-                    room_.deliver(read_message.substr(0, n));
-                    read_message.erase(0, n);
+                // Messages handled since the reader last gave other handlers a turn.
+                std::size_t handled = 0;
+                const std::size_t budget = context_.config.reader_budget;
+                while(!handing_off_) {
+                    if (read_message_.empty()) {
+                        // Wait for data without a buffer, so that the session may hibernate meanwhile.
+                        reading_ = false;
+                        handled = 0;
+                        co_await socket_.async_wait(stream_socket::wait_read, use_awaitable);
+                        wake();
+                    }
+                    TraceSpan read_span("read");
+                    size_t n = co_await boost::asio::async_read_until(socket_, boost::asio::dynamic_buffer(read_message_, context_.config.max_message_size), "\n", use_awaitable);
+                    last_activity_ = last_read_ = std::chrono::steady_clock::now();
+                    ping_sent_ = false;
+                    // Lines may end in CRLF, a client answering "PONG\r\n" is alive all the same.
+                    if (message_body(std::string_view(read_message_).substr(0, n)) != "PONG") {
+                        if (!co_await throttle(n, message_body(std::string_view(read_message_).substr(0, n)))) {
+                            break;
+                        }
+                        std::uint64_t trace_id = trace_sample();
+                        read_span.end(trace_id);
+                        handle(message_body(std::string_view(read_message_).substr(0, n)), n, trace_id);
+                    }
+                    read_message_.erase(0, n);
+                    if (budget > 0 && ++handled >= budget && !read_message_.empty()) {
+                        // More input is already buffered: let the other sessions run first.
+                        handled = 0;
+                        context_.metrics.reader_yields.add();
+                        co_await boost::asio::post(socket_.get_executor(), use_awaitable);
+                    }
                 }
             } catch (boost::system::system_error& e) {
-                std::cerr << "Async read error: " << e.what() << std::endl;
-                stop();
+                if (!handing_off_) {
+                    std::cerr << "Async read error: " << e.what() << std::endl;
+                    stop();
+                }
             }catch (std::exception&) {
+                if (!handing_off_) {
+                    stop();
+                }
+            }
+            if (handing_off_) {
+                reader_done_ = true;
+                if (writer_done_) {
+                    finish_hand_off();
+                }
+            }
+        }
+        /**
+         * @brief Pass the connection on once both the reader and the writer stopped.
+         */
+        void finish_hand_off() {
+            HandoffSession state;
+            if (!stopped_ && !ring_) {
+                state.fd = ::dup(socket_.native_handle());
+                state.port = context_.config.ports[room_.id()];
+                state.username = username();
+                state.pending = hibernated_ ? std::string() : read_message_;
+                state.compress = compress_;
+                state.dictionary = compress_ ? context_.compressor->id() : 0;
+                state.last_seq = last_seq_;
+                MessagePtr message;
+                while (write_message_.pop(message)) {
+                    queued_.fetch_sub(1, std::memory_order_relaxed);
+                    for (auto& queued : message->bundle.empty() ? std::vector<MessagePtr>{message} : message->bundle) {
+                        state.queued.push_back(to_handoff(*queued, *context_.names));
+                        state.last_seq = std::max(state.last_seq, queued->seq);
+                    }
+                }
+            }
+            auto done = std::move(handoff_);
+            stop();
+            done(std::move(state));
+        }
+        /**
+         * @brief Coroutine to read messages from the shared ring of a local publisher.
+         * Reads as long as the ring has messages and only waits on its eventfd once it is empty,
+         * so a busy publisher is served without a system call per message.
+         * @return Awaitable<void>
+         */
+        awaitable<void> ring_reader() {
+            try {
+                std::string scratch;
+                std::size_t handled = 0;
+                const std::size_t budget = context_.config.reader_budget;
+                while (socket_.is_open()) {
+                    std::string_view text;
+                    if (!ring_->front(text, scratch, context_.config.max_message_size)) {
+                        handled = 0;
+                        if (ring_->sleep()) {
+                            co_await ring_wakeup_->async_wait(boost::asio::posix::stream_descriptor::wait_read, use_awaitable);
+                            ring_->woken();
+                        }
+                        continue;
+                    }
+                    last_activity_ = last_read_ = std::chrono::steady_clock::now();
+                    if (!co_await throttle(text.size(), message_body(text))) {
+                        break;
+                    }
+                    std::uint64_t trace_id = trace_sample();
+                    TraceSpan read_span("read", trace_id);
+                    handle(message_body(text), text.size(), trace_id);
+                    ring_->pop();
+                    if (budget > 0 && ++handled >= budget) {
+                        handled = 0;
+                        context_.metrics.reader_yields.add();
+                        co_await boost::asio::post(socket_.get_executor(), use_awaitable);
+                    }
+                }
+            } catch (boost::system::system_error& e) {
+                if (e.code() != boost::asio::error::operation_aborted) {
+                    std::cerr << "Shared ring error: " << e.what() << std::endl;
+                }
                 stop();
+            } catch (std::exception& e) {
+                std::cerr << "Shared ring of " << username() << ": " << e.what() << std::endl;
+                stop();
+            }
+        }
+        /**
+         * @brief Act on a chat line: a command, or a message to the room.
+         * @param body Line without the line break.
+         * @param bytes Size of the line as received.
+         * @param trace_id Trace id if the message is sampled.
+         */
+        void handle(std::string_view body, std::size_t bytes, std::uint64_t trace_id) {
+            last_message_ = std::chrono::steady_clock::now();
+            context_.metrics.messages_in.add();
+            context_.metrics.bytes_in.add(bytes);
+            ++messages_in_;
+            bytes_in_ += bytes;
+            if (body.starts_with("/msg ")) {
+                direct_message(body.substr(5), trace_id);
+            } else if (body.starts_with("/search ")) {
+                room_.search(std::string(body.substr(8)), shared_from_this());
+            } else {
+                store_mentions(body);
+                room_.deliver(make_envelope(user_, static_cast<std::uint32_t>(room_.id()), std::string(body),
+                                            last_read_, trace_id));
+            }
+        }
+        /**
+         * @brief Whether handle() sends a line to the room rather than acting on a command.
+         */
+        static bool is_room_message(std::string_view body) {
+            return !body.starts_with("/msg ") && !body.starts_with("/search ");
+        }
+        /**
+         * @brief Text of a line without the line break.
+         */
+        static std::string_view message_body(std::string_view line) {
+            while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) {
+                line.remove_suffix(1);
+            }
+            return line;
+        }
+        /**
+         * @brief Send "/msg <user> <text>" to one user, through its mailbox if it is offline.
+         * @param command Everything after "/msg ".
+         * @param trace_id Trace id if the message is sampled.
+         */
+        void direct_message(std::string_view command, std::uint64_t trace_id) {
+            auto space = command.find(' ');
+            if (space == std::string_view::npos || space == 0 || !context_.mailboxes) {
+                deliver(context_.mailboxes ? "Usage: /msg <user> <text>" : "Direct messages are disabled");
+                return;
+            }
+            std::string to(command.substr(0, space));
+            auto message = make_message("[" + std::string(username()) + " -> " + to + "] " + std::string(command.substr(space + 1)),
+                                        last_read_, trace_id);
+            switch (context_.mailboxes->send(to, message)) {
+                case Mailboxes::Delivery::delivered:
+                    if (context_.names->find(to) != user_.id()) {
+                        deliver(message);
+                    }
+                    break;
+                case Mailboxes::Delivery::stored:
+                    deliver(to + " is offline, the message waits in their mailbox");
+                    break;
+                case Mailboxes::Delivery::offline:
+                    deliver(to + " is offline");
+                    break;
+            }
+        }
+        /**
+         * @brief Put a copy of a room message into the mailbox of every offline user it mentions as @name.
+         * @param body Message text.
+         */
+        void store_mentions(std::string_view body) {
+            if (!context_.mailboxes || !context_.mailboxes->persistent() || body.find('@') == std::string_view::npos) {
+                return;
+            }
+            std::vector<std::string_view> mentioned;
+            MessagePtr copy;
+            for (auto at = body.find('@'); at != std::string_view::npos; at = body.find('@', at + 1)) {
+                auto end = body.find_first_of(" \t,.:;!?()", at + 1);
+                std::string_view name = body.substr(at + 1, end == std::string_view::npos ? std::string_view::npos : end - at - 1);
+                if (name.empty() || name == username() || std::find(mentioned.begin(), mentioned.end(), name) != mentioned.end()) {
+                    continue;
+                }
+                mentioned.push_back(name);
+                if (!copy) {
+                    copy = make_message("[" + std::string(username()) + " in " + std::string(room_.name()) + "] " + std::string(body));
+                }
+                context_.mailboxes->mention(name, room_.name(), copy);
+            }
+        }
+        /**
+         * @brief Wait until the session rate limit, and the room's for a room message, let a line through.
+         * The reader stops reading meanwhile, so TCP backpressure slows the sender down.
+         * @param bytes Line size.
+         * @param body Line without the line break, commands do not use the room's limit.
+         * @return Awaitable<bool> False if the session was stopped while waiting.
+         */
+        awaitable<bool> throttle(std::size_t bytes, std::string_view body) {
+            const bool to_room = is_room_message(body);
+            auto now = std::chrono::steady_clock::now();
+            auto delay = admit(bytes, to_room, now);
+            if (delay > std::chrono::steady_clock::duration::zero()) {
+                Metrics& metrics = context_.metrics;
+                metrics.throttled_messages.add();
+                metrics.throttled_sessions.add(1);
+                throttled_ = true;
+                auto paused_at = now;
+                boost::asio::steady_timer pause(socket_.get_executor());
+                while (delay > std::chrono::steady_clock::duration::zero() && socket_.is_open()) {
+                    pause.expires_after(delay);
+                    co_await pause.async_wait(use_awaitable);
+                    now = std::chrono::steady_clock::now();
+                    delay = admit(bytes, to_room, now);
+                }
+                throttled_ = false;
+                metrics.throttled_sessions.add(-1);
+                metrics.throttled_ns.add(std::chrono::nanoseconds(now - paused_at).count());
+                last_read_ = now;
+            }
+            co_return socket_.is_open();
+        }
+        /**
+         * @brief Take the tokens of a line from the session's bucket and, for a room message, the room's.
+         * Nothing is taken unless every bucket involved lets the line through now.
+         * @return std::chrono::steady_clock::duration Zero if the line passed, otherwise the time to wait.
+         */
+        std::chrono::steady_clock::duration admit(std::size_t bytes, bool to_room, std::chrono::steady_clock::time_point now) {
+            auto delay = limit_.delay(bytes, now);
+            if (delay == std::chrono::steady_clock::duration::zero() && to_room) {
+                delay = room_.admit(bytes, now);
             }
+            if (delay == std::chrono::steady_clock::duration::zero()) {
+                limit_.consume(bytes);
+            }
+            return delay;
         }
         /**
          * @brief Coroutine to write messages to the socket.
@@ -144,15 +1117,38 @@ class ChatSession : public Users, public std::enable_shared_from_this<ChatSessio
         awaitable<void> writer() {
             try {
                 while (socket_.is_open()) {
-                   if (!write_message_.empty()) {
+                   if (handing_off_) {
+                        break;
+                   }
+                   take_batch();
+                   if (!batch_.empty()) {
+                        context_.metrics.record_queue_depth(batch_.size() + queued_.load(std::memory_order_relaxed));
                         /*------co_await-------
                         Унарный оператор, позволяющий, в общем случае, приостановить выполнение
                         сопрограммы и передать управление вызывающей стороне, пока не завершатся
                         вычисления представленные операндом
                         */
-                        co_await boost::asio::async_write(socket_, boost::asio::buffer(write_message_.front() + '\n'), use_awaitable);
-                        write_message_.pop_front();
+                        frame_batch();
+                        TraceSpan span("write", batch_);
+                        std::size_t bytes = co_await boost::asio::async_write(socket_, frames_, use_awaitable);
+                        span.end();
+                        context_.metrics.messages_out.add(batch_.size());
+                        context_.metrics.bytes_out.add(bytes);
+                        messages_out_ += batch_.size();
+                        bytes_out_ += bytes;
+                        record_latency();
+                        for (auto& message : batch_) {
+                            last_seq_ = std::max(last_seq_, message->bundle.empty() ? message->seq : message->bundle.back()->seq);
+                        }
+                        batch_.clear();
+                        last_activity_ = std::chrono::steady_clock::now();
                    } else {
+                        writer_sleeping_.store(true);
+                        // A message pushed before the flag was set would not wake us.
+                        if (!write_message_.empty()) {
+                            writer_sleeping_.store(false);
+                            continue;
+                        }
                         boost::system::error_code ec;
                         co_await timer_.async_wait(redirect_error(use_awaitable, ec));
                    }
@@ -160,67 +1156,1385 @@ class ChatSession : public Users, public std::enable_shared_from_this<ChatSessio
             } catch (std::exception&) {
                 stop();
             }
+            if (handing_off_) {
+                writer_done_ = true;
+                if (reader_done_) {
+                    finish_hand_off();
+                } else {
+                    // The writer is idle now, this only interrupts the reader.
+                    boost::system::error_code ignored;
+                    socket_.cancel(ignored);
+                }
+            }
         }
         /**
-         * @brief Stop the chat session.
+         * @brief Take a receive buffer from the pool when data arrives after hibernation.
          */
-        void stop() {
-            room_.leave(shared_from_this()); 
-            socket_.close();
+        void wake() {
+            reading_ = true;
+            if (hibernated_) {
+                read_message_ = context_.buffers.acquire();
+                hibernated_ = false;
+                arm_housekeeping();
+            }
+        }
+        /**
+         * @brief Move up to max_batch_ queued messages into the batch for one gather write.
+         */
+        void take_batch() {
+            MessagePtr message;
+            while (batch_.size() < max_batch_ && write_message_.pop(message)) {
+                batch_.push_back(std::move(message));
+            }
+            queued_.fetch_sub(batch_.size(), std::memory_order_relaxed);
+        }
+        /**
+         * @brief Build the gather buffers of the batch.
+         * Room messages start with "#<seq> <sender id> <time ms> ". On a compressing connection,
+         * a message with a compressed payload is "~<seq> <sender id> <time ms> <size>\n" followed
+         * by the payload bytes instead, and a history bundle is "Z<size>\n" followed by one zstd
+         * stream of the plain frames of its messages. The first message of every sender on this
+         * connection is preceded by a line "@<sender id> <username>".
+         */
+        void frame_batch() {
+            // All headers are written first: frames_ points into headers_, which must not reallocate afterwards.
+            headers_.clear();
+            header_ends_.clear();
+            bulks_.clear();
+            for (auto& message : batch_) {
+                if (!message->bundle.empty()) {
+                    bulks_.push_back(compress_bundle(*message));
+                    if (bulks_.back().second) {
+                        headers_ += 'Z';
+                        headers_ += std::to_string(bulks_.back().first.size());
+                        headers_ += '\n';
+                    }
+                } else if (message->sender) {
+                    frame_header(*message, headers_, packed(*message));
+                }
+                header_ends_.push_back(headers_.size());
+            }
+            frames_.clear();
+            std::size_t offset = 0;
+            std::size_t bulk = 0;
+            for (std::size_t i = 0; i < batch_.size(); ++i) {
+                const Message& message = *batch_[i];
+                if (header_ends_[i] > offset) {
+                    frames_.push_back(boost::asio::buffer(headers_.data() + offset, header_ends_[i] - offset));
+                    offset = header_ends_[i];
+                }
+                if (!message.bundle.empty()) {
+                    frames_.push_back(boost::asio::buffer(bulks_[bulk++].first));
+                } else if (packed(message)) {
+                    frames_.push_back(boost::asio::buffer(message.compressed));
+                    context_.metrics.compressed_messages.add();
+                    context_.metrics.compression_saved_bytes.add(message.text.size() - message.compressed.size());
+                } else {
+                    frames_.push_back(boost::asio::buffer(message.text));
+                    frames_.push_back(boost::asio::buffer("\n", 1));
+                }
+            }
+        }
+        /**
+         * @brief Append the header of a room message, after the announcement of a new sender.
+         * @param message Room message.
+         * @param out Headers being built.
+         * @param pack The message goes out with its compressed payload.
+         */
+        void frame_header(const Message& message, std::string& out, bool pack) {
+            std::uint32_t sender = message.sender.id();
+            // Announced again once the id stands for another name.
+            std::uint32_t generation = context_.names->generation(sender);
+            auto [announced, first] = announced_.try_emplace(sender, generation);
+            if (first || announced->second != generation) {
+                announced->second = generation;
+                out += '@';
+                out += std::to_string(sender);
+                out += ' ';
+                out += context_.names->name(sender);
+                out += '\n';
+            }
+            out += pack ? '~' : '#';
+            out += std::to_string(message.seq);
+            out += ' ';
+            out += std::to_string(sender);
+            out += ' ';
+            out += std::to_string(message.sent_ms);
+            out += ' ';
+            if (pack) {
+                out += std::to_string(message.compressed.size());
+                out += '\n';
+            }
+        }
+        /**
+         * @brief Frame the messages of a history bundle and compress them as one stream.
+         * @param bundle Bundle built by deliver_history().
+         * @return std::pair<std::string, bool> The bytes to write, and whether they are compressed;
+         * the plain frames if compression failed.
+         */
+        std::pair<std::string, bool> compress_bundle(const Message& bundle) {
+            std::string plain;
+            for (auto& message : bundle.bundle) {
+                if (message->sender) {
+                    frame_header(*message, plain, false);
+                }
+                plain += message->text;
+                plain += '\n';
+            }
+            std::string compressed = context_.compressor->compress_stream(plain);
+            if (compressed.empty()) {
+                return {std::move(plain), false};
+            }
+            context_.metrics.compressed_messages.add(bundle.bundle.size());
+            context_.metrics.compression_saved_bytes.add(plain.size() - compressed.size());
+            return {std::move(compressed), true};
+        }
+        /**
+         * @brief Whether a message goes out with its compressed payload on this connection.
+         */
+        bool packed(const Message& message) const {
+            return compress_ && message.sender && !message.compressed.empty();
+        }
+        /**
+         * @brief Record the delivery latency of every message of the batch just written.
+         * Notices and history replayed on join were read before the session began and are skipped.
+         */
+        void record_latency() {
+            auto now = std::chrono::steady_clock::now();
+            for (auto& message : batch_) {
+                if (message->received >= joined_) {
+                    context_.metrics.delivery_latency.record(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(now - message->received).count());
+                }
+            }
+        }
+        /**
+         * @brief Return the receive buffer to the pool and drop the send queue blocks
+         * while neither the reader nor the writer uses them.
+         */
+        void hibernate() {
+            if (hibernated_ || reading_ || !write_message_.empty() || !batch_.empty()) {
+                return;
+            }
+            context_.buffers.release(std::move(read_message_));
+            read_message_ = std::string();
+            std::vector<MessagePtr>().swap(batch_);
+            std::vector<boost::asio::const_buffer>().swap(frames_);
+            std::string().swap(headers_);
+            std::vector<std::size_t>().swap(header_ends_);
+            std::vector<std::pair<std::string, bool>>().swap(bulks_);
+            hibernated_ = true;
+        }
+        /**
+         * @brief Arm the wheel timer for the nearest heartbeat, idle or hibernation deadline.
+         * Activity in between only moves the deadlines, the timer re-arms itself lazily.
+         */
+        void arm_housekeeping() {
+            const ServerConfig& config = context_.config;
+            auto due = ping_sent_ ? ping_sent_at_ + config.heartbeat_timeout : last_read_ + config.heartbeat_interval;
+            if (config.idle_timeout.count() > 0) {
+                due = std::min(due, last_message_ + config.idle_timeout);
+            }
+            if (!hibernated_) {
+                due = std::min(due, last_activity_ + config.hibernate_after);
+            }
+            context_.wheel.schedule(housekeeping_, due - std::chrono::steady_clock::now(), [this]{ housekeeping(); });
+        }
+        /**
+         * @brief Wheel callback: evict dead or idle peers, send heartbeats and hibernate.
+         */
+        void housekeeping() {
+            const ServerConfig& config = context_.config;
+            auto now = std::chrono::steady_clock::now();
+            if (config.idle_timeout.count() > 0 && now - last_message_ >= config.idle_timeout) {
+                std::cerr << "Idle timeout: " << username() << std::endl;
+                stop();
+                return;
+            }
+            if (throttled_) {
+                // The reader is paused on purpose, an unanswered PING is expected.
+                ping_sent_ = false;
+                last_read_ = now;
+            }
+            if (ping_sent_ && now - ping_sent_at_ >= config.heartbeat_timeout) {
+                std::cerr << "Heartbeat timeout: " << username() << std::endl;
+                stop();
+                return;
+            }
+            if (!ping_sent_ && now - last_read_ >= config.heartbeat_interval) {
+                deliver("PING");
+                ping_sent_ = true;
+                ping_sent_at_ = now;
+            }
+            if (now - last_activity_ >= config.hibernate_after) {
+                hibernate();
+            }
+            arm_housekeeping();
+        }
+        /**
+         * @brief Stop the chat session.
+         */
+        void stop() {
+            if (stopped_) {
+                return;
+            }
+            stopped_ = true;
+            unregister();
+            if (context_.mailboxes) {
+                context_.mailboxes->disconnect(user_.id(), this);
+            }
+            context_.metrics.connections.add(-1);
+            housekeeping_.cancel();
+            room_.leave(shared_from_this()); 
+            socket_.close();
+            if (ring_wakeup_) {
+                boost::system::error_code ignored;
+                ring_wakeup_->close(ignored);
+            }
             timer_.cancel();
         }
-        tcp::socket socket_;
+        /**
+         * @brief Remove the session from the shard's table of open sessions.
+         */
+        void unregister() {
+            auto it = context_.sessions.find(id_);
+            if (it != context_.sessions.end() && it->second == this) {
+                context_.sessions.erase(it);
+            }
+        }
+        stream_socket socket_;
         boost::asio::steady_timer timer_;
         ChatRoom& room_;
-        std::deque<std::string> write_message_;
-        std::string username_;
+        std::optional<std::uint64_t> resume_after_;
+        bool compress_;
+        // Inbox filled by any thread, drained by the writer.
+        MpscQueue<MessagePtr> write_message_;
+        std::atomic<bool> writer_sleeping_{false};
+        // Messages in the inbox, approximate while producers are pushing.
+        std::atomic<std::size_t> queued_{0};
+        std::vector<MessagePtr> batch_;
+        std::vector<boost::asio::const_buffer> frames_;
+        // Envelope headers of the batch being written, and where the header of each message ends.
+        std::string headers_;
+        std::vector<std::size_t> header_ends_;
+        // Compressed history bundles of the batch being written.
+        std::vector<std::pair<std::string, bool>> bulks_;
+        // Senders whose username this connection has been told, with the generation of their id at the time.
+        std::unordered_map<std::uint32_t, std::uint32_t> announced_;
+        static constexpr std::size_t max_batch_ = 64;
+        // Shared ring of a local publisher and a duplicate of its eventfd to wait on, if any.
+        std::unique_ptr<ShmRing> ring_;
+        std::optional<boost::asio::posix::stream_descriptor> ring_wakeup_;
+        // Newest room message written to the client.
+        std::uint64_t last_seq_ = 0;
+        // Hot restart: receives the state once the reader and the writer both stopped.
+        std::function<void(HandoffSession)> handoff_;
+        bool handing_off_ = false;
+        bool reader_done_ = false;
+        bool writer_done_ = false;
+        // Interned id of the username.
+        // Holds the username's id for as long as the session.
+        NameRef user_;
+        ServerContext& context_;
+        std::string read_message_;
+        // Any read or write, used for hibernation.
+        std::chrono::steady_clock::time_point last_activity_;
+        // Anything received, including PONG, used for heartbeats.
+        std::chrono::steady_clock::time_point last_read_;
+        // Last chat message, used for idle eviction.
+        std::chrono::steady_clock::time_point last_message_;
+        std::chrono::steady_clock::time_point ping_sent_at_;
+        // Start of the session, older messages are not counted in the latency histogram.
+        std::chrono::steady_clock::time_point joined_;
+        // Traffic of this session alone, for the admin console.
+        std::uint64_t messages_in_ = 0;
+        std::uint64_t bytes_in_ = 0;
+        std::uint64_t messages_out_ = 0;
+        std::uint64_t bytes_out_ = 0;
+        std::uint64_t id_ = 0;
+        WheelTimer housekeeping_;
+        RateLimiter limit_;
+        bool throttled_ = false;
+        bool ping_sent_ = false;
+        bool reading_ = false;
+        bool hibernated_ = true;
+        bool stopped_ = false;
 };
+/**
+ * @brief Create a session that is destroyed by the thread of its event loop.
+ * The last reference may be dropped by a fan-out worker or the mailbox thread, while the
+ * socket, timers and buffer pool of a session belong to its shard; the deletion is then posted.
+ * @param socket Connected socket, its event loop owns the session.
+ * @param args Remaining arguments of the ChatSession constructor.
+ * @return std::shared_ptr<ChatSession> New session.
+ */
+template <typename... Args>
+std::shared_ptr<ChatSession> make_session(stream_socket socket, Args&&... args) {
+    auto& io_context = static_cast<boost::asio::io_context&>(boost::asio::query(socket.get_executor(), boost::asio::execution::context));
+    return std::shared_ptr<ChatSession>(new ChatSession(std::move(socket), std::forward<Args>(args)...), [&io_context](ChatSession* session) {
+        // A stopped loop runs nothing more, its sessions go with the shutdown.
+        if (io_context.stopped() || io_context.get_executor().running_in_this_thread()) {
+            delete session;
+        } else {
+            boost::asio::post(io_context, [session]{ delete session; });
+        }
+    });
+}
+/**
+ * @brief Read the username of a new connection and start its session.
+ * The first line is either "<username>" or "RESUME <seq> <username>" for a client that
+ * reconnects after seeing the room's messages up to seq. Either may be preceded by
+ * "ZSTD <dictionary id> " from a client that can decompress payloads. If the server compresses,
+ * it answers "ZSTD <dictionary id> <size>" followed by its dictionary, or by nothing (size 0)
+ * when the client already has it. A local publisher on a Unix domain socket may also put
+ * "SHM " in front of the name, the server answers "SHM <capacity>" and passes the memfd and
+ * eventfd of a shared ring along, or "SHM 0" and nothing when it has no ring to give.
+ * The connection is closed if the username does not arrive within the handshake timeout.
+ * @param socket Accepted socket.
+ * @param room Chat room.
+ * @param context State shared by the sessions.
+ * @param trace_id Trace id if the connection is sampled for tracing.
+ * @return Awaitable<void>
+ */
+awaitable<void> handshake(stream_socket socket, ChatRoom& room, ServerContext& context, std::uint64_t trace_id) {
+    TraceSpan span("handshake", trace_id);
+    WheelTimer deadline;
+    context.wheel.schedule(deadline, context.config.handshake_timeout, [&socket]{
+        boost::system::error_code ignored;
+        socket.close(ignored);
+    });
+    std::string buf;
+    boost::system::error_code ec;
+    size_t n = co_await boost::asio::async_read_until(socket, boost::asio::dynamic_buffer(buf, context.config.max_message_size), "\n", redirect_error(use_awaitable, ec));
+    deadline.cancel();
+
+    if (!ec) {
+        std::string username = buf.substr(0, n - 1);
+        if (username.ends_with('\r')) {
+            username.pop_back();
+        }
+        buf.erase(0, n);
+        std::string keyword;
+        bool compress = false;
+        std::uint32_t dictionary = 0;
+        std::istringstream zstd(username);
+        if (zstd >> keyword >> dictionary && keyword == "ZSTD" && zstd.get() == ' ') {
+            std::getline(zstd, username);
+            compress = context.compressor != nullptr;
+        }
+        bool shared_ring = username.starts_with("SHM ");
+        if (shared_ring) {
+            username.erase(0, 4);
+        }
+        std::optional<std::uint64_t> resume_after;
+        std::istringstream resume(username);
+        std::uint64_t seq;
+        if (resume >> keyword >> seq && keyword == "RESUME" && resume.get() == ' ') {
+            resume_after = seq;
+            std::getline(resume, username);
+        }
+        NameRef user = context.names->acquire(username);
+        if (!user) {
+            context.metrics.names_refused.add();
+            static const std::string refusal = "Too many users, try again later\n";
+            co_await boost::asio::async_write(socket, boost::asio::buffer(refusal), redirect_error(use_awaitable, ec));
+            socket.close(ec);
+            co_return;
+        }
+        if (compress) {
+            bool ship = dictionary != context.compressor->id();
+            std::string answer = "ZSTD " + std::to_string(context.compressor->id()) + ' '
+                + std::to_string(ship ? context.compressor->dictionary().size() : 0) + '\n';
+            std::array<boost::asio::const_buffer, 2> frames = {
+                boost::asio::buffer(answer),
+                ship ? boost::asio::buffer(context.compressor->dictionary()) : boost::asio::const_buffer()};
+            co_await boost::asio::async_write(socket, frames, redirect_error(use_awaitable, ec));
+            if (ec) {
+                co_return;
+            }
+        }
+        std::unique_ptr<ShmRing> ring;
+        if (shared_ring) {
+            std::string answer = "SHM 0\n";
+            if (context.config.shm_ring_size > 0 && socket.local_endpoint().protocol().family() == AF_UNIX) {
+                ring = ShmRing::create(context.config.shm_ring_size);
+                answer = "SHM " + std::to_string(ring->capacity()) + '\n';
+            }
+            // A line fits the empty send buffer of a new connection, it goes out at once.
+            if (ring ? !ring->send(socket.native_handle(), answer)
+                     : ::send(socket.native_handle(), answer.data(), answer.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(answer.size())) {
+                co_return;
+            }
+        }
+        auto session = make_session(std::move(socket), room, std::move(user), context, std::move(buf), resume_after, compress);
+        if (ring) {
+            session->attach(std::move(ring));
+        }
+        session->start();
+    } else {
+        std::cerr << "Error reading username: " << ec.message() << std::endl;
+        socket.close(ec);
+    }
+}
+/**
+ * @brief Measure how late the event loop runs a timer, a busy loop serves everything late.
+ * Every run also beats the heartbeat watched by the stall watchdog.
+ * @param context State of the shard.
+ * @return Awaitable<void>
+ */
+awaitable<void> lag_probe(ServerContext& context) {
+    boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor);
+    context.heartbeat.thread.store(pthread_self(), std::memory_order_relaxed);
+    auto now = std::chrono::steady_clock::now();
+    context.heartbeat.beat(now);
+    while (true) {
+        auto due = now + context.config.lag_probe_interval;
+        timer.expires_at(due);
+        co_await timer.async_wait(use_awaitable);
+        now = std::chrono::steady_clock::now();
+        context.heartbeat.beat(now);
+        auto lag = std::chrono::duration_cast<std::chrono::nanoseconds>(now - due).count();
+        context.metrics.loop_lag_ns.set(lag);
+        context.metrics.loop_lag_max_ns.raise(lag);
+        context.metrics.loop_lag.record(lag);
+    }
+}
+/**
+ * @brief Evict the idle rooms of a shard now and then.
+ * @param context State of the shard.
+ * @return Awaitable<void>
+ */
+awaitable<void> room_sweeper(ServerContext& context) {
+    boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor);
+    // A room is evicted at most half its idle time late.
+    auto interval = std::max<std::chrono::milliseconds>(context.config.room_idle / 2, context.config.timer_tick);
+    while (true) {
+        timer.expires_after(interval);
+        co_await timer.async_wait(use_awaitable);
+        context.room_cache.trim(std::chrono::steady_clock::now(), context.config.room_idle);
+    }
+}
 /**
  * @brief Listener coroutine to accept incoming connections.
- * @param acceptor TCP acceptor.
+ * Ends when the acceptor is closed for a hot restart.
+ * @param acceptor TCP or Unix domain socket acceptor, kept by the hot restart.
+ * @param room Replica of the port's chat room on this shard.
+ * @param context State shared by the sessions.
  * @return Awaitable<void>
  */
-awaitable<void> listener(tcp::acceptor acceptor) {
-    ChatRoom room;
+template <typename Acceptor>
+awaitable<void> listener(Acceptor& acceptor, ChatRoom& room, ServerContext& context) {
     while (true) {
-        tcp::socket socket = co_await acceptor.async_accept(use_awaitable);
-        boost::asio::streambuf buf;
         boost::system::error_code ec;
-        size_t bytes_transferred = co_await boost::asio::async_read_until(socket, buf, "\n", use_awaitable);
+        auto socket = co_await acceptor.async_accept(redirect_error(use_awaitable, ec));
+        if (ec) {
+            if (ec != boost::asio::error::operation_aborted) {
+                std::cerr << "Accept error: " << ec.message() << std::endl;
+            }
+            co_return;
+        }
+        std::uint64_t trace_id = trace_sample();
+        TraceSpan span("accept", trace_id);
+        context.metrics.accepts.add();
+        co_spawn(acceptor.get_executor(), handshake(stream_socket(std::move(socket)), room, context, trace_id), detached);
+    }
+}
+/**
+ * @brief Commands of the admin console.
+ * Every shard answers for its own rooms and sessions in one short handler on its own event
+ * loop, so a query never holds up message processing for longer than a walk of that state.
+ */
+class AdminConsole {
+    public:
+        /**
+         * @brief Constructor for admin console.
+         * @param shards All shards of the server.
+         * @param config Server settings.
+         */
+        AdminConsole(ShardGroup& shards, const ServerConfig& config) : shards_(shards), config_(config) {}
+        /**
+         * @brief Answer one command line.
+         * @param line Command and its arguments.
+         * @return Awaitable<std::string> Answer, one or more lines.
+         */
+        awaitable<std::string> run(std::string line) {
+            std::istringstream in(line);
+            std::string command;
+            in >> command;
+            if (command.empty()) {
+                co_return "";
+            }
+            if (command == "help") {
+                co_return "rooms                                 members and history of every room\n"
+                          "sessions                              open sessions with queue depth and traffic\n"
+                          "rates                                 average rates and rate limits of every session\n"
+                          "kick <session>                        disconnect a session\n"
+                          "throttle <session> <msg/s> <bytes/s>  set the rate limit of a session, 0 is unlimited\n"
+                          "history <port> <messages>             resize the history of a room\n"
+                          "quit                                  close the console\n";
+            }
+            if (command == "rooms") {
+                co_return co_await rooms();
+            }
+            if (command == "sessions" || command == "rates") {
+                co_return co_await sessions(command == "rates");
+            }
+            if (command == "kick") {
+                std::uint64_t id;
+                if (!(in >> id)) {
+                    co_return "usage: kick <session>\n";
+                }
+                bool found = co_await on_session(id, [](ChatSession& session) { session.kick(); });
+                co_return found ? "kicked " + std::to_string(id) + "\n" : "no session " + std::to_string(id) + "\n";
+            }
+            if (command == "throttle") {
+                std::uint64_t id;
+                double messages_per_sec, bytes_per_sec;
+                if (!(in >> id >> messages_per_sec >> bytes_per_sec) || messages_per_sec < 0 || bytes_per_sec < 0) {
+                    co_return "usage: throttle <session> <msg/s> <bytes/s>\n";
+                }
+                bool found = co_await on_session(id, [=](ChatSession& session) {
+                    session.throttle(messages_per_sec, bytes_per_sec);
+                });
+                co_return found ? "throttled " + std::to_string(id) + "\n" : "no session " + std::to_string(id) + "\n";
+            }
+            if (command == "history") {
+                unsigned short port;
+                std::size_t limit;
+                if (!(in >> port >> limit)) {
+                    co_return "usage: history <port> <messages>\n";
+                }
+                auto room = std::find(config_.ports.begin(), config_.ports.end(), port);
+                if (room == config_.ports.end()) {
+                    co_return "no room on port " + std::to_string(port) + "\n";
+                }
+                std::size_t room_id = static_cast<std::size_t>(room - config_.ports.begin());
+                for (std::size_t shard = 0; shard < shards_.size(); ++shard) {
+                    co_await on_shard(shard, [&]{
+                        chat_room(shard, room_id).resize_history(limit);
+                        return true;
+                    });
+                }
+                co_return "history of room " + std::to_string(port) + " keeps " + std::to_string(limit) + " messages\n";
+            }
+            co_return "unknown command " + command + ", try help\n";
+        }
+    private:
+        /**
+         * @brief Run a function on the event loop of a shard and wait for its result.
+         */
+        template <typename F>
+        awaitable<std::invoke_result_t<F>> on_shard(std::size_t shard, F f) {
+            co_return co_await co_spawn(shards_[shard].io_context(),
+                [f]() -> awaitable<std::invoke_result_t<F>> { co_return f(); }, use_awaitable);
+        }
+        /**
+         * @brief Run a function on a session on its own shard.
+         * @return Awaitable<bool> False if there is no such session.
+         */
+        template <typename F>
+        awaitable<bool> on_session(std::uint64_t id, F f) {
+            Shard& shard = shards_[id % shards_.size()];
+            co_return co_await on_shard(shard.id(), [&shard, id, f]{
+                auto it = shard.context().sessions.find(id);
+                if (it == shard.context().sessions.end()) {
+                    return false;
+                }
+                f(*it->second);
+                return true;
+            });
+        }
+        ChatRoom& chat_room(std::size_t shard, std::size_t room) {
+            return static_cast<ChatRoom&>(shards_[shard].room(room));
+        }
+        awaitable<std::string> rooms() {
+            std::ostringstream out;
+            for (std::size_t room = 0; room < config_.ports.size(); ++room) {
+                std::size_t members = 0;
+                std::ostringstream per_shard;
+                std::string history;
+                for (std::size_t shard = 0; shard < shards_.size(); ++shard) {
+                    auto [local, home_history] = co_await on_shard(shard, [&]{
+                        ChatRoom& replica = chat_room(shard, room);
+                        std::string text = !replica.is_home() ? std::string()
+                            : replica.evicted() ? std::string("evicted")
+                            : std::to_string(replica.history_size()) + "/" + std::to_string(replica.history_limit());
+                        return std::make_pair(replica.members(), text);
+                    });
+                    members += local;
+                    per_shard << (shard == 0 ? "" : ", ") << local;
+                    if (!home_history.empty()) {
+                        history = home_history;
+                    }
+                }
+                out << "room " << config_.ports[room] << ": " << members << " members (per shard: "
+                    << per_shard.str() << "), history " << history << '\n';
+            }
+            co_return out.str();
+        }
+        /**
+         * @brief List the sessions of all shards.
+         * @param rates Show average rates and limits instead of totals.
+         */
+        awaitable<std::string> sessions(bool rates) {
+            std::ostringstream out;
+            out << std::fixed << std::setprecision(1);
+            if (rates) {
+                out << "id\tuser\tmsg/s in\tbytes/s in\tmsg/s out\tbytes/s out\tlimit msg/s\tlimit bytes/s\tthrottled\n";
+            } else {
+                out << "id\tuser\troom\tage s\tqueued\tmsgs in\tbytes in\tmsgs out\tbytes out\n";
+            }
+            for (std::size_t shard = 0; shard < shards_.size(); ++shard) {
+                auto stats = co_await on_shard(shard, [&]{
+                    std::vector<ChatSession::Stats> all;
+                    auto now = std::chrono::steady_clock::now();
+                    for (auto& [id, session] : shards_[shard].context().sessions) {
+                        all.push_back(session->stats(now));
+                    }
+                    return all;
+                });
+                for (auto& session : stats) {
+                    double age = std::max(std::chrono::duration<double>(session.age).count(), 1e-3);
+                    out << session.id << '\t' << session.username << '\t';
+                    if (rates) {
+                        auto limit = [&out](double value) {
+                            if (value > 0) {
+                                out << value << '\t';
+                            } else {
+                                out << "-\t";
+                            }
+                        };
+                        out << session.messages_in / age << '\t' << session.bytes_in / age << '\t'
+                            << session.messages_out / age << '\t' << session.bytes_out / age << '\t';
+                        limit(session.messages_per_sec_limit);
+                        limit(session.bytes_per_sec_limit);
+                        out << (session.throttled ? "yes" : "no") << '\n';
+                    } else {
+                        out << config_.ports[session.room] << '\t' << age << '\t' << session.queued << '\t'
+                            << session.messages_in << '\t' << session.bytes_in << '\t'
+                            << session.messages_out << '\t' << session.bytes_out << '\n';
+                    }
+                }
+            }
+            co_return out.str();
+        }
 
-        if (!ec) {
-            std::istream is(&buf);
-            std::string username;
-            std::getline(is, username);
-            std::make_shared<ChatSession>(std::move(socket), room, std::move(username))->start();
-        } else {
-            std::cerr << "Error reading username: " << ec.message() << std::endl;
-            socket.close();
+        ShardGroup& shards_;
+        const ServerConfig& config_;
+};
+/**
+ * @brief Hot restart: pass the listening sockets, sessions and rooms on to a new server process.
+ * The new process connects to the handoff socket. The listening sockets go first and the old
+ * process stops accepting right after, so new connections wait in the backlog for the new one.
+ * Every shard then stops its sessions between two writes and collects their state, the home
+ * shards collect their rooms, and everything is sent over before the old process stops.
+ */
+class HotRestart {
+    public:
+        /**
+         * @brief Constructor for hot restart.
+         * @param shards All shards of the server.
+         * @param config Server settings.
+         */
+        HotRestart(ShardGroup& shards, const ServerConfig& config) : shards_(shards), config_(config) {}
+        /**
+         * @brief Keep a listening socket of a room, to pass on and close on a hot restart.
+         * @param shard Shard accepting on it.
+         * @param room Index of the room.
+         * @param acceptor Listening acceptor.
+         * @return tcp::acceptor& The acceptor, valid as long as this object.
+         */
+        tcp::acceptor& keep(std::size_t shard, std::size_t room, tcp::acceptor acceptor) {
+            tcp::acceptor& kept = tcp_.emplace_back(std::move(acceptor));
+            listeners_.push_back({shard, {HandoffListener::Kind::tcp, config_.ports[room], kept.native_handle()},
+                                  [&kept]{ kept.close(); }});
+            return kept;
+        }
+        /**
+         * @brief Keep the Unix domain socket acceptor of a room; only the first one of a room is passed on.
+         */
+        boost::asio::local::stream_protocol::acceptor& keep(std::size_t shard, std::size_t room,
+                                                            boost::asio::local::stream_protocol::acceptor acceptor) {
+            auto& kept = local_.emplace_back(std::move(acceptor));
+            bool first = std::none_of(listeners_.begin(), listeners_.end(), [&](const Kept& other) {
+                return other.listener.kind == HandoffListener::Kind::unix_socket && other.listener.port == config_.ports[room];
+            });
+            listeners_.push_back({shard, {HandoffListener::Kind::unix_socket, config_.ports[room], first ? kept.native_handle() : -1},
+                                  [&kept]{ kept.close(); }});
+            return kept;
+        }
+        /**
+         * @brief Pass the metrics socket on as well, the old process keeps serving it until it exits.
+         */
+        void keep_metrics(int fd) {
+            listeners_.push_back({0, {HandoffListener::Kind::metrics, config_.metrics_port, fd}, nullptr});
+        }
+        bool handed_off() const {
+            return handed_off_;
+        }
+        /**
+         * @brief Wait on the handoff socket for a new process, hand everything over and stop the server.
+         * Until a new process took the listening sockets nothing was given up, so the server goes on
+         * and waits for the next one.
+         * @param acceptor Handoff socket.
+         * @return Awaitable<void>
+         */
+        awaitable<void> serve(HandoffAcceptor acceptor) {
+            while (true) {
+                auto socket = co_await acceptor.async_accept(use_awaitable);
+                auto started = std::chrono::steady_clock::now();
+                HandoffChannel channel(socket.native_handle());
+                bool sent = std::all_of(listeners_.begin(), listeners_.end(), [&channel](const Kept& kept) {
+                    return kept.listener.fd < 0 || channel.send(kept.listener);
+                });
+                if (sent) {
+                    acceptor.close();
+                    co_await hand_over(channel, started);
+                    co_return;
+                }
+                std::cerr << "Handoff failed, the new process went away or stopped reading; still serving" << std::endl;
+            }
+        }
+    private:
+        /**
+         * @brief A listening socket, closed on its own shard.
+         */
+        struct Kept {
+            std::size_t shard;
+            // Passed on unless its fd is -1.
+            HandoffListener listener;
+            std::function<void()> close;
+        };
+
+        /**
+         * @brief Stop accepting, send the sessions and rooms after the listening sockets, and stop the server.
+         * @param channel Channel to the new process, which has the listening sockets.
+         * @param started When the new process connected.
+         * @return Awaitable<void>
+         */
+        awaitable<void> hand_over(HandoffChannel& channel, std::chrono::steady_clock::time_point started) {
+            for (std::size_t shard = 0; shard < shards_.size(); ++shard) {
+                co_await on_shard(shard, [this, shard]{
+                    for (auto& kept : listeners_) {
+                        if (kept.shard == shard && kept.close) {
+                            kept.close();
+                        }
+                    }
+                    return true;
+                });
+            }
+            auto sessions = co_await collect_sessions();
+            std::size_t passed = 0;
+            bool sent = true;
+            for (auto& session : sessions) {
+                if (session.fd >= 0) {
+                    sent = sent && channel.send(session);
+                    passed += sent;
+                    ::close(session.fd);
+                }
+            }
+            for (std::size_t room = 0; room < config_.ports.size() && sent; ++room) {
+                std::size_t home = room % shards_.size();
+                HandoffRoom state = co_await on_shard(home, [this, home, room]{
+                    return static_cast<ChatRoom&>(shards_[home].room(room)).hand_off();
+                });
+                sent = channel.send(state);
+            }
+            sent = sent && channel.send_end();
+            handed_off_ = true;
+            std::cerr << (sent ? "Handed " : "Handoff interrupted after ") << passed << " sessions over in "
+                      << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count()
+                      << " ms" << std::endl;
+            shards_.stop();
+        }
+        /**
+         * @brief Sessions collected from all shards.
+         */
+        struct Collected {
+            std::mutex mutex;
+            std::vector<HandoffSession> sessions;
+            // Sessions still stopping, plus one until every shard started stopping its own.
+            std::size_t remaining = 1;
+            // Set once the sessions were taken, a session stopping later closes its own connection.
+            bool closed = false;
+            std::unique_ptr<boost::asio::steady_timer> done;
+        };
+        // Longest wait for a session to finish its write, one that takes longer is dropped.
+        static constexpr auto drain_timeout = std::chrono::seconds(5);
+
+        /**
+         * @brief Run a function on the event loop of a shard and wait for its result.
+         */
+        template <typename F>
+        awaitable<std::invoke_result_t<F>> on_shard(std::size_t shard, F f) {
+            co_return co_await co_spawn(shards_[shard].io_context(),
+                [f]() -> awaitable<std::invoke_result_t<F>> { co_return f(); }, use_awaitable);
+        }
+        /**
+         * @brief Stop the sessions of every shard and collect their state, must run on the first shard.
+         */
+        awaitable<std::vector<HandoffSession>> collect_sessions() {
+            auto collected = std::make_shared<Collected>();
+            collected->done = std::make_unique<boost::asio::steady_timer>(shards_[0].io_context(), drain_timeout);
+            auto finished = [collected, this](HandoffSession state) {
+                std::lock_guard<std::mutex> lock(collected->mutex);
+                if (collected->closed) {
+                    if (state.fd >= 0) {
+                        ::close(state.fd);
+                    }
+                    return;
+                }
+                collected->sessions.push_back(std::move(state));
+                if (--collected->remaining == 0) {
+                    boost::asio::post(shards_[0].io_context(), [collected]{ collected->done->cancel(); });
+                }
+            };
+            for (std::size_t shard = 0; shard < shards_.size(); ++shard) {
+                co_await on_shard(shard, [this, shard, &collected, &finished]{
+                    std::vector<std::shared_ptr<ChatSession>> sessions;
+                    for (auto& [id, session] : shards_[shard].context().sessions) {
+                        sessions.push_back(session->shared_from_this());
+                    }
+                    {
+                        std::lock_guard<std::mutex> lock(collected->mutex);
+                        collected->remaining += sessions.size();
+                    }
+                    for (auto& session : sessions) {
+                        session->hand_off(finished);
+                    }
+                    return true;
+                });
+            }
+            bool waiting;
+            {
+                std::lock_guard<std::mutex> lock(collected->mutex);
+                waiting = --collected->remaining > 0;
+            }
+            if (waiting) {
+                boost::system::error_code ec;
+                co_await collected->done->async_wait(redirect_error(use_awaitable, ec));
+            }
+            std::lock_guard<std::mutex> lock(collected->mutex);
+            collected->closed = true;
+            if (collected->remaining > 0) {
+                std::cerr << collected->remaining << " sessions did not stop in time and are dropped" << std::endl;
+            }
+            co_return std::move(collected->sessions);
+        }
+
+        ShardGroup& shards_;
+        const ServerConfig& config_;
+        // Acceptors live here rather than in their listener coroutines, so that they can be closed.
+        std::deque<tcp::acceptor> tcp_;
+        std::deque<boost::asio::local::stream_protocol::acceptor> local_;
+        std::vector<Kept> listeners_;
+        bool handed_off_ = false;
+};
+/**
+ * @brief Snapshots of every room, so that a restart maps one file instead of reading each room's history.
+ * The home shard of a room copies its state between two handlers, a thread of its own writes
+ * the file, so no event loop waits for the disk. A snapshot that comes due while the previous
+ * one is still being written is skipped.
+ */
+class RoomSnapshots {
+    public:
+        /**
+         * @brief Constructor for room snapshots.
+         * @param shards All shards of the server.
+         * @param config Server settings.
+         */
+        RoomSnapshots(ShardGroup& shards, const ServerConfig& config) : shards_(shards), config_(config) {}
+        RoomSnapshots(const RoomSnapshots&) = delete;
+        RoomSnapshots& operator=(const RoomSnapshots&) = delete;
+        ~RoomSnapshots() {
+            if (writer_.joinable()) {
+                writer_.join();
+            }
+        }
+        /**
+         * @brief Write a snapshot every snapshot_interval, must run on the first shard.
+         * @return Awaitable<void>
+         */
+        awaitable<void> run() {
+            boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor);
+            while (true) {
+                timer.expires_after(config_.snapshot_interval);
+                co_await timer.async_wait(use_awaitable);
+                if (writing_.load(std::memory_order_acquire)) {
+                    std::cerr << "Skipping a snapshot, the previous one is still being written" << std::endl;
+                    continue;
+                }
+                std::vector<RoomState> rooms;
+                for (std::size_t shard = 0; shard < shards_.size(); ++shard) {
+                    auto saved = co_await on_shard(shard, [this, shard]{ return save(shard, false); });
+                    std::move(saved.begin(), saved.end(), std::back_inserter(rooms));
+                }
+                if (writer_.joinable()) {
+                    writer_.join();
+                }
+                writing_.store(true, std::memory_order_relaxed);
+                writer_ = std::thread([this, rooms = std::move(rooms)]() mutable {
+                    write(rooms);
+                    writing_.store(false, std::memory_order_release);
+                });
+            }
+        }
+        /**
+         * @brief Write the last snapshot, with every search index written out, once the shards stopped.
+         */
+        void write_final() {
+            if (writer_.joinable()) {
+                writer_.join();
+            }
+            std::vector<RoomState> rooms;
+            for (std::size_t shard = 0; shard < shards_.size(); ++shard) {
+                auto saved = save(shard, true);
+                std::move(saved.begin(), saved.end(), std::back_inserter(rooms));
+            }
+            write(rooms);
+        }
+    private:
+        /**
+         * @brief Run a function on the event loop of a shard and wait for its result.
+         */
+        template <typename F>
+        awaitable<std::invoke_result_t<F>> on_shard(std::size_t shard, F f) {
+            co_return co_await co_spawn(shards_[shard].io_context(),
+                [f]() -> awaitable<std::invoke_result_t<F>> { co_return f(); }, use_awaitable);
+        }
+        /**
+         * @brief State of the rooms a shard is the home of, on that shard.
+         */
+        std::vector<RoomState> save(std::size_t shard, bool flush) {
+            std::vector<RoomState> rooms;
+            for (std::size_t room = shard; room < config_.ports.size(); room += shards_.size()) {
+                rooms.push_back(static_cast<ChatRoom&>(shards_[shard].room(room)).save(flush));
+            }
+            return rooms;
+        }
+        void write(std::vector<RoomState>& rooms) {
+            // Evicted rooms are read back from their files here, not on the event loops.
+            for (auto& room : rooms) {
+                if (room.file.empty()) {
+                    continue;
+                }
+                auto file = RoomSnapshot::open(room.file);
+                if (auto saved = file ? file->find(room.name) : std::nullopt) {
+                    room = file->state(*saved);
+                } else {
+                    room.file.clear();
+                }
+            }
+            if (!RoomSnapshot::write(config_.snapshot_file, rooms)) {
+                std::cerr << "Cannot write snapshot " << config_.snapshot_file << std::endl;
+            }
+        }
+
+        ShardGroup& shards_;
+        const ServerConfig& config_;
+        std::thread writer_;
+        std::atomic<bool> writing_{false};
+};
+/**
+ * @brief Serve a connection passed on by the previous process.
+ * The client notices nothing: it gets the messages that were queued for it, then the room
+ * messages it missed during the handoff.
+ * @param shard Shard that serves it.
+ * @param room_id Index of its room.
+ * @param state State of the connection.
+ */
+void adopt_session(Shard& shard, std::size_t room_id, HandoffSession state) {
+    ServerContext& context = shard.context();
+    sockaddr_storage address{};
+    socklen_t length = sizeof(address);
+    ::getsockname(state.fd, reinterpret_cast<sockaddr*>(&address), &length);
+    stream_socket socket(shard.io_context(), boost::asio::generic::stream_protocol(address.ss_family, 0), state.fd);
+    std::optional<std::uint64_t> resume_after;
+    if (state.last_seq > 0) {
+        resume_after = state.last_seq;
+    }
+    NameRef user = context.names->acquire(state.username);
+    if (!user) {
+        context.metrics.names_refused.add();
+        return;
+    }
+    // The client only decompresses with the dictionary it negotiated, which this process may not have loaded.
+    bool compress = state.compress && context.compressor && context.compressor->id() == state.dictionary;
+    auto session = make_session(std::move(socket), static_cast<ChatRoom&>(shard.room(room_id)), std::move(user), context,
+                                std::move(state.pending), resume_after, compress);
+    for (auto& message : state.queued) {
+        session->deliver(from_handoff(message, room_id, context));
+    }
+    session->start(false);
+}
+/**
+ * @brief Open a listening socket that other shards may bind to the same port.
+ * The kernel spreads incoming connections between the shards.
+ * @param io_context Event loop of the shard.
+ * @param port TCP port.
+ * @return tcp::acceptor Listening acceptor.
+ */
+tcp::acceptor open_acceptor(boost::asio::io_context& io_context, unsigned short port) {
+    tcp::endpoint endpoint(tcp::v4(), port);
+    tcp::acceptor acceptor(io_context, endpoint.protocol());
+    acceptor.set_option(tcp::acceptor::reuse_address(true));
+    acceptor.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+    acceptor.bind(endpoint);
+    acceptor.listen();
+    return acceptor;
+}
+/**
+ * @brief Open the Unix domain socket of a room, replacing a stale one.
+ * Local clients skip the TCP stack: no checksums, segmentation or loopback routing.
+ * @param io_context Event loop of the first shard.
+ * @param path Filesystem path of the socket.
+ * @return local::stream_protocol::acceptor Listening acceptor.
+ */
+boost::asio::local::stream_protocol::acceptor open_unix_acceptor(boost::asio::io_context& io_context, const std::string& path) {
+    ::unlink(path.c_str());
+    return boost::asio::local::stream_protocol::acceptor(io_context, boost::asio::local::stream_protocol::endpoint(path));
+}
+/**
+ * @brief Acceptor of another shard on the same Unix domain socket.
+ * A Unix socket path cannot be bound twice, so every shard accepts on a duplicate of the one
+ * listening socket and whichever shard is woken first takes the connection.
+ * @param io_context Event loop of the shard.
+ * @param first Acceptor opened by open_unix_acceptor().
+ * @return local::stream_protocol::acceptor Acceptor sharing the listening socket.
+ */
+boost::asio::local::stream_protocol::acceptor share_unix_acceptor(boost::asio::io_context& io_context,
+                                                                   boost::asio::local::stream_protocol::acceptor& first) {
+    int fd = ::dup(first.native_handle());
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "Cannot share a Unix domain socket");
+    }
+    return boost::asio::local::stream_protocol::acceptor(io_context, boost::asio::local::stream_protocol(), fd);
+}
+/**
+ * @brief Member of a benchmark room that counts what reaches it instead of writing to a socket.
+ */
+class CountingMember : public Users {
+    public:
+        explicit CountingMember(std::atomic<std::size_t>& delivered) : delivered_(delivered) {}
+        void deliver(const MessagePtr&) override {
+            delivered_.fetch_add(1, std::memory_order_relaxed);
+        }
+    private:
+        std::atomic<std::size_t>& delivered_;
+};
+void bench_fanout(const ServerConfig& settings) {
+    constexpr std::size_t hot_rooms = 2;
+    constexpr std::size_t members = 100000;
+    constexpr std::size_t messages = 50;
+    ServerConfig config;
+    config.ports = {1, 2};
+    // A shard per room, so both home shards publish at once, as with busy rooms on different shards.
+    config.shards = hot_rooms;
+    config.fanout_workers = settings.fanout_workers > 0 ? settings.fanout_workers : std::max(4u, std::thread::hardware_concurrency());
+    config.fanout_slice = settings.fanout_slice;
+    config.room_history = 0;
+    InternTable names;
+    ShardGroup shards(config);
+    WorkStealingPool pool(config.fanout_workers);
+    for (std::size_t i = 0; i < shards.size(); ++i) {
+        shards[i].context().names = &names;
+        shards[i].context().fanout_pool = &pool;
+        for (std::size_t room_id = 0; room_id < hot_rooms; ++room_id) {
+            shards[i].add_room(std::make_unique<ChatRoom>(shards[i], room_id, RateLimiter(0, 0, config.rate_burst)));
         }
     }
+    auto guard = boost::asio::make_work_guard(shards[0].io_context());
+    std::thread running([&shards]{ shards.run(false); });
+    // Every room joins its members on its home shard, then waits for them all.
+    std::atomic<std::size_t> delivered{0};
+    std::atomic<std::size_t> ready{0};
+    for (std::size_t room_id = 0; room_id < hot_rooms; ++room_id) {
+        Shard& home = shards[room_id % shards.size()];
+        boost::asio::post(home.io_context(), [&, room_id, &room = static_cast<ChatRoom&>(home.room(room_id))]{
+            for (std::size_t i = 0; i < members; ++i) {
+                room.join(std::make_shared<CountingMember>(delivered));
+            }
+            ready.fetch_add(1);
+        });
+    }
+    while (ready.load() < hot_rooms) {
+        std::this_thread::yield();
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    for (std::size_t room_id = 0; room_id < hot_rooms; ++room_id) {
+        Shard& home = shards[room_id % shards.size()];
+        boost::asio::post(home.io_context(), [&room = static_cast<ChatRoom&>(home.room(room_id))]{
+            for (std::size_t message = 0; message < messages; ++message) {
+                room.deliver(make_message("benchmark message " + std::to_string(message)));
+            }
+        });
+    }
+    while (delivered.load(std::memory_order_relaxed) < hot_rooms * members * messages) {
+        std::this_thread::yield();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+    shards.stop();
+    running.join();
+
+    auto stats = pool.stats();
+    double min_busy = 1e100, max_busy = 0;
+    std::cout << "fanout, " << hot_rooms << " hot rooms x " << members << " members x " << messages
+              << " messages on " << config.fanout_workers << " workers: " << elapsed.count() << " s, "
+              << static_cast<double>(hot_rooms * members * messages) / elapsed.count() / 1e6 << " M deliveries/s\n";
+    for (std::size_t i = 0; i < stats.size(); ++i) {
+        double busy = std::chrono::duration<double>(stats[i].busy).count();
+        min_busy = std::min(min_busy, busy);
+        max_busy = std::max(max_busy, busy);
+        std::cout << "  worker " << i << ": busy " << 100.0 * busy / elapsed.count() << "%, tasks "
+                  << stats[i].tasks << ", stolen " << stats[i].steals << '\n';
+    }
+    std::cout << "  balance (least / most busy worker): " << (max_busy > 0 ? min_busy / max_busy : 0) << '\n';
 }
 /**
  * @brief Main function.
  * @param argc Number of arguments.
- * @param argv User arguments(port).
+ * @param argv User arguments(ports and --option=value settings).
  * @return int Exit code.
  */
 int main(int cnt_paraments, char* ports[]) {
     try {
-
-        if (cnt_paraments < 2) {
-            std::cerr << "No port provided. Usage: ./chat_server <port1> ...";
+        ServerConfig config = parse_config(cnt_paraments, ports);
+        if (!config.bench.empty()) {
+            return run_bench(config);
+        }
+        if (!config.zstd_train.empty()) {
+            return train_dictionary(config.zstd_train, config.zstd_dict, config.zstd_dict_size);
+        }
+        if (config.ports.empty()) {
+            std::cerr << "No port provided. Usage: ./chat_server <port1> ... [--option=value]";
+        }
+        if (!config.trace_file.empty()) {
+#ifdef CHAT_TRACING
+            trace_start(config.trace_file, config.trace_sample);
+#else
+            std::cerr << "Built without CHAT_TRACING, --trace-file is ignored" << std::endl;
+#endif
+        }
+        std::unique_ptr<MessageCompressor> compressor;
+        if (!config.zstd_dict.empty()) {
+#ifdef CHAT_ZSTD
+            compressor = std::make_unique<MessageCompressor>(config.zstd_dict, config.zstd_level);
+#else
+            std::cerr << "Built without CHAT_ZSTD, --zstd-dict is ignored" << std::endl;
+#endif
         }
-        boost::asio::io_context io_context(1);
-        for (int i = 0; i < cnt_paraments; ++i) {
-            unsigned short port = std::atoi(ports[i]);
-            co_spawn(io_context, listener(tcp::acceptor(io_context, {tcp::v4(), port})), detached);
+        // Taken over before the rooms are built: they map the search index the old process wrote last.
+        HandoffState inherited;
+        if (!config.handoff_socket.empty()) {
+            // Longer than the old process waits for its sessions to finish their writes.
+            inherited = receive_handoff(config.handoff_socket, std::chrono::seconds(10));
         }
-        boost::asio::signal_set signals(io_context, SIGINT, SIGTERM);
-        signals.async_wait([&](auto, auto){ io_context.stop(); });
-        io_context.run();
+        // Listening sockets passed on by the old process, by kind and port.
+        std::map<std::pair<HandoffListener::Kind, unsigned short>, std::deque<int>> inherited_listeners;
+        for (auto& listener : inherited.listeners) {
+            inherited_listeners[{listener.kind, listener.port}].push_back(listener.fd);
+        }
+        auto take_listener = [&](HandoffListener::Kind kind, unsigned short port) {
+            auto it = inherited_listeners.find({kind, port});
+            if (it == inherited_listeners.end() || it->second.empty()) {
+                return -1;
+            }
+            int fd = it->second.front();
+            it->second.pop_front();
+            return fd;
+        };
+        // Mapped while the rooms are built, they copy what they need.
+        auto loading = std::chrono::steady_clock::now();
+        std::unique_ptr<RoomSnapshot> snapshot;
+        if (!config.snapshot_file.empty()) {
+            snapshot = RoomSnapshot::open(config.snapshot_file);
+            if (!snapshot && ::access(config.snapshot_file.c_str(), F_OK) == 0) {
+                std::cerr << "Ignoring damaged snapshot " << config.snapshot_file << std::endl;
+            }
+        }
+        if (!config.room_cache_dir.empty()) {
+            ::mkdir(config.room_cache_dir.c_str(), 0700);
+        }
+        // Declared before the shards: sessions and rooms look names up until they are gone.
+        InternTable names(config.max_names + config.ports.size());
+        std::vector<std::string_view> room_names;
+        for (auto port : config.ports) {
+            room_names.push_back(names.name(names.intern(std::to_string(port))));
+        }
+        // Declared before the shards: the rooms wait for their queued segments when they are gone.
+        std::unique_ptr<IndexWriter> index_writer;
+        if (!config.index_dir.empty()) {
+            index_writer = std::make_unique<IndexWriter>();
+        }
+        ShardGroup shards(config);
+        // Declared after the shards: its tasks refer to rooms and must finish first.
+        std::unique_ptr<WorkStealingPool> fanout_pool;
+        if (config.fanout_workers > 0) {
+            fanout_pool = std::make_unique<WorkStealingPool>(config.fanout_workers);
+        }
+        // Declared after the shards: its disk thread delivers to sessions and must stop first.
+        Mailboxes mailboxes(config.mailbox_dir, names);
+        // Declared after the shards: it owns acceptors of their event loops.
+        HotRestart restart(shards, config);
+        // Declared after the shards: its writer thread must finish before they are gone.
+        RoomSnapshots snapshots(shards, config);
+        // Listening Unix domain sockets by room, every shard accepts on a duplicate.
+        std::vector<boost::asio::local::stream_protocol::acceptor*> unix_acceptors;
+        for (std::size_t i = 0; i < shards.size(); ++i) {
+            Shard& shard = shards[i];
+            shard.context().fanout_pool = fanout_pool.get();
+            shard.context().mailboxes = &mailboxes;
+            shard.context().index_writer = index_writer.get();
+            shard.context().names = &names;
+            shard.context().compressor = compressor.get();
+            shard.context().snapshot = snapshot.get();
+            co_spawn(shard.io_context(), shard.context().wheel.run(), detached);
+            if (config.lag_probe_interval.count() > 0) {
+                co_spawn(shard.io_context(), lag_probe(shard.context()), detached);
+            }
+            if (shard.context().room_cache.enabled()) {
+                co_spawn(shard.io_context(), room_sweeper(shard.context()), detached);
+            }
+            // Every shard has a replica of every room and its own acceptor per port.
+            for (std::size_t room_id = 0; room_id < config.ports.size(); ++room_id) {
+                auto room = std::make_unique<ChatRoom>(shard, room_id,
+                    RateLimiter(config.room_shard_messages_per_sec, config.room_shard_bytes_per_sec, config.rate_burst));
+                ChatRoom& replica = *room;
+                shard.add_room(std::move(room));
+                int fd = take_listener(HandoffListener::Kind::tcp, config.ports[room_id]);
+                tcp::acceptor& acceptor = restart.keep(i, room_id, fd >= 0 ? tcp::acceptor(shard.io_context(), tcp::v4(), fd)
+                                                                           : open_acceptor(shard.io_context(), config.ports[room_id]));
+                co_spawn(shard.io_context(), listener(acceptor, replica, shard.context()), detached);
+                if (!config.unix_socket_dir.empty()) {
+                    if (i == 0) {
+                        fd = take_listener(HandoffListener::Kind::unix_socket, config.ports[room_id]);
+                        unix_acceptors.push_back(&restart.keep(i, room_id, fd >= 0
+                            ? boost::asio::local::stream_protocol::acceptor(shard.io_context(), boost::asio::local::stream_protocol(), fd)
+                            : open_unix_acceptor(shard.io_context(), unix_socket_path(config, room_id))));
+                    }
+                    auto& shared = restart.keep(i, room_id, share_unix_acceptor(shard.io_context(), *unix_acceptors[room_id]));
+                    co_spawn(shard.io_context(), listener(shared, replica, shard.context()), detached);
+                }
+            }
+        }
+        if (snapshot) {
+            for (std::size_t i = 0; i < shards.size(); ++i) {
+                shards[i].context().snapshot = nullptr;
+            }
+            std::cerr << "Restored " << snapshot->rooms() << " rooms from " << config.snapshot_file << " in "
+                      << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loading).count()
+                      << " ms" << std::endl;
+            snapshot.reset();
+        }
+        // The old process had more shards: their listening sockets are spread over ours.
+        std::size_t extra = 0;
+        for (std::size_t room_id = 0; room_id < config.ports.size(); ++room_id) {
+            for (int fd; (fd = take_listener(HandoffListener::Kind::tcp, config.ports[room_id])) >= 0; ++extra) {
+                Shard& shard = shards[extra % shards.size()];
+                tcp::acceptor& acceptor = restart.keep(shard.id(), room_id, tcp::acceptor(shard.io_context(), tcp::v4(), fd));
+                co_spawn(shard.io_context(), listener(acceptor, static_cast<ChatRoom&>(shard.room(room_id)), shard.context()),
+                         detached);
+            }
+        }
+        int metrics_fd = take_listener(HandoffListener::Kind::metrics, config.metrics_port);
+        for (auto& [listener, fds] : inherited_listeners) {
+            for (int fd : fds) {
+                ::close(fd);
+            }
+        }
+        // Rooms first: sessions resume from the history they inherit.
+        for (auto& room : inherited.rooms) {
+            auto port = std::find(config.ports.begin(), config.ports.end(), room.port);
+            if (port != config.ports.end()) {
+                std::size_t room_id = static_cast<std::size_t>(port - config.ports.begin());
+                static_cast<ChatRoom&>(shards[room_id % shards.size()].room(room_id)).take_over(room);
+            }
+        }
+        for (std::size_t i = 0; i < inherited.sessions.size(); ++i) {
+            HandoffSession& session = inherited.sessions[i];
+            auto port = std::find(config.ports.begin(), config.ports.end(), session.port);
+            if (port == config.ports.end()) {
+                ::close(session.fd);
+                continue;
+            }
+            Shard& shard = shards[i % shards.size()];
+            boost::asio::post(shard.io_context(), [&shard, room_id = static_cast<std::size_t>(port - config.ports.begin()),
+                                                   session = std::move(session)]() mutable {
+                adopt_session(shard, room_id, std::move(session));
+            });
+        }
+        if (!inherited.sessions.empty() || !inherited.listeners.empty()) {
+            std::cerr << "Took over " << inherited.sessions.size() << " sessions from the previous process" << std::endl;
+        }
+        auto render = [&shards, &room_names, &fanout_pool] {
+            std::ostringstream out;
+            Metrics::expose(out, shards.metrics(), room_names);
+            if (fanout_pool) {
+                fanout_pool->print(out);
+            }
+            return out.str();
+        };
+        if (config.metrics_port != 0) {
+            tcp::acceptor acceptor = metrics_fd >= 0
+                ? tcp::acceptor(shards[0].io_context(), tcp::v4(), metrics_fd)
+                : tcp::acceptor(shards[0].io_context(), tcp::endpoint(boost::asio::ip::address_v4::loopback(), config.metrics_port));
+            restart.keep_metrics(acceptor.native_handle());
+            co_spawn(shards[0].io_context(), metrics_server(std::move(acceptor), render), detached);
+        }
+        // Declared after the shards: it reads their state and must stop first.
+        std::unique_ptr<StallWatchdog> watchdog;
+        if (config.lag_probe_interval.count() > 0 && config.stall_threshold.count() > 0) {
+            watchdog = std::make_unique<StallWatchdog>(shards, config.stall_threshold);
+        }
+        AdminConsole console(shards, config);
+        if (!config.admin_socket.empty()) {
+            co_spawn(shards[0].io_context(),
+                     admin_server(open_admin_socket(shards[0].io_context(), config.admin_socket),
+                                  [&console](std::string line) { return console.run(std::move(line)); }),
+                     detached);
+        }
+        if (!config.handoff_socket.empty()) {
+            co_spawn(shards[0].io_context(), restart.serve(open_handoff_socket(shards[0].io_context(), config.handoff_socket)),
+                     detached);
+        }
+        if (!config.snapshot_file.empty() && config.snapshot_interval.count() > 0) {
+            co_spawn(shards[0].io_context(), snapshots.run(), detached);
+        }
+        boost::asio::signal_set signals(shards[0].io_context(), SIGINT, SIGTERM);
+        signals.async_wait([&](auto, auto){ shards.stop(); });
+        boost::asio::signal_set dump(shards[0].io_context(), SIGUSR1);
+        std::function<void(const boost::system::error_code&, int)> on_dump = [&](const boost::system::error_code& ec, int) {
+            if (ec) {
+                return;
+            }
+            Metrics::print_latency(std::cerr, shards.metrics());
+            dump.async_wait(on_dump);
+        };
+        dump.async_wait(on_dump);
+        shards.run(config.pin_shards);
+        watchdog.reset();
+        // After a hot restart the sockets on these paths belong to the new process.
+        if (!restart.handed_off()) {
+            if (!config.admin_socket.empty()) {
+                ::unlink(config.admin_socket.c_str());
+            }
+            for (std::size_t room_id = 0; room_id < unix_acceptors.size(); ++room_id) {
+                ::unlink(unix_socket_path(config, room_id).c_str());
+            }
+            if (!config.handoff_socket.empty()) {
+                ::unlink(config.handoff_socket.c_str());
+            }
+            // Likewise the snapshot file: after a hot restart the new process has the newer state.
+            if (!config.snapshot_file.empty()) {
+                snapshots.write_final();
+            }
+        }
+        std::cerr << render();
+        Metrics::print_latency(std::cerr, shards.metrics());
+        trace_flush();
     } catch (std::exception& err){
         std::cerr << err.what() << '\n';
     }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "intern_table.hpp"
+
+/**
+ * @brief Chat message shared by every queue it is delivered to.
+ * Room messages are an envelope built by the server: the sender, room and timestamp come from
+ * the session that read the payload, never from the client. Server notices have sender 0.
+ */
+struct Message {
+    // Payload, without a line break.
+    std::string text;
+    // When the server finished reading it, zero for server notices.
+    std::chrono::steady_clock::time_point received{};
+    // Id of its spans when sampled for tracing, otherwise 0.
+    std::uint64_t trace_id = 0;
+    // Position in its room, stamped by the room's home shard; 0 for server notices.
+    std::uint64_t seq = 0;
+    // Interned name of the sending user, held as long as the message; null for server notices.
+    NameRef sender;
+    // Index of the room it was posted to.
+    std::uint32_t room = 0;
+    // Server wall clock time it was read at, in milliseconds since the Unix epoch.
+    std::int64_t sent_ms = 0;
+    // Payload compressed once by the home shard for sessions that negotiated it, empty if not compressed.
+    std::string compressed;
+    // Replayed history written to a compressing session as one stream; the bundle has no text of its own.
+    std::vector<std::shared_ptr<const Message>> bundle;
+};
+
+using MessagePtr = std::shared_ptr<const Message>;
+
+/**
+ * @brief Create a server notice.
+ * @param text Message text.
+ * @param received When the server finished reading it.
+ * @param trace_id Trace id if sampled for tracing.
+ * @return MessagePtr Shared message.
+ */
+inline MessagePtr make_message(std::string text, std::chrono::steady_clock::time_point received = {},
+                               std::uint64_t trace_id = 0) {
+    auto message = std::make_shared<Message>();
+    message->text = std::move(text);
+    message->received = received;
+    message->trace_id = trace_id;
+    return message;
+}
+
+/**
+ * @brief Create a room message on behalf of a user.
+ * The object itself is not const, so the home shard of a room may stamp its sequence number
+ * before anyone else sees it.
+ * @param sender Interned name of the sender.
+ * @param room Index of the room.
+ * @param payload Text the user sent.
+ * @param received When the server finished reading it.
+ * @param trace_id Trace id if sampled for tracing.
+ * @return MessagePtr Shared message.
+ */
+inline MessagePtr make_envelope(NameRef sender, std::uint32_t room, std::string payload,
+                                std::chrono::steady_clock::time_point received, std::uint64_t trace_id = 0) {
+    auto sent = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+    auto message = std::make_shared<Message>();
+    message->text = std::move(payload);
+    message->received = received;
+    message->trace_id = trace_id;
+    message->sender = std::move(sender);
+    message->room = room;
+    message->sent_ms = sent.count();
+    return message;
+}
@@ -0,0 +1,256 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "histogram.hpp"
+
+/**
+ * @brief Monotonic counter, written by its owning thread and read by scrapes from any thread.
+ */
+class Counter {
+    public:
+        void add(std::uint64_t n = 1) {
+            value_.fetch_add(n, std::memory_order_relaxed);
+        }
+        std::uint64_t get() const {
+            return value_.load(std::memory_order_relaxed);
+        }
+    private:
+        std::atomic<std::uint64_t> value_{0};
+};
+
+/**
+ * @brief Value that goes up and down.
+ */
+class Gauge {
+    public:
+        void add(std::int64_t n) {
+            value_.fetch_add(n, std::memory_order_relaxed);
+        }
+        void set(std::int64_t n) {
+            value_.store(n, std::memory_order_relaxed);
+        }
+        /**
+         * @brief Raise the value to n if it is lower.
+         */
+        void raise(std::int64_t n) {
+            std::int64_t current = value_.load(std::memory_order_relaxed);
+            while (current < n && !value_.compare_exchange_weak(current, n, std::memory_order_relaxed)) {
+            }
+        }
+        std::int64_t get() const {
+            return value_.load(std::memory_order_relaxed);
+        }
+    private:
+        std::atomic<std::int64_t> value_{0};
+};
+
+/**
+ * @brief Counters describing the work of one event loop.
+ * Every shard updates only its own instance, so the hot path touches no shared cache line
+ * and takes no lock; a scrape adds up the instances of all shards.
+ */
+struct Metrics {
+    // Upper bounds of the send queue depth buckets, the last bucket is +Inf.
+    static constexpr std::array<std::size_t, 11> depth_bounds = {0, 1, 2, 4, 8, 16, 32, 64, 128, 256, 1024};
+
+    explicit Metrics(std::size_t rooms) : room_members(rooms) {}
+
+    Counter accepts;
+    Gauge connections;
+    Counter messages_in;
+    Counter bytes_in;
+    Counter messages_out;
+    Counter bytes_out;
+    // Messages written compressed, and the payload bytes that saved.
+    Counter compressed_messages;
+    Counter compression_saved_bytes;
+    // Messages still queued when their session ended.
+    Counter dropped_messages;
+    // Messages that had to wait for a rate limit.
+    Counter throttled_messages;
+    // Sessions whose reader is paused by a rate limit right now.
+    Gauge throttled_sessions;
+    // Total time readers spent paused.
+    Counter throttled_ns;
+    // Times a reader used up its budget and yielded to the event loop.
+    Counter reader_yields;
+    // Slices of sliced fan-outs run so far, or tasks handed to the fan-out pool.
+    Counter fanout_slices;
+    // Longest time a single fan-out step held the event loop.
+    Gauge fanout_max_stall_ns;
+    // Delay of the latest lag probe and the largest one seen.
+    Gauge loop_lag_ns;
+    Gauge loop_lag_max_ns;
+    // Delay of every lag probe.
+    LatencyHistogram loop_lag;
+    // Stalls reported by the watchdog.
+    Counter loop_stalls;
+    // Send queue depth seen by the writer before each batch, per bucket.
+    std::array<Counter, depth_bounds.size() + 1> queue_depth;
+    Counter queue_depth_sum;
+    // Members of every room on this shard.
+    std::vector<Gauge> room_members;
+    // Time from reading a message to writing it to a recipient, one sample per recipient.
+    LatencyHistogram delivery_latency;
+    // Connections refused because their username did not fit in the intern table.
+    Counter names_refused;
+    // Joins that found their home room loaded, and those that had to load it from disk.
+    Counter room_cache_hits;
+    Counter room_cache_misses;
+    Counter room_evictions;
+    // Home rooms loaded right now.
+    Gauge rooms_loaded;
+    // Time to load an evicted room.
+    LatencyHistogram room_load;
+
+    // Quantiles reported for latency histograms.
+    static constexpr std::array<double, 4> quantiles = {0.5, 0.9, 0.99, 0.999};
+
+    /**
+     * @brief Count a send queue depth observation.
+     * @param depth Queued messages.
+     */
+    void record_queue_depth(std::size_t depth) {
+        std::size_t bucket = 0;
+        while (bucket < depth_bounds.size() && depth > depth_bounds[bucket]) {
+            ++bucket;
+        }
+        queue_depth[bucket].add();
+        queue_depth_sum.add(depth);
+    }
+    /**
+     * @brief Merge one histogram of several instances.
+     * @param shards Instances of all shards.
+     * @param member Histogram to merge.
+     * @return LatencyHistogram::Snapshot Merged counts.
+     */
+    static LatencyHistogram::Snapshot merge(const std::vector<const Metrics*>& shards, LatencyHistogram Metrics::* member) {
+        LatencyHistogram::Snapshot snapshot;
+        for (auto* shard : shards) {
+            snapshot.merge(shard->*member);
+        }
+        return snapshot;
+    }
+    /**
+     * @brief Write one-line summaries of the delivery latency and the event loop lag.
+     * @param out Stream to write to.
+     * @param shards Instances of all shards.
+     */
+    static void print_latency(std::ostream& out, const std::vector<const Metrics*>& shards) {
+        auto print = [&out](const char* title, const LatencyHistogram::Snapshot& snapshot) {
+            out << title << snapshot.total << " samples:";
+            for (double q : quantiles) {
+                out << " p" << q * 100 << '=' << snapshot.quantile(q) / 1000.0 << "us";
+            }
+            out << " max=" << snapshot.max / 1000.0 << "us\n";
+        };
+        print("Delivery latency over ", merge(shards, &Metrics::delivery_latency));
+        print("Event loop lag over ", merge(shards, &Metrics::loop_lag));
+    }
+    /**
+     * @brief Write the sum of several instances in the Prometheus text format.
+     * @param out Stream to write to.
+     * @param shards Instances of all shards.
+     * @param rooms Label of every room.
+     */
+    static void expose(std::ostream& out, const std::vector<const Metrics*>& shards, const std::vector<std::string_view>& rooms) {
+        auto counter = [&](const char* name, const char* help, auto member, double scale = 1.0) {
+            double total = 0;
+            for (auto* shard : shards) {
+                total += static_cast<double>((shard->*member).get());
+            }
+            out << "# HELP chat_" << name << ' ' << help << '\n'
+                << "# TYPE chat_" << name << " counter\n"
+                << "chat_" << name << ' ' << total * scale << '\n';
+        };
+        auto gauge = [&](const char* name, const char* help, auto member, bool max, double scale = 1.0) {
+            double total = 0;
+            for (auto* shard : shards) {
+                double value = static_cast<double>((shard->*member).get());
+                total = max ? std::max(total, value) : total + value;
+            }
+            out << "# HELP chat_" << name << ' ' << help << '\n'
+                << "# TYPE chat_" << name << " gauge\n"
+                << "chat_" << name << ' ' << total * scale << '\n';
+        };
+        counter("accepts_total", "Accepted connections.", &Metrics::accepts);
+        gauge("connections", "Open chat sessions.", &Metrics::connections, false);
+        counter("messages_in_total", "Chat messages received.", &Metrics::messages_in);
+        counter("bytes_in_total", "Bytes of chat messages received.", &Metrics::bytes_in);
+        counter("messages_out_total", "Messages written to clients.", &Metrics::messages_out);
+        counter("bytes_out_total", "Bytes written to clients.", &Metrics::bytes_out);
+        counter("compressed_messages_total", "Messages written with a compressed payload.", &Metrics::compressed_messages);
+        counter("compression_saved_bytes_total", "Payload bytes saved by compression.", &Metrics::compression_saved_bytes);
+        counter("dropped_messages_total", "Messages still queued when their session ended.", &Metrics::dropped_messages);
+        counter("throttled_messages_total", "Messages delayed by a rate limit.", &Metrics::throttled_messages);
+        gauge("throttled_sessions", "Sessions paused by a rate limit.", &Metrics::throttled_sessions, false);
+        counter("throttled_seconds_total", "Time readers spent paused by rate limits.", &Metrics::throttled_ns, 1e-9);
+        counter("reader_yields_total", "Times a reader yielded after using up its budget.", &Metrics::reader_yields);
+        counter("fanout_slices_total", "Fan-out slices run on the event loop or the pool.", &Metrics::fanout_slices);
+        gauge("fanout_max_stall_seconds", "Longest event loop stall caused by one fan-out step.", &Metrics::fanout_max_stall_ns, true, 1e-9);
+        gauge("loop_lag_seconds", "Latest event loop lag, worst shard.", &Metrics::loop_lag_ns, true, 1e-9);
+        gauge("loop_lag_max_seconds", "Largest event loop lag seen.", &Metrics::loop_lag_max_ns, true, 1e-9);
+        counter("loop_stalls_total", "Event loop stalls caught by the watchdog.", &Metrics::loop_stalls);
+        counter("names_refused_total", "Connections refused because the table of usernames was full.", &Metrics::names_refused);
+        counter("room_cache_hits_total", "Joins that found their room loaded.", &Metrics::room_cache_hits);
+        counter("room_cache_misses_total", "Joins that loaded their room from disk.", &Metrics::room_cache_misses);
+        counter("room_evictions_total", "Idle rooms written to disk and freed.", &Metrics::room_evictions);
+        gauge("rooms_loaded", "Rooms whose history is in memory.", &Metrics::rooms_loaded, false);
+
+        out << "# HELP chat_send_queue_depth Send queue depth seen by writers before each batch.\n"
+            << "# TYPE chat_send_queue_depth histogram\n";
+        std::uint64_t cumulative = 0;
+        for (std::size_t bucket = 0; bucket <= depth_bounds.size(); ++bucket) {
+            for (auto* shard : shards) {
+                cumulative += shard->queue_depth[bucket].get();
+            }
+            out << "chat_send_queue_depth_bucket{le=\""
+                << (bucket < depth_bounds.size() ? std::to_string(depth_bounds[bucket]) : std::string("+Inf"))
+                << "\"} " << cumulative << '\n';
+        }
+        std::uint64_t sum = 0;
+        for (auto* shard : shards) {
+            sum += shard->queue_depth_sum.get();
+        }
+        out << "chat_send_queue_depth_sum " << sum << '\n'
+            << "chat_send_queue_depth_count " << cumulative << '\n';
+
+        out << "# HELP chat_room_members Members of each room.\n"
+            << "# TYPE chat_room_members gauge\n";
+        for (std::size_t room = 0; room < rooms.size(); ++room) {
+            std::int64_t members = 0;
+            for (auto* shard : shards) {
+                members += shard->room_members[room].get();
+            }
+            out << "chat_room_members{room=\"" << rooms[room] << "\"} " << members << '\n';
+        }
+
+        auto summary = [&](const char* name, const char* help, LatencyHistogram Metrics::* member) {
+            auto snapshot = merge(shards, member);
+            out << "# HELP chat_" << name << "_seconds " << help << '\n'
+                << "# TYPE chat_" << name << "_seconds summary\n";
+            for (double q : quantiles) {
+                out << "chat_" << name << "_seconds{quantile=\"" << q << "\"} " << snapshot.quantile(q) * 1e-9 << '\n';
+            }
+            out << "chat_" << name << "_seconds_sum " << static_cast<double>(snapshot.sum) * 1e-9 << '\n'
+                << "chat_" << name << "_seconds_count " << snapshot.total << '\n';
+            return snapshot;
+        };
+        auto latency = summary("delivery_latency", "Time from reading a message to writing it to each recipient.",
+                               &Metrics::delivery_latency);
+        out << "# HELP chat_delivery_latency_max_seconds Slowest delivery seen.\n"
+            << "# TYPE chat_delivery_latency_max_seconds gauge\n"
+            << "chat_delivery_latency_max_seconds " << static_cast<double>(latency.max) * 1e-9 << '\n';
+        summary("loop_lag_probe", "How late every lag probe ran.", &Metrics::loop_lag);
+        summary("room_load", "Time to load an evicted room from disk.", &Metrics::room_load);
+    }
+};
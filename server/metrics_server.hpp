@@ -0,0 +1,46 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <functional>
+#include <iostream>
+#include <string>
+
+using boost::asio::awaitable;
+using boost::asio::co_spawn;
+using boost::asio::detached;
+using boost::asio::use_awaitable;
+using boost::asio::ip::tcp;
+
+/**
+ * @brief Answer one scrape: read the request head, reply with the current metrics and close.
+ * @param socket Accepted connection.
+ * @param render Produces the body in the Prometheus text format.
+ * @return Awaitable<void>
+ */
+inline awaitable<void> metrics_scrape(tcp::socket socket, std::function<std::string()> render) {
+    try {
+        std::string request;
+        co_await boost::asio::async_read_until(socket, boost::asio::dynamic_buffer(request, 8192), "\r\n\r\n", use_awaitable);
+        std::string body = render();
+        std::string response = "HTTP/1.0 200 OK\r\n"
+                               "Content-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                               "Connection: close\r\n\r\n" + body;
+        co_await boost::asio::async_write(socket, boost::asio::buffer(response), use_awaitable);
+    } catch (boost::system::system_error& e) {
+        std::cerr << "Metrics scrape error: " << e.what() << std::endl;
+    }
+}
+
+/**
+ * @brief Serve metrics over HTTP, every request gets the whole exposition whatever its path.
+ * @param acceptor Listening acceptor.
+ * @param render Produces the body in the Prometheus text format.
+ * @return Awaitable<void>
+ */
+inline awaitable<void> metrics_server(tcp::acceptor acceptor, std::function<std::string()> render) {
+    while (true) {
+        tcp::socket socket = co_await acceptor.async_accept(use_awaitable);
+        co_spawn(acceptor.get_executor(), metrics_scrape(std::move(socket), render), detached);
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+/**
+ * @brief Unbounded lock-free multi-producer/single-consumer queue.
+ * Producers append with a single atomic exchange, the consumer never waits for them.
+ * A push that is still linking its node may briefly hide the nodes pushed after it.
+ */
+template <typename T>
+class MpscQueue {
+    public:
+        MpscQueue() {
+            Node* stub = new Node;
+            head_.store(stub, std::memory_order_relaxed);
+            tail_ = stub;
+        }
+        MpscQueue(const MpscQueue&) = delete;
+        MpscQueue& operator=(const MpscQueue&) = delete;
+        ~MpscQueue() {
+            T value;
+            while (pop(value)) {
+            }
+            delete tail_;
+        }
+        /**
+         * @brief Append a value, callable from any thread.
+         * @param value Value to append.
+         */
+        void push(T value) {
+            Node* node = new Node;
+            node->value = std::move(value);
+            Node* prev = head_.exchange(node, std::memory_order_acq_rel);
+            prev->next.store(node, std::memory_order_release);
+        }
+        /**
+         * @brief Take the oldest value, consumer side only.
+         * @param value Receives the value.
+         * @return bool False if the queue is empty.
+         */
+        bool pop(T& value) {
+            Node* tail = tail_;
+            Node* next = tail->next.load(std::memory_order_acquire);
+            if (!next) {
+                return false;
+            }
+            value = std::move(next->value);
+            next->value = T();
+            tail_ = next;
+            delete tail;
+            return true;
+        }
+        /**
+         * @brief Check for pending values, consumer side only.
+         */
+        bool empty() const {
+            return tail_->next.load(std::memory_order_acquire) == nullptr;
+        }
+    private:
+        struct Node {
+            std::atomic<Node*> next{nullptr};
+            T value{};
+        };
+
+        // Producer side.
+        alignas(64) std::atomic<Node*> head_;
+        // Consumer side.
+        alignas(64) Node* tail_;
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+
+/**
+ * @brief Classic token bucket: refills at a fixed rate up to its capacity.
+ * A rate of zero means unlimited.
+ */
+class TokenBucket {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        TokenBucket() = default;
+        /**
+         * @brief Constructor for token bucket.
+         * @param rate Tokens added per second, 0 disables the bucket.
+         * @param burst Seconds worth of tokens the bucket can hold.
+         */
+        TokenBucket(double rate, double burst) :
+            rate_(rate), capacity_(std::max(rate * burst, 1.0)), tokens_(capacity_), last_(clock::now()) {}
+        /**
+         * @brief Time until the given number of tokens is available, zero if it is now.
+         * @param cost Number of tokens needed.
+         * @param now Current time.
+         */
+        clock::duration delay(double cost, clock::time_point now) {
+            if (rate_ <= 0) {
+                return clock::duration::zero();
+            }
+            refill(now);
+            // Costs above the capacity are allowed once the bucket is full, otherwise they could never pass.
+            double needed = std::min(cost, capacity_);
+            if (tokens_ >= needed) {
+                return clock::duration::zero();
+            }
+            return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>((needed - tokens_) / rate_));
+        }
+        /**
+         * @brief Take tokens, the balance may become negative for oversized costs.
+         * @param cost Number of tokens to take.
+         */
+        void consume(double cost) {
+            if (rate_ > 0) {
+                tokens_ -= cost;
+            }
+        }
+        /**
+         * @brief Tokens added per second, 0 if unlimited.
+         */
+        double rate() const {
+            return rate_;
+        }
+    private:
+        void refill(clock::time_point now) {
+            std::chrono::duration<double> elapsed = now - last_;
+            last_ = now;
+            tokens_ = std::min(capacity_, tokens_ + elapsed.count() * rate_);
+        }
+
+        double rate_ = 0;
+        double capacity_ = 1;
+        double tokens_ = 1;
+        clock::time_point last_;
+};
+
+/**
+ * @brief Pair of buckets limiting messages per second and bytes per second.
+ */
+class RateLimiter {
+    public:
+        RateLimiter() = default;
+        /**
+         * @brief Constructor for rate limiter.
+         * @param messages_per_sec Message rate, 0 is unlimited.
+         * @param bytes_per_sec Byte rate, 0 is unlimited.
+         * @param burst Seconds worth of traffic allowed in a burst.
+         */
+        RateLimiter(double messages_per_sec, double bytes_per_sec, double burst) :
+            messages_(messages_per_sec, burst), bytes_(bytes_per_sec, burst) {}
+        /**
+         * @brief Time until a message of the given size may pass, zero if it may pass now.
+         * @param bytes Message size.
+         * @param now Current time.
+         */
+        TokenBucket::clock::duration delay(std::size_t bytes, TokenBucket::clock::time_point now) {
+            return std::max(messages_.delay(1, now), bytes_.delay(static_cast<double>(bytes), now));
+        }
+        /**
+         * @brief Let a message through if both buckets allow it now, taking its tokens in the same step.
+         * @param bytes Message size.
+         * @param now Current time.
+         * @return TokenBucket::clock::duration Zero if the message passed, otherwise the time until it may.
+         */
+        TokenBucket::clock::duration acquire(std::size_t bytes, TokenBucket::clock::time_point now) {
+            auto wait = delay(bytes, now);
+            if (wait == TokenBucket::clock::duration::zero()) {
+                consume(bytes);
+            }
+            return wait;
+        }
+        /**
+         * @brief Account for a message that passed.
+         * @param bytes Message size.
+         */
+        void consume(std::size_t bytes) {
+            messages_.consume(1);
+            bytes_.consume(static_cast<double>(bytes));
+        }
+        double messages_per_sec() const {
+            return messages_.rate();
+        }
+        double bytes_per_sec() const {
+            return bytes_.rate();
+        }
+    private:
+        TokenBucket messages_;
+        TokenBucket bytes_;
+};
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <list>
+#include <unordered_map>
+
+/**
+ * @brief A room whose state can be written to disk and loaded again when it is needed.
+ */
+class CachedRoom {
+    public:
+        /**
+         * @brief Write the room's state out and free it, unless the room is in use.
+         * @return bool False if the room has members or work in flight and stays loaded.
+         */
+        virtual bool evict() = 0;
+        virtual ~CachedRoom() {}
+};
+
+/**
+ * @brief Loaded rooms of one shard, least recently used last.
+ * Rooms unused for the idle time are evicted from the end of the list while more than the
+ * capacity are loaded. A room that refuses is in use and moves back to the front, so
+ * every sweep only looks at rooms that may be idle. Must be used from its shard only.
+ */
+class RoomCache {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        /**
+         * @brief Constructor for room cache.
+         * @param capacity Rooms kept loaded however idle they are.
+         * @param enabled Evict rooms at all; a disabled cache ignores every call.
+         */
+        RoomCache(std::size_t capacity, bool enabled) : capacity_(capacity), enabled_(enabled) {}
+        RoomCache(const RoomCache&) = delete;
+        RoomCache& operator=(const RoomCache&) = delete;
+        bool enabled() const {
+            return enabled_;
+        }
+        /**
+         * @brief Number of rooms loaded.
+         */
+        std::size_t size() const {
+            return rooms_.size();
+        }
+        /**
+         * @brief Mark a loaded room as used now, adding it if it is new.
+         */
+        void touch(CachedRoom* room, clock::time_point now) {
+            if (!enabled_) {
+                return;
+            }
+            auto it = index_.find(room);
+            if (it == index_.end()) {
+                rooms_.push_front({room, now});
+                index_.emplace(room, rooms_.begin());
+                return;
+            }
+            it->second->used = now;
+            rooms_.splice(rooms_.begin(), rooms_, it->second);
+        }
+        /**
+         * @brief Evict idle rooms, least recently used first, until at most the capacity are loaded.
+         * @param now Current time.
+         * @param idle Time a room must have been unused.
+         * @return std::size_t Rooms evicted.
+         */
+        std::size_t trim(clock::time_point now, clock::duration idle) {
+            std::size_t evicted = 0;
+            // Each room is looked at once: a room that refuses goes to the front.
+            std::size_t remaining = rooms_.size();
+            while (enabled_ && rooms_.size() > capacity_ && remaining-- > 0 && now - rooms_.back().used >= idle) {
+                CachedRoom* room = rooms_.back().room;
+                if (room->evict()) {
+                    index_.erase(room);
+                    rooms_.pop_back();
+                    ++evicted;
+                } else {
+                    touch(room, now);
+                }
+            }
+            return evicted;
+        }
+    private:
+        struct Entry {
+            CachedRoom* room;
+            clock::time_point used;
+        };
+
+        std::size_t capacity_;
+        bool enabled_;
+        std::list<Entry> rooms_;
+        std::unordered_map<CachedRoom*, std::list<Entry>::iterator> index_;
+};
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "handoff.hpp"
+
+/**
+ * @brief State of a room kept across restarts.
+ */
+struct RoomState {
+    std::string name;
+    std::uint64_t last_seq = 0;
+    // Sequence numbers the room's search index segments on disk are named after.
+    std::vector<std::uint64_t> index_roots;
+    // Recent history, oldest first.
+    std::vector<HandoffMessage> history;
+    // Set instead of the history and index roots for an evicted room: the file holding them.
+    std::string file;
+};
+
+/**
+ * @brief Immutable, memory-mapped snapshot of the state of every room.
+ * Loading it costs a mapping and one pass that checks the bounds, however long the rooms have
+ * existed; a room's state is then read in place when the room is built.
+ * File layout, all numbers 64-bit: magic, room count, message count, root count; per room,
+ * sorted by name, the offset and length of its name, its last sequence number, and the index
+ * and count of its first history message and first index root; per message its sequence
+ * number, time, and the offset and length of its sender and text; the index roots; then the
+ * names, senders and texts themselves.
+ */
+class RoomSnapshot {
+    public:
+        /**
+         * @brief A history message, pointing into the mapping.
+         */
+        struct MessageView {
+            std::uint64_t seq;
+            std::int64_t sent_ms;
+            std::string_view sender;
+            std::string_view text;
+        };
+
+        /**
+         * @brief Write a snapshot file.
+         * @param path File to create, written under a temporary name and renamed when complete.
+         * @param rooms State of every room, reordered by name.
+         * @return bool False if the file could not be written.
+         */
+        static bool write(const std::string& path, std::vector<RoomState>& rooms) {
+            std::sort(rooms.begin(), rooms.end(), [](const RoomState& a, const RoomState& b) { return a.name < b.name; });
+            std::size_t messages = 0, roots = 0;
+            for (auto& room : rooms) {
+                messages += room.history.size();
+                roots += room.index_roots.size();
+            }
+            std::vector<std::uint64_t> table = {magic, rooms.size(), messages, roots};
+            table.reserve(header + rooms.size() * room_fields + messages * message_fields + roots);
+            std::uint64_t blob = (header + rooms.size() * room_fields + messages * message_fields + roots) * sizeof(std::uint64_t);
+            std::string data;
+            std::uint64_t message = 0, root = 0;
+            for (auto& room : rooms) {
+                table.insert(table.end(), {blob + data.size(), room.name.size(), room.last_seq,
+                                           message, room.history.size(), root, room.index_roots.size()});
+                data += room.name;
+                message += room.history.size();
+                root += room.index_roots.size();
+            }
+            for (auto& room : rooms) {
+                for (auto& entry : room.history) {
+                    table.insert(table.end(), {entry.seq, static_cast<std::uint64_t>(entry.sent_ms), blob + data.size(), entry.sender.size()});
+                    data += entry.sender;
+                    table.insert(table.end(), {blob + data.size(), entry.text.size()});
+                    data += entry.text;
+                }
+            }
+            for (auto& room : rooms) {
+                table.insert(table.end(), room.index_roots.begin(), room.index_roots.end());
+            }
+            // Unique per process: an old and a new server may both be writing during a hot restart.
+            std::string temporary = path + "." + std::to_string(::getpid()) + ".tmp";
+            std::FILE* file = std::fopen(temporary.c_str(), "wb");
+            if (!file) {
+                return false;
+            }
+            bool ok = std::fwrite(table.data(), sizeof(std::uint64_t), table.size(), file) == table.size()
+                && std::fwrite(data.data(), 1, data.size(), file) == data.size();
+            ok = std::fclose(file) == 0 && ok;
+            if (!ok || std::rename(temporary.c_str(), path.c_str()) != 0) {
+                std::remove(temporary.c_str());
+                return false;
+            }
+            return true;
+        }
+        /**
+         * @brief Map a snapshot file.
+         * @return std::unique_ptr<RoomSnapshot> Snapshot, null if the file is missing or damaged.
+         */
+        static std::unique_ptr<RoomSnapshot> open(const std::string& path) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return nullptr;
+            }
+            struct stat st;
+            void* map = MAP_FAILED;
+            if (::fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(header * sizeof(std::uint64_t))) {
+                map = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            }
+            ::close(fd);
+            if (map == MAP_FAILED) {
+                return nullptr;
+            }
+            std::unique_ptr<RoomSnapshot> snapshot(new RoomSnapshot(static_cast<const char*>(map), static_cast<std::size_t>(st.st_size)));
+            return snapshot->valid() ? std::move(snapshot) : nullptr;
+        }
+        RoomSnapshot(const RoomSnapshot&) = delete;
+        RoomSnapshot& operator=(const RoomSnapshot&) = delete;
+        ~RoomSnapshot() {
+            ::munmap(const_cast<char*>(data_), size_);
+        }
+        std::size_t rooms() const {
+            return rooms_;
+        }
+        /**
+         * @brief Position of a room in the snapshot.
+         * @param name Name of the room.
+         * @return std::optional<std::size_t> Its position, none if the room is not in the snapshot.
+         */
+        std::optional<std::size_t> find(std::string_view name) const {
+            std::size_t low = 0, high = rooms_;
+            while (low < high) {
+                std::size_t middle = (low + high) / 2;
+                int order = this->name(middle).compare(name);
+                if (order == 0) {
+                    return middle;
+                }
+                if (order < 0) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+            return std::nullopt;
+        }
+        std::string_view name(std::size_t room) const {
+            std::size_t entry = header + room * room_fields;
+            return bytes(number(entry), number(entry + 1));
+        }
+        std::uint64_t last_seq(std::size_t room) const {
+            return number(header + room * room_fields + 2);
+        }
+        std::vector<std::uint64_t> index_roots(std::size_t room) const {
+            std::size_t entry = header + room * room_fields;
+            std::vector<std::uint64_t> roots;
+            for (std::uint64_t i = 0; i < number(entry + 6); ++i) {
+                roots.push_back(number(roots_at_ + number(entry + 5) + i));
+            }
+            return roots;
+        }
+        /**
+         * @brief Copy of the state of a room.
+         * @param room Position returned by find().
+         * @return RoomState Its state.
+         */
+        RoomState state(std::size_t room) const {
+            RoomState state{std::string(name(room)), last_seq(room), index_roots(room), {}, {}};
+            for_each_message(room, [&state](const MessageView& message) {
+                state.history.push_back({message.seq, std::string(message.sender), message.sent_ms, std::string(message.text)});
+            });
+            return state;
+        }
+        /**
+         * @brief Call a function on every history message of a room, oldest first.
+         * @param room Position returned by find().
+         * @param f Takes a MessageView, valid as long as the snapshot.
+         */
+        template <typename F>
+        void for_each_message(std::size_t room, F f) const {
+            std::size_t entry = header + room * room_fields;
+            for (std::uint64_t i = 0; i < number(entry + 4); ++i) {
+                std::size_t message = messages_at_ + (number(entry + 3) + i) * message_fields;
+                f(MessageView{number(message), static_cast<std::int64_t>(number(message + 1)),
+                              bytes(number(message + 2), number(message + 3)), bytes(number(message + 4), number(message + 5))});
+            }
+        }
+    private:
+        static constexpr std::uint64_t magic = 0x31504e53544148ull;  // "HATSNP1"
+        static constexpr std::size_t header = 4;
+        static constexpr std::size_t room_fields = 7;
+        static constexpr std::size_t message_fields = 6;
+
+        RoomSnapshot(const char* data, std::size_t size) : data_(data), size_(size) {
+            rooms_ = static_cast<std::size_t>(number(1));
+            messages_ = static_cast<std::size_t>(number(2));
+            roots_ = static_cast<std::size_t>(number(3));
+            messages_at_ = header + rooms_ * room_fields;
+            roots_at_ = messages_at_ + messages_ * message_fields;
+        }
+        bool valid() const {
+            std::size_t limit = size_ / sizeof(std::uint64_t);
+            if (number(0) != magic || rooms_ > limit || messages_ > limit || roots_ > limit) {
+                return false;
+            }
+            std::size_t table = (roots_at_ + roots_) * sizeof(std::uint64_t);
+            if (table > size_) {
+                return false;
+            }
+            // Every name, sender and text must lie inside the file, every room's ranges inside the tables.
+            auto inside = [&](std::size_t index) {
+                std::uint64_t offset = number(index), length = number(index + 1);
+                return offset >= table && offset <= size_ && length <= size_ - offset;
+            };
+            for (std::size_t i = 0; i < rooms_; ++i) {
+                std::size_t entry = header + i * room_fields;
+                if (!inside(entry) || number(entry + 3) > messages_ || number(entry + 4) > messages_ - number(entry + 3)
+                    || number(entry + 5) > roots_ || number(entry + 6) > roots_ - number(entry + 5)) {
+                    return false;
+                }
+            }
+            for (std::size_t i = 0; i < messages_; ++i) {
+                std::size_t message = messages_at_ + i * message_fields;
+                if (!inside(message + 2) || !inside(message + 4)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        std::uint64_t number(std::size_t index) const {
+            std::uint64_t value;
+            std::copy_n(data_ + index * sizeof(value), sizeof(value), reinterpret_cast<char*>(&value));
+            return value;
+        }
+        std::string_view bytes(std::uint64_t offset, std::uint64_t length) const {
+            return {data_ + offset, static_cast<std::size_t>(length)};
+        }
+
+        const char* data_;
+        std::size_t size_;
+        std::size_t rooms_;
+        std::size_t messages_;
+        std::size_t roots_;
+        // Index of the first number of the message table and of the roots.
+        std::size_t messages_at_;
+        std::size_t roots_at_;
+};
@@ -0,0 +1,710 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Call f with every term of a text: lowercased runs of letters and digits.
+ * Bytes above 127 count as letters, so UTF-8 words stay whole.
+ */
+template <typename F>
+void for_each_term(std::string_view text, F f) {
+    constexpr std::size_t max_term = 64;
+    std::string term;
+    auto flush = [&] {
+        if (!term.empty() && term.size() <= max_term) {
+            f(std::string_view(term));
+        }
+        term.clear();
+    };
+    for (unsigned char c : text) {
+        if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 128) {
+            term += static_cast<char>(c);
+        } else if (c >= 'A' && c <= 'Z') {
+            term += static_cast<char>(c - 'A' + 'a');
+        } else {
+            flush();
+        }
+    }
+    flush();
+}
+
+/**
+ * @brief Append a number in LEB128 varint encoding.
+ */
+inline void put_varint(std::string& out, std::uint64_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+/**
+ * @brief Decode a posting list: the first varint is a sequence number, every other one the gap to the previous.
+ */
+inline void decode_postings(std::string_view bytes, std::vector<std::uint64_t>& seqs) {
+    seqs.clear();
+    std::uint64_t seq = 0;
+    std::uint64_t value = 0;
+    unsigned shift = 0;
+    for (unsigned char byte : bytes) {
+        value |= std::uint64_t(byte & 0x7f) << shift;
+        shift += 7;
+        if ((byte & 0x80) == 0) {
+            seq += value;
+            seqs.push_back(seq);
+            value = 0;
+            shift = 0;
+        }
+    }
+}
+
+/**
+ * @brief Immutable, memory-mapped part of a room index covering a range of messages.
+ * File layout, all numbers 64-bit: magic, message count, term count; per message its sequence
+ * number and the offset and length of its text; per term, sorted, the offset and length of the
+ * term and of its posting list; then the texts, terms and posting lists themselves.
+ */
+class IndexSegment {
+    public:
+        /**
+         * @brief Write a segment file.
+         * @param path File to create, written under a temporary name and renamed when complete.
+         * @param seqs Sequence numbers of the messages, ascending.
+         * @param texts Texts of the messages.
+         * @param postings Encoded posting list of every term.
+         * @return bool False if the file could not be written.
+         */
+        static bool write(const std::string& path, const std::vector<std::uint64_t>& seqs, const std::vector<std::string>& texts,
+                          const std::unordered_map<std::string, std::string>& postings) {
+            std::vector<const std::pair<const std::string, std::string>*> terms;
+            terms.reserve(postings.size());
+            for (auto& entry : postings) {
+                terms.push_back(&entry);
+            }
+            std::sort(terms.begin(), terms.end(), [](auto* a, auto* b) { return a->first < b->first; });
+
+            std::vector<std::uint64_t> table = {magic, seqs.size(), terms.size()};
+            std::uint64_t blob = (table.size() + seqs.size() * 3 + terms.size() * 4) * sizeof(std::uint64_t);
+            std::string data;
+            for (std::size_t i = 0; i < seqs.size(); ++i) {
+                table.insert(table.end(), {seqs[i], blob + data.size(), texts[i].size()});
+                data += texts[i];
+            }
+            for (auto* term : terms) {
+                table.insert(table.end(), {blob + data.size(), term->first.size()});
+                data += term->first;
+                table.insert(table.end(), {blob + data.size(), term->second.size()});
+                data += term->second;
+            }
+            std::string temporary = path + ".tmp";
+            std::FILE* file = std::fopen(temporary.c_str(), "wb");
+            if (!file) {
+                return false;
+            }
+            bool ok = std::fwrite(table.data(), sizeof(std::uint64_t), table.size(), file) == table.size()
+                && std::fwrite(data.data(), 1, data.size(), file) == data.size()
+                && std::fflush(file) == 0 && ::fdatasync(::fileno(file)) == 0;
+            ok = std::fclose(file) == 0 && ok;
+            if (!ok || std::rename(temporary.c_str(), path.c_str()) != 0) {
+                std::remove(temporary.c_str());
+                return false;
+            }
+            // The rename itself is durable only once the directory is.
+            auto slash = path.find_last_of('/');
+            int dir = ::open(slash == std::string::npos ? "." : path.substr(0, slash).c_str(), O_RDONLY | O_DIRECTORY);
+            if (dir >= 0) {
+                ::fsync(dir);
+                ::close(dir);
+            }
+            return true;
+        }
+        /**
+         * @brief Map a segment file.
+         * @return std::unique_ptr<IndexSegment> Segment, null if the file is missing or damaged.
+         */
+        static std::unique_ptr<IndexSegment> open(const std::string& path) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return nullptr;
+            }
+            struct stat st;
+            void* map = MAP_FAILED;
+            if (::fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(3 * sizeof(std::uint64_t))) {
+                map = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            }
+            ::close(fd);
+            if (map == MAP_FAILED) {
+                return nullptr;
+            }
+            std::unique_ptr<IndexSegment> segment(new IndexSegment(static_cast<const char*>(map), static_cast<std::size_t>(st.st_size)));
+            return segment->valid() ? std::move(segment) : nullptr;
+        }
+        IndexSegment(const IndexSegment&) = delete;
+        IndexSegment& operator=(const IndexSegment&) = delete;
+        ~IndexSegment() {
+            ::munmap(const_cast<char*>(data_), size_);
+        }
+        std::uint64_t last_seq() const {
+            return messages_ == 0 ? 0 : number(3 + (messages_ - 1) * 3);
+        }
+        /**
+         * @brief Number of messages in this segment.
+         */
+        std::size_t messages() const {
+            return messages_;
+        }
+        /**
+         * @brief Call f with the sequence number and text of every message, oldest first.
+         */
+        template <typename F>
+        void for_each_message(F f) const {
+            for (std::size_t i = 0; i < messages_; ++i) {
+                f(number(3 + i * 3), bytes(number(3 + i * 3 + 1), number(3 + i * 3 + 2)));
+            }
+        }
+        /**
+         * @brief Encoded posting list of a term, empty if the term does not occur.
+         */
+        std::string_view postings(std::string_view term) const {
+            std::size_t low = 0, high = terms_;
+            while (low < high) {
+                std::size_t middle = (low + high) / 2;
+                int order = this->term(middle).compare(term);
+                if (order == 0) {
+                    std::size_t entry = terms_at_ + middle * 4;
+                    return bytes(number(entry + 2), number(entry + 3));
+                }
+                if (order < 0) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+            return {};
+        }
+        /**
+         * @brief Text of a message of this segment.
+         */
+        std::string_view text(std::uint64_t seq) const {
+            std::size_t low = 0, high = messages_;
+            while (low < high) {
+                std::size_t middle = (low + high) / 2;
+                if (number(3 + middle * 3) < seq) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+            if (low == messages_ || number(3 + low * 3) != seq) {
+                return {};
+            }
+            return bytes(number(3 + low * 3 + 1), number(3 + low * 3 + 2));
+        }
+    private:
+        static constexpr std::uint64_t magic = 0x31584449544148ull;  // "HATIDX1"
+
+        IndexSegment(const char* data, std::size_t size) : data_(data), size_(size) {
+            messages_ = static_cast<std::size_t>(number(1));
+            terms_ = static_cast<std::size_t>(number(2));
+            terms_at_ = 3 + messages_ * 3;
+        }
+        bool valid() const {
+            if (number(0) != magic || messages_ > size_ / sizeof(std::uint64_t) || terms_ > size_ / sizeof(std::uint64_t)) {
+                return false;
+            }
+            std::size_t table = (terms_at_ + terms_ * 4) * sizeof(std::uint64_t);
+            if (table > size_) {
+                return false;
+            }
+            // Every text, term and posting list must lie inside the file.
+            auto inside = [&](std::size_t index) {
+                std::uint64_t offset = number(index), length = number(index + 1);
+                return offset >= table && offset <= size_ && length <= size_ - offset;
+            };
+            for (std::size_t i = 0; i < messages_; ++i) {
+                if (!inside(3 + i * 3 + 1)) {
+                    return false;
+                }
+            }
+            for (std::size_t i = 0; i < terms_; ++i) {
+                if (!inside(terms_at_ + i * 4) || !inside(terms_at_ + i * 4 + 2)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        std::uint64_t number(std::size_t index) const {
+            std::uint64_t value;
+            std::copy_n(data_ + index * sizeof(value), sizeof(value), reinterpret_cast<char*>(&value));
+            return value;
+        }
+        std::string_view bytes(std::uint64_t offset, std::uint64_t length) const {
+            return {data_ + offset, static_cast<std::size_t>(length)};
+        }
+        std::string_view term(std::size_t index) const {
+            std::size_t entry = terms_at_ + index * 4;
+            return bytes(number(entry), number(entry + 1));
+        }
+
+        const char* data_;
+        std::size_t size_;
+        std::size_t messages_;
+        std::size_t terms_;
+        // Index of the first number of the term table.
+        std::size_t terms_at_;
+};
+
+/**
+ * @brief Thread writing the full in-memory segments of the room indexes to disk.
+ * Queued segments are written before it stops.
+ */
+class IndexWriter {
+    public:
+        IndexWriter() : thread_([this]{ run(); }) {}
+        IndexWriter(const IndexWriter&) = delete;
+        IndexWriter& operator=(const IndexWriter&) = delete;
+        ~IndexWriter() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            wakeup_.notify_one();
+            thread_.join();
+        }
+        /**
+         * @brief Run a task on the writer thread, callable from any thread.
+         */
+        void submit(std::function<void()> task) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                tasks_.push_back(std::move(task));
+            }
+            wakeup_.notify_one();
+        }
+    private:
+        void run() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (true) {
+                wakeup_.wait(lock, [this]{ return stopping_ || !tasks_.empty(); });
+                if (tasks_.empty()) {
+                    return;
+                }
+                auto task = std::move(tasks_.front());
+                tasks_.pop_front();
+                lock.unlock();
+                task();
+                lock.lock();
+            }
+        }
+
+        std::mutex mutex_;
+        std::condition_variable wakeup_;
+        std::deque<std::function<void()>> tasks_;
+        bool stopping_ = false;
+        std::thread thread_;
+};
+
+/**
+ * @brief Inverted index over every message of a room, maintained as messages are published.
+ * New messages go into an in-memory segment; once it holds segment_size messages it is
+ * written to disk as an immutable segment by the index writer, stays searchable in memory
+ * meanwhile, and is replaced by the memory-mapped file once written. A segment file is named
+ * after the sequence number following the previous segment, so each segment leads to the next
+ * even across numbers lost in a crash. A flush writes the in-memory segment under the name it
+ * will keep but leaves it open, and a last segment found short on startup is read back into
+ * memory, so only the newest file is ever less than full and flushes rewrite it instead of
+ * adding files. Segments are mapped on startup. Queries match messages containing all of their
+ * terms, newest first. Must be used from the home shard of the room only.
+ */
+class RoomIndex {
+    public:
+        /**
+         * @brief One search result.
+         */
+        struct Match {
+            std::uint64_t seq;
+            std::string text;
+        };
+
+        /**
+         * @brief Constructor for room index, maps the segments already in the directory.
+         * @param dir Directory of this room's segments, created if missing.
+         * @param segment_size Messages per segment.
+         * @param writer Thread writing full segments, null writes them on the calling thread.
+         */
+        RoomIndex(std::string dir, std::size_t segment_size, IndexWriter* writer = nullptr) :
+            dir_(std::move(dir)), segment_size_(std::max<std::size_t>(segment_size, 1)), writer_(writer) {
+            scan();
+            reopen();
+        }
+        /**
+         * @brief Constructor for room index, maps the segments listed by a snapshot and those written after it.
+         * Does not list the directory, which takes a system call per segment: each segment leads to the next.
+         * @param dir Directory of this room's segments.
+         * @param segment_size Messages per segment.
+         * @param roots roots() at the time of the snapshot, empty scans the directory.
+         * @param writer Thread writing full segments, null writes them on the calling thread.
+         */
+        RoomIndex(std::string dir, std::size_t segment_size, const std::vector<std::uint64_t>& roots, IndexWriter* writer = nullptr) :
+            dir_(std::move(dir)), segment_size_(std::max<std::size_t>(segment_size, 1)), writer_(writer) {
+            if (roots.empty()) {
+                scan();
+                reopen();
+                return;
+            }
+            for (auto root : roots) {
+                map(root);
+            }
+            // The listed segments are gone, see what is left.
+            if (segments_.empty()) {
+                scan();
+                reopen();
+                return;
+            }
+            while (map(segments_.back()->last_seq() + 1)) {
+            }
+            reopen();
+        }
+        RoomIndex(const RoomIndex&) = delete;
+        RoomIndex& operator=(const RoomIndex&) = delete;
+        ~RoomIndex() {
+            flush();
+        }
+        /**
+         * @brief Write the messages indexed so far to disk, where another process can map them.
+         * Waits for the segments queued to the index writer, then writes the in-memory segment
+         * without sealing it.
+         */
+        void flush() {
+            for (auto& sealing : sealing_) {
+                std::unique_lock<std::mutex> lock(sealing->mutex);
+                sealing->written.wait(lock, [&]{ return sealing->done; });
+            }
+            collect();
+            if (unflushed_) {
+                checkpoint();
+            }
+        }
+        /**
+         * @brief Sequence numbers the written segments are named after, as kept by a snapshot.
+         * Segments still being written and the flushed in-memory segment follow them and are found by their chain.
+         */
+        const std::vector<std::uint64_t>& roots() const {
+            return roots_;
+        }
+        /**
+         * @brief Newest indexed sequence number, the room continues after it.
+         */
+        std::uint64_t last_seq() const {
+            if (!seqs_.empty()) {
+                return seqs_.back();
+            }
+            if (!sealing_.empty()) {
+                return sealing_.back()->seqs.back();
+            }
+            return segments_.empty() ? 0 : segments_.back()->last_seq();
+        }
+        /**
+         * @brief Index a published message.
+         * @param seq Its sequence number, greater than every indexed one.
+         * @param text Its text.
+         */
+        void add(std::uint64_t seq, std::string_view text) {
+            collect();
+            unflushed_ = true;
+            seqs_.push_back(seq);
+            texts_.emplace_back(text);
+            for_each_term(text, [&](std::string_view term) {
+                auto [it, inserted] = postings_.try_emplace(std::string(term));
+                Posting& posting = it->second;
+                if (!inserted && posting.last == seq) {
+                    return;
+                }
+                put_varint(posting.bytes, seq - posting.last);
+                posting.last = seq;
+            });
+            if (seqs_.size() >= segment_size_) {
+                seal();
+            }
+        }
+        /**
+         * @brief Find the newest messages containing every term of a query.
+         * @param query Search terms.
+         * @param limit Maximum number of results.
+         * @return std::vector<Match> Matches, newest first.
+         */
+        std::vector<Match> search(std::string_view query, std::size_t limit) {
+            collect();
+            std::vector<std::string> terms;
+            for_each_term(query, [&](std::string_view term) {
+                if (std::find(terms.begin(), terms.end(), term) == terms.end()) {
+                    terms.emplace_back(term);
+                }
+            });
+            std::vector<Match> matches;
+            if (terms.empty()) {
+                return matches;
+            }
+            std::vector<std::uint64_t> hits;
+            hits = intersect(terms, [this](std::string_view term) {
+                auto it = postings_.find(std::string(term));
+                return it == postings_.end() ? std::string_view() : std::string_view(it->second.bytes);
+            });
+            for (auto seq = hits.rbegin(); seq != hits.rend() && matches.size() < limit; ++seq) {
+                auto position = std::lower_bound(seqs_.begin(), seqs_.end(), *seq) - seqs_.begin();
+                matches.push_back({*seq, texts_[static_cast<std::size_t>(position)]});
+            }
+            for (auto sealing = sealing_.rbegin(); sealing != sealing_.rend() && matches.size() < limit; ++sealing) {
+                const Sealing& segment = **sealing;
+                hits = intersect(terms, [&](std::string_view term) {
+                    auto it = segment.postings.find(std::string(term));
+                    return it == segment.postings.end() ? std::string_view() : std::string_view(it->second);
+                });
+                for (auto seq = hits.rbegin(); seq != hits.rend() && matches.size() < limit; ++seq) {
+                    auto position = std::lower_bound(segment.seqs.begin(), segment.seqs.end(), *seq) - segment.seqs.begin();
+                    matches.push_back({*seq, segment.texts[static_cast<std::size_t>(position)]});
+                }
+            }
+            for (auto segment = segments_.rbegin(); segment != segments_.rend() && matches.size() < limit; ++segment) {
+                hits = intersect(terms, [&](std::string_view term) { return (*segment)->postings(term); });
+                for (auto seq = hits.rbegin(); seq != hits.rend() && matches.size() < limit; ++seq) {
+                    matches.push_back({*seq, std::string((*segment)->text(*seq))});
+                }
+            }
+            return matches;
+        }
+    private:
+        struct Posting {
+            std::string bytes;
+            // Last sequence number in the list, the next one is encoded relative to it.
+            std::uint64_t last = 0;
+        };
+        /**
+         * @brief A full in-memory segment, searched in memory until the index writer wrote and mapped it.
+         * Its messages are only read once it is queued; the mapped segment is handed over under the mutex.
+         */
+        struct Sealing {
+            std::uint64_t root;
+            std::string path;
+            std::vector<std::uint64_t> seqs;
+            std::vector<std::string> texts;
+            std::unordered_map<std::string, std::string> postings;
+            std::mutex mutex;
+            std::condition_variable written;
+            bool done = false;
+            // Null if the file could not be written.
+            std::unique_ptr<IndexSegment> segment;
+        };
+        /**
+         * @brief Sequence numbers present in the posting lists of all terms, ascending.
+         */
+        template <typename Lookup>
+        static std::vector<std::uint64_t> intersect(const std::vector<std::string>& terms, Lookup lookup) {
+            std::vector<std::uint64_t> result, list, both;
+            for (std::size_t i = 0; i < terms.size(); ++i) {
+                std::string_view bytes = lookup(terms[i]);
+                if (bytes.empty()) {
+                    return {};
+                }
+                decode_postings(bytes, i == 0 ? result : list);
+                if (i > 0) {
+                    both.clear();
+                    std::set_intersection(result.begin(), result.end(), list.begin(), list.end(), std::back_inserter(both));
+                    result.swap(both);
+                    if (result.empty()) {
+                        return result;
+                    }
+                }
+            }
+            return result;
+        }
+        /**
+         * @brief Map every segment in the directory.
+         */
+        void scan() {
+            std::error_code ec;
+            std::filesystem::create_directories(dir_, ec);
+            std::vector<std::uint64_t> roots;
+            for (auto& entry : std::filesystem::directory_iterator(dir_, ec)) {
+                std::string stem = entry.path().stem().string();
+                if (entry.path().extension() == ".seg" && !stem.empty() && stem.find_first_not_of("0123456789") == std::string::npos) {
+                    roots.push_back(std::stoull(stem));
+                }
+            }
+            // Segments are named after sequence numbers, so name order is message order.
+            std::sort(roots.begin(), roots.end());
+            for (auto root : roots) {
+                map(root);
+            }
+        }
+        /**
+         * @brief Map a segment after the ones already mapped.
+         * @param root Sequence number its file is named after.
+         * @return bool False if the file is missing or damaged.
+         */
+        bool map(std::uint64_t root) {
+            std::string path = segment_path(root);
+            if (auto segment = IndexSegment::open(path)) {
+                segments_.push_back(std::move(segment));
+                roots_.push_back(root);
+                return true;
+            }
+            std::error_code ec;
+            if (std::filesystem::exists(path, ec)) {
+                std::cerr << "Skipping damaged index segment " << path << std::endl;
+            }
+            return false;
+        }
+        /**
+         * @brief File of a segment.
+         */
+        std::string segment_path(std::uint64_t root) const {
+            char name[32];
+            std::snprintf(name, sizeof(name), "%020llu.seg", static_cast<unsigned long long>(root));
+            return dir_ + "/" + name;
+        }
+        /**
+         * @brief Sequence number the in-memory segment is named after.
+         */
+        std::uint64_t next_root() const {
+            if (!sealing_.empty()) {
+                return sealing_.back()->seqs.back() + 1;
+            }
+            if (reopened_root_) {
+                return *reopened_root_;
+            }
+            return segments_.empty() ? seqs_.front() : segments_.back()->last_seq() + 1;
+        }
+        /**
+         * @brief Read a short last segment back into the in-memory segment, which replaces its file once it is written again.
+         */
+        void reopen() {
+            if (segments_.empty() || segments_.back()->messages() >= segment_size_) {
+                return;
+            }
+            auto segment = std::move(segments_.back());
+            segments_.pop_back();
+            std::uint64_t root = roots_.back();
+            roots_.pop_back();
+            segment->for_each_message([this](std::uint64_t seq, std::string_view text) { add(seq, text); });
+            reopened_root_ = root;
+            // Already on disk as it is.
+            unflushed_ = false;
+        }
+        /**
+         * @brief Write the in-memory segment under the name it keeps, leaving it in memory.
+         * A later flush or the full segment replaces the file.
+         */
+        void checkpoint() {
+            std::unordered_map<std::string, std::string> postings;
+            for (auto& [term, posting] : postings_) {
+                postings.emplace(term, posting.bytes);
+            }
+            std::string path = segment_path(next_root());
+            if (IndexSegment::write(path, seqs_, texts_, postings)) {
+                unflushed_ = false;
+            } else {
+                std::cerr << "Cannot write index segment " << path << std::endl;
+            }
+        }
+        /**
+         * @brief Hand the in-memory segment to the index writer, which writes it to disk and maps it.
+         */
+        void seal() {
+            if (seqs_.empty()) {
+                return;
+            }
+            auto sealing = std::make_shared<Sealing>();
+            sealing->root = next_root();
+            reopened_root_.reset();
+            unflushed_ = false;
+            sealing->path = segment_path(sealing->root);
+            sealing->seqs.swap(seqs_);
+            sealing->texts.swap(texts_);
+            for (auto& [term, posting] : postings_) {
+                sealing->postings.emplace(term, std::move(posting.bytes));
+            }
+            postings_.clear();
+            sealing_.push_back(sealing);
+            if (writer_) {
+                writer_->submit([sealing]{ write(*sealing); });
+            } else {
+                write(*sealing);
+                collect();
+            }
+        }
+        /**
+         * @brief Write a full segment to disk and map it, on the index writer.
+         */
+        static void write(Sealing& sealing) {
+            std::unique_ptr<IndexSegment> segment;
+            if (IndexSegment::write(sealing.path, sealing.seqs, sealing.texts, sealing.postings)) {
+                segment = IndexSegment::open(sealing.path);
+            }
+            {
+                std::lock_guard<std::mutex> lock(sealing.mutex);
+                sealing.segment = std::move(segment);
+                sealing.done = true;
+            }
+            sealing.written.notify_all();
+        }
+        /**
+         * @brief Replace the in-memory segments the index writer finished by their mapped files, oldest first.
+         */
+        void collect() {
+            while (!sealing_.empty()) {
+                Sealing& sealing = *sealing_.front();
+                {
+                    std::lock_guard<std::mutex> lock(sealing.mutex);
+                    if (!sealing.done) {
+                        return;
+                    }
+                }
+                if (!sealing.segment) {
+                    std::cerr << "Cannot write index segment " << sealing.path << ", its messages are no longer searchable" << std::endl;
+                } else {
+                    segments_.push_back(std::move(sealing.segment));
+                    roots_.push_back(sealing.root);
+                }
+                sealing_.pop_front();
+            }
+        }
+
+        std::string dir_;
+        std::size_t segment_size_;
+        IndexWriter* writer_;
+        // Full segments queued to the index writer, oldest first.
+        std::deque<std::shared_ptr<Sealing>> sealing_;
+        // Written segments, oldest first.
+        std::vector<std::unique_ptr<IndexSegment>> segments_;
+        // Sequence numbers the segment files are named after.
+        std::vector<std::uint64_t> roots_;
+        // Name of the short segment file the in-memory segment was read back from.
+        std::optional<std::uint64_t> reopened_root_;
+        // The in-memory segment changed since it was last written.
+        bool unflushed_ = false;
+        // The in-memory segment.
+        std::vector<std::uint64_t> seqs_;
+        std::vector<std::string> texts_;
+        std::unordered_map<std::string, Posting> postings_;
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <pthread.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+
+#include "buffer_pool.hpp"
+#include "compression.hpp"
+#include "config.hpp"
+#include "intern_table.hpp"
+#include "mailbox.hpp"
+#include "metrics.hpp"
+#include "room_cache.hpp"
+#include "search_index.hpp"
+#include "timer_wheel.hpp"
+#include "work_stealing.hpp"
+
+/**
+ * @brief Proof of life of an event loop, written by its lag probe and read by the stall watchdog.
+ */
+struct LoopHeartbeat {
+    // Thread running the event loop.
+    std::atomic<pthread_t> thread{};
+    // steady_clock time of the latest probe in nanoseconds, 0 before the first one.
+    std::atomic<std::int64_t> beat_ns{0};
+
+    void beat(std::chrono::steady_clock::time_point now) {
+        beat_ns.store(std::chrono::nanoseconds(now.time_since_epoch()).count(), std::memory_order_release);
+    }
+};
+
+class ChatSession;
+class RoomSnapshot;
+
+/**
+ * @brief State shared by all sessions of one event loop.
+ */
+struct ServerContext {
+    const ServerConfig& config;
+    BufferPool buffers;
+    TimerWheel wheel;
+    Metrics metrics;
+    LoopHeartbeat heartbeat;
+    // Home rooms of this shard that are loaded, in the order they were used.
+    RoomCache room_cache;
+    // Pool for fan-out of large rooms, shared by all shards, may be null.
+    WorkStealingPool* fanout_pool = nullptr;
+    // Online users and mailboxes of offline ones, shared by all shards, may be null.
+    Mailboxes* mailboxes = nullptr;
+    // Thread writing full search index segments, shared by all shards, may be null.
+    IndexWriter* index_writer = nullptr;
+    // Compressor for sessions that negotiated compression, shared by all shards, may be null.
+    const MessageCompressor* compressor = nullptr;
+    // Ids of usernames and room names, shared by all shards.
+    InternTable* names = nullptr;
+    // Snapshot the rooms restore their state from while they are built, null afterwards.
+    const RoomSnapshot* snapshot = nullptr;
+    // Open sessions of this event loop by id, for the admin console.
+    std::map<std::uint64_t, ChatSession*> sessions;
+
+    /**
+     * @brief Constructor for server context.
+     * @param cfg Server settings.
+     * @param shard Index of the shard owning this context.
+     * @param shard_count Number of shards.
+     */
+    ServerContext(const ServerConfig& cfg, std::size_t shard = 0, std::size_t shard_count = 1) :
+        config(cfg), buffers(cfg.max_message_size, cfg.buffer_pool_size), wheel(cfg.timer_tick),
+        metrics(cfg.ports.size()), room_cache(cfg.room_cache_size, !cfg.room_cache_dir.empty()), shard_(shard), shard_count_(shard_count) {}
+    /**
+     * @brief Id for a new session, unique across shards; id % shard_count is the owning shard.
+     */
+    std::uint64_t next_session_id() {
+        return sessions_started_++ * shard_count_ + shard_;
+    }
+private:
+    std::size_t shard_;
+    std::size_t shard_count_;
+    std::uint64_t sessions_started_ = 0;
+};
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "message.hpp"
+#include "server_context.hpp"
+#include "spsc_queue.hpp"
+#include "users.hpp"
+
+/**
+ * @brief Message travelling between shards.
+ */
+struct ShardMail {
+    enum class Kind {
+        // Replica -> home shard: a local session posted a message.
+        publish,
+        // Home shard -> replica: a sequenced message for local members.
+        broadcast,
+        // Replica -> home shard: the replica got its first local member.
+        subscribe,
+        // Replica -> home shard: the replica lost its last local member.
+        unsubscribe,
+        // Home shard -> replica: recent history answering a subscribe.
+        history,
+        // Replica -> home shard: a local session searches the room.
+        search,
+    };
+    Kind kind = Kind::publish;
+    std::size_t room = 0;
+    std::size_t from = 0;
+    MessagePtr message;
+    std::vector<MessagePtr> history;
+    // Session that asked, for a search.
+    std::shared_ptr<Users> user;
+};
+
+/**
+ * @brief Room state kept by one shard, receiving the mail addressed to the room.
+ */
+class ShardRoom {
+    public:
+        /**
+         * @brief Handle mail from another shard.
+         * @param mail Mail to handle.
+         */
+        virtual void on_mail(ShardMail& mail) = 0;
+        virtual ~ShardRoom() {}
+};
+
+class ShardGroup;
+
+/**
+ * @brief One event loop pinned to one thread, owning its sessions and room replicas.
+ * Shards share nothing; they talk only through one SPSC queue per ordered pair of shards.
+ */
+class Shard {
+    public:
+        /**
+         * @brief Constructor for shard.
+         * @param id Index of the shard.
+         * @param group All shards of the server.
+         * @param config Server settings.
+         * @param shard_count Number of shards in the group.
+         */
+        Shard(std::size_t id, ShardGroup& group, const ServerConfig& config, std::size_t shard_count) :
+            id_(id), group_(group), context_(config, id, shard_count), io_context_(1) {
+            for (std::size_t i = 0; i < shard_count; ++i) {
+                inbox_.push_back(std::make_unique<SpscQueue<ShardMail>>());
+            }
+        }
+        ~Shard() {
+            // Sessions referenced by the rooms must go before the io_context they belong to.
+            rooms_.clear();
+        }
+        std::size_t id() const {
+            return id_;
+        }
+        boost::asio::io_context& io_context() {
+            return io_context_;
+        }
+        ServerContext& context() {
+            return context_;
+        }
+        /**
+         * @brief Register the replica of a room, rooms are numbered in registration order.
+         * @param room Room replica.
+         */
+        void add_room(std::unique_ptr<ShardRoom> room) {
+            rooms_.push_back(std::move(room));
+        }
+        ShardRoom& room(std::size_t index) {
+            return *rooms_[index];
+        }
+        std::size_t shard_count() const {
+            return inbox_.size();
+        }
+        /**
+         * @brief Send mail to another shard, must be called on this shard's thread.
+         * @param to Receiving shard.
+         * @param mail Mail to send.
+         */
+        void send(std::size_t to, ShardMail mail);
+    private:
+        friend class ShardGroup;
+        /**
+         * @brief Make sure the shard drains its inboxes soon, callable from any thread.
+         */
+        void notify() {
+            if (!drain_scheduled_.exchange(true)) {
+                boost::asio::post(io_context_, [this]{ drain(); });
+            }
+        }
+        /**
+         * @brief Handle queued mail, a bounded amount per turn.
+         */
+        void drain() {
+            constexpr std::size_t budget = 256;
+            std::size_t handled = 0;
+            bool more = true;
+            while (more && handled < budget) {
+                more = false;
+                for (auto& inbox : inbox_) {
+                    ShardMail mail;
+                    if (inbox->pop(mail)) {
+                        rooms_[mail.room]->on_mail(mail);
+                        ++handled;
+                        more = true;
+                    }
+                }
+            }
+            if (more) {
+                boost::asio::post(io_context_, [this]{ drain(); });
+                return;
+            }
+            drain_scheduled_.store(false);
+            // A producer may have pushed after the last pop but seen the flag still set.
+            for (auto& inbox : inbox_) {
+                if (!inbox->empty()) {
+                    notify();
+                    return;
+                }
+            }
+        }
+
+        std::size_t id_;
+        ShardGroup& group_;
+        ServerContext context_;
+        boost::asio::io_context io_context_;
+        std::vector<std::unique_ptr<ShardRoom>> rooms_;
+        // inbox_[i] receives mail from shard i.
+        std::vector<std::unique_ptr<SpscQueue<ShardMail>>> inbox_;
+        std::atomic<bool> drain_scheduled_{false};
+};
+
+/**
+ * @brief All shards of the server and their threads.
+ */
+class ShardGroup {
+    public:
+        /**
+         * @brief Constructor for shard group.
+         * @param config Server settings, config.shards shards are created.
+         */
+        explicit ShardGroup(const ServerConfig& config) {
+            std::size_t count = config.shards > 0 ? config.shards : std::max(1u, std::thread::hardware_concurrency());
+            for (std::size_t i = 0; i < count; ++i) {
+                shards_.push_back(std::make_unique<Shard>(i, *this, config, count));
+            }
+        }
+        ~ShardGroup() {
+            stop();
+            for (auto& thread : threads_) {
+                thread.join();
+            }
+        }
+        std::size_t size() const {
+            return shards_.size();
+        }
+        Shard& operator[](std::size_t index) {
+            return *shards_[index];
+        }
+        /**
+         * @brief Run shard 0 on the calling thread and every other shard on its own thread.
+         * @param pin Bind shard i to CPU i.
+         */
+        void run(bool pin) {
+            for (std::size_t i = 1; i < shards_.size(); ++i) {
+                threads_.emplace_back([this, i, pin]{
+                    if (pin) {
+                        pin_thread(i);
+                    }
+                    auto guard = boost::asio::make_work_guard(shards_[i]->io_context());
+                    shards_[i]->io_context().run();
+                });
+            }
+            if (pin) {
+                pin_thread(0);
+            }
+            shards_[0]->io_context().run();
+            stop();
+            for (auto& thread : threads_) {
+                thread.join();
+            }
+            threads_.clear();
+        }
+        /**
+         * @brief Stop the event loops of all shards.
+         */
+        void stop() {
+            for (auto& shard : shards_) {
+                shard->io_context().stop();
+            }
+        }
+        /**
+         * @brief Counters of all shards, safe to read from any thread.
+         */
+        std::vector<const Metrics*> metrics() {
+            std::vector<const Metrics*> all;
+            for (auto& shard : shards_) {
+                all.push_back(&shard->context().metrics);
+            }
+            return all;
+        }
+    private:
+        friend class Shard;
+        static void pin_thread(std::size_t cpu) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu % std::max(1u, std::thread::hardware_concurrency()), &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+
+        std::vector<std::unique_ptr<Shard>> shards_;
+        std::vector<std::thread> threads_;
+};
+
+inline void Shard::send(std::size_t to, ShardMail mail) {
+    mail.from = id_;
+    Shard& target = *group_.shards_[to];
+    target.inbox_[id_]->push(std::move(mail));
+    target.notify();
+}
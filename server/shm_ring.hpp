@@ -0,0 +1,279 @@
+#pragma once
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+/**
+ * @brief Single-producer/single-consumer ring of messages in memory shared by two processes.
+ * A local publisher writes records of a 4-byte length and the message text; the server reads
+ * them in place. Neither side makes a system call per message: the consumer only sleeps on
+ * the eventfd after it found the ring empty and said so in the header, and the producer only
+ * writes the eventfd when it finds the consumer asleep. The memory is a memfd whose file
+ * descriptor, together with the eventfd, is passed over a Unix domain socket.
+ * The producer is not trusted: every record is checked against the ring before it is read.
+ */
+class ShmRing {
+    public:
+        /**
+         * @brief Create a new ring, the consumer's end.
+         * @param capacity Bytes of records, rounded up to a power of two.
+         * @return std::unique_ptr<ShmRing> The ring.
+         */
+        static std::unique_ptr<ShmRing> create(std::size_t capacity) {
+            std::size_t size = 4096;
+            while (size < capacity) {
+                size *= 2;
+            }
+            int memory = ::memfd_create("chat-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+            if (memory < 0) {
+                throw std::system_error(errno, std::generic_category(), "Cannot create a shared ring");
+            }
+            // Sealed, so the producer cannot shrink the memory under the server's mapping.
+            if (::ftruncate(memory, static_cast<off_t>(sizeof(Header) + size)) != 0 ||
+                ::fcntl(memory, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+                int error = errno;
+                ::close(memory);
+                throw std::system_error(error, std::generic_category(), "Cannot size a shared ring");
+            }
+            int event = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            if (event < 0) {
+                int error = errno;
+                ::close(memory);
+                throw std::system_error(error, std::generic_category(), "Cannot create a ring eventfd");
+            }
+            auto ring = std::make_unique<ShmRing>(memory, event);
+            ring->header_->capacity = size;
+            ring->capacity_ = size;
+            return ring;
+        }
+        /**
+         * @brief Receive a ring passed by send(), the producer's end.
+         * Reads the line sent along with it, up to and including its line break.
+         * @param socket Connected Unix domain socket.
+         * @param line Receives the line without the line break.
+         * @return std::unique_ptr<ShmRing> The ring, null if none came with the line.
+         */
+        static std::unique_ptr<ShmRing> receive(int socket, std::string& line) {
+            line.clear();
+            int fds[2] = {-1, -1};
+            char byte;
+            while (true) {
+                alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))];
+                iovec io{&byte, 1};
+                msghdr message{};
+                message.msg_iov = &io;
+                message.msg_iovlen = 1;
+                message.msg_control = control;
+                message.msg_controllen = sizeof(control);
+                ssize_t n = ::recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+                if (n <= 0) {
+                    break;
+                }
+                for (cmsghdr* c = CMSG_FIRSTHDR(&message); c; c = CMSG_NXTHDR(&message, c)) {
+                    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && c->cmsg_len == CMSG_LEN(sizeof(fds))) {
+                        std::memcpy(fds, CMSG_DATA(c), sizeof(fds));
+                    }
+                }
+                if (byte == '\n') {
+                    break;
+                }
+                line += byte;
+            }
+            if (fds[0] < 0) {
+                return nullptr;
+            }
+            return std::make_unique<ShmRing>(fds[0], fds[1]);
+        }
+        /**
+         * @brief Map a ring, taking over both file descriptors.
+         * @param memory_fd memfd of the ring.
+         * @param event_fd eventfd that wakes the consumer.
+         */
+        ShmRing(int memory_fd, int event_fd) : memory_fd_(memory_fd), event_fd_(event_fd) {
+            struct stat st;
+            if (::fstat(memory_fd_, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(Header)) {
+                close_fds();
+                throw std::runtime_error("Invalid shared ring");
+            }
+            size_ = static_cast<std::size_t>(st.st_size);
+            void* mapped = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd_, 0);
+            if (mapped == MAP_FAILED) {
+                close_fds();
+                throw std::system_error(errno, std::generic_category(), "Cannot map a shared ring");
+            }
+            header_ = static_cast<Header*>(mapped);
+            data_ = static_cast<char*>(mapped) + sizeof(Header);
+            // Trust the size of the mapping, not the header the other process may write.
+            capacity_ = size_ - sizeof(Header);
+        }
+        ShmRing(const ShmRing&) = delete;
+        ShmRing& operator=(const ShmRing&) = delete;
+        ~ShmRing() {
+            ::munmap(header_, size_);
+            close_fds();
+        }
+        int event_fd() const {
+            return event_fd_;
+        }
+        std::size_t capacity() const {
+            return capacity_;
+        }
+        /**
+         * @brief Pass the ring to the producer with a line of text.
+         * @param socket Connected Unix domain socket.
+         * @param line Line to send, with its line break.
+         * @return bool False if the line and descriptors could not be sent at once.
+         */
+        bool send(int socket, std::string_view line) const {
+            int fds[2] = {memory_fd_, event_fd_};
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+            iovec io{const_cast<char*>(line.data()), line.size()};
+            msghdr message{};
+            message.msg_iov = &io;
+            message.msg_iovlen = 1;
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            cmsghdr* c = CMSG_FIRSTHDR(&message);
+            c->cmsg_level = SOL_SOCKET;
+            c->cmsg_type = SCM_RIGHTS;
+            c->cmsg_len = CMSG_LEN(sizeof(fds));
+            std::memcpy(CMSG_DATA(c), fds, sizeof(fds));
+            return ::sendmsg(socket, &message, MSG_NOSIGNAL) == static_cast<ssize_t>(line.size());
+        }
+        /**
+         * @brief Append a message, producer only.
+         * @param text Message text.
+         * @return bool False if the ring is too full, the producer retries later.
+         */
+        bool push(std::string_view text) {
+            std::uint64_t head = header_->head.load(std::memory_order_relaxed);
+            std::uint64_t tail = header_->tail.load(std::memory_order_acquire);
+            std::size_t record = record_size(text.size());
+            if (record > capacity_ - (head - tail)) {
+                return false;
+            }
+            auto length = static_cast<std::uint32_t>(text.size());
+            copy_in(head, &length, sizeof(length));
+            copy_in(head + sizeof(length), text.data(), text.size());
+            header_->head.store(head + record, std::memory_order_release);
+            // Pairs with the fence in sleep(): either the consumer sees the record or we see it asleep.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (header_->sleeping.load(std::memory_order_relaxed) && header_->sleeping.exchange(0)) {
+                std::uint64_t one = 1;
+                [[maybe_unused]] ssize_t n = ::write(event_fd_, &one, sizeof(one));
+            }
+            return true;
+        }
+        /**
+         * @brief Oldest message, consumer only.
+         * @param text Receives the message, in place unless it wraps around the end of the ring.
+         * @param scratch Holds a message that wraps around.
+         * @param limit Longest message accepted.
+         * @return bool False if the ring is empty.
+         */
+        bool front(std::string_view& text, std::string& scratch, std::size_t limit) {
+            std::uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+            std::uint64_t head = header_->head.load(std::memory_order_acquire);
+            if (head == tail) {
+                return false;
+            }
+            std::uint32_t length;
+            if (head - tail > capacity_ || head - tail < sizeof(length)) {
+                throw std::runtime_error("Corrupt shared ring");
+            }
+            copy_out(tail, &length, sizeof(length));
+            if (length > limit || record_size(length) > head - tail) {
+                throw std::runtime_error("Oversized message in shared ring");
+            }
+            std::size_t start = (tail + sizeof(length)) & (capacity_ - 1);
+            if (start + length <= capacity_) {
+                text = std::string_view(data_ + start, length);
+            } else {
+                scratch.resize(length);
+                copy_out(tail + sizeof(length), scratch.data(), length);
+                text = scratch;
+            }
+            front_size_ = record_size(length);
+            return true;
+        }
+        /**
+         * @brief Drop the message returned by front(), consumer only.
+         */
+        void pop() {
+            header_->tail.store(header_->tail.load(std::memory_order_relaxed) + front_size_, std::memory_order_release);
+        }
+        /**
+         * @brief Announce that the consumer is about to wait on the eventfd, consumer only.
+         * @return bool False if a message arrived meanwhile, the consumer reads instead of waiting.
+         */
+        bool sleep() {
+            header_->sleeping.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (header_->head.load(std::memory_order_acquire) != header_->tail.load(std::memory_order_relaxed)) {
+                header_->sleeping.store(0, std::memory_order_relaxed);
+                return false;
+            }
+            return true;
+        }
+        /**
+         * @brief Reset the eventfd after a wakeup, consumer only.
+         */
+        void woken() {
+            std::uint64_t count;
+            [[maybe_unused]] ssize_t n = ::read(event_fd_, &count, sizeof(count));
+        }
+    private:
+        // Head and tail count bytes ever written and read, on cache lines of their own.
+        struct Header {
+            std::uint64_t capacity;
+            alignas(64) std::atomic<std::uint64_t> head{0};
+            alignas(64) std::atomic<std::uint64_t> tail{0};
+            alignas(64) std::atomic<std::uint32_t> sleeping{0};
+        };
+        static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "Shared rings need lock-free atomics");
+
+        // Records keep their length fields 4-byte aligned, so a length never wraps around.
+        static std::size_t record_size(std::size_t length) {
+            return (sizeof(std::uint32_t) + length + 3) & ~std::size_t(3);
+        }
+        void copy_in(std::uint64_t position, const void* from, std::size_t size) {
+            std::size_t start = position & (capacity_ - 1);
+            std::size_t first = std::min(size, capacity_ - start);
+            std::memcpy(data_ + start, from, first);
+            std::memcpy(data_, static_cast<const char*>(from) + first, size - first);
+        }
+        void copy_out(std::uint64_t position, void* to, std::size_t size) const {
+            std::size_t start = position & (capacity_ - 1);
+            std::size_t first = std::min(size, capacity_ - start);
+            std::memcpy(to, data_ + start, first);
+            std::memcpy(static_cast<char*>(to) + first, data_, size - first);
+        }
+        void close_fds() {
+            ::close(memory_fd_);
+            if (event_fd_ >= 0) {
+                ::close(event_fd_);
+            }
+        }
+
+        int memory_fd_;
+        int event_fd_;
+        std::size_t size_ = 0;
+        Header* header_ = nullptr;
+        char* data_ = nullptr;
+        std::size_t capacity_ = 0;
+        std::size_t front_size_ = 0;
+};
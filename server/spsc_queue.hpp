@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+/**
+ * @brief Unbounded lock-free single-producer/single-consumer queue.
+ * Nodes the consumer is done with are recycled by the producer, so a queue in
+ * steady state does not allocate.
+ */
+template <typename T>
+class SpscQueue {
+    public:
+        SpscQueue() {
+            Node* node = new Node;
+            tail_.store(node, std::memory_order_relaxed);
+            head_ = first_ = tail_copy_ = node;
+        }
+        SpscQueue(const SpscQueue&) = delete;
+        SpscQueue& operator=(const SpscQueue&) = delete;
+        ~SpscQueue() {
+            Node* node = first_;
+            while (node) {
+                Node* next = node->next.load(std::memory_order_relaxed);
+                delete node;
+                node = next;
+            }
+        }
+        /**
+         * @brief Append a value, producer side only.
+         * @param value Value to append.
+         */
+        void push(T value) {
+            Node* node = allocate();
+            node->value = std::move(value);
+            node->next.store(nullptr, std::memory_order_relaxed);
+            head_->next.store(node, std::memory_order_release);
+            head_ = node;
+        }
+        /**
+         * @brief Take the oldest value, consumer side only.
+         * @param value Receives the value.
+         * @return bool False if the queue is empty.
+         */
+        bool pop(T& value) {
+            Node* tail = tail_.load(std::memory_order_relaxed);
+            Node* next = tail->next.load(std::memory_order_acquire);
+            if (!next) {
+                return false;
+            }
+            value = std::move(next->value);
+            next->value = T();
+            tail_.store(next, std::memory_order_release);
+            return true;
+        }
+        /**
+         * @brief Check for pending values, consumer side only.
+         */
+        bool empty() const {
+            return tail_.load(std::memory_order_relaxed)->next.load(std::memory_order_acquire) == nullptr;
+        }
+    private:
+        struct Node {
+            std::atomic<Node*> next{nullptr};
+            T value{};
+        };
+        /**
+         * @brief Reuse a node the consumer has passed, or allocate a new one.
+         */
+        Node* allocate() {
+            if (first_ == tail_copy_) {
+                tail_copy_ = tail_.load(std::memory_order_acquire);
+            }
+            if (first_ != tail_copy_) {
+                Node* node = first_;
+                first_ = first_->next.load(std::memory_order_relaxed);
+                return node;
+            }
+            return new Node;
+        }
+
+        // Consumer side.
+        alignas(64) std::atomic<Node*> tail_;
+        // Producer side.
+        alignas(64) Node* head_;
+        Node* first_;
+        Node* tail_copy_;
+};
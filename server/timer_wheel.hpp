@@ -0,0 +1,206 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <utility>
+
+class TimerWheel;
+
+/**
+ * @brief Timer that lives inside its owner and is linked into a TimerWheel slot.
+ * Destroying an armed timer cancels it.
+ */
+class WheelTimer {
+    public:
+        WheelTimer() = default;
+        WheelTimer(const WheelTimer&) = delete;
+        WheelTimer& operator=(const WheelTimer&) = delete;
+        ~WheelTimer() {
+            cancel();
+        }
+        /**
+         * @brief Remove the timer from its wheel, the callback is not called.
+         */
+        void cancel();
+        /**
+         * @brief Check whether the timer waits for expiry.
+         */
+        bool armed() const {
+            return wheel_ != nullptr;
+        }
+    private:
+        friend class TimerWheel;
+        TimerWheel* wheel_ = nullptr;
+        WheelTimer** slot_ = nullptr;
+        WheelTimer* prev_ = nullptr;
+        WheelTimer* next_ = nullptr;
+        std::uint64_t expiry_ = 0;
+        std::function<void()> callback_;
+};
+
+/**
+ * @brief Hierarchical hashed timer wheel.
+ * Scheduling and cancelling are O(1), every tick touches one slot, and timers of the
+ * outer levels are cascaded inwards when the inner level wraps around.
+ */
+class TimerWheel {
+    public:
+        using clock = std::chrono::steady_clock;
+        /**
+         * @brief Constructor for timer wheel.
+         * @param tick Resolution of the wheel.
+         */
+        explicit TimerWheel(std::chrono::milliseconds tick) :
+            tick_(tick.count() > 0 ? tick : std::chrono::milliseconds(1)), start_(clock::now()) {
+            for (auto& level : slots_) {
+                level.fill(nullptr);
+            }
+        }
+        TimerWheel(const TimerWheel&) = delete;
+        TimerWheel& operator=(const TimerWheel&) = delete;
+        /**
+         * @brief Arm a timer, re-arming it if it is already pending.
+         * @param timer Timer to arm.
+         * @param delay Time until the callback runs, rounded up to whole ticks.
+         * @param callback Function to call on expiry.
+         */
+        void schedule(WheelTimer& timer, clock::duration delay, std::function<void()> callback) {
+            timer.cancel();
+            std::uint64_t ticks = (delay + tick_ - clock::duration(1)) / tick_;
+            timer.expiry_ = now_ + std::max<std::uint64_t>(ticks, 1);
+            timer.callback_ = std::move(callback);
+            link(timer);
+            ++size_;
+        }
+        /**
+         * @brief Number of pending timers.
+         */
+        std::size_t size() const {
+            return size_;
+        }
+        /**
+         * @brief Process every tick that elapsed up to the given moment.
+         * @param now Current time.
+         */
+        void advance(clock::time_point now) {
+            std::uint64_t target = (now - start_) / tick_;
+            while (now_ < target) {
+                ++now_;
+                cascade();
+                expire(slots_[0][now_ & slot_mask]);
+            }
+        }
+        /**
+         * @brief Coroutine that drives the wheel from one steady_timer.
+         * @return Awaitable<void>
+         */
+        boost::asio::awaitable<void> run() {
+            boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor);
+            while (true) {
+                timer.expires_after(tick_);
+                co_await timer.async_wait(boost::asio::use_awaitable);
+                advance(clock::now());
+            }
+        }
+    private:
+        friend class WheelTimer;
+        static constexpr int levels = 4;
+        static constexpr int slot_bits = 8;
+        static constexpr std::uint64_t slot_mask = (1u << slot_bits) - 1;
+
+        /**
+         * @brief Put a timer into the slot that matches its distance from now.
+         */
+        void link(WheelTimer& timer) {
+            std::uint64_t expiry = timer.expiry_;
+            std::uint64_t delta = expiry - now_;
+            int level = 0;
+            while (level + 1 < levels && delta >= (std::uint64_t(1) << (slot_bits * (level + 1)))) {
+                ++level;
+            }
+            if (level == levels - 1 && delta >= (std::uint64_t(1) << (slot_bits * levels))) {
+                // Beyond the range of the wheel: park in the farthest slot, it is cascaded again later.
+                expiry = now_ + (std::uint64_t(1) << (slot_bits * levels)) - 1;
+            }
+            WheelTimer*& head = slots_[level][(expiry >> (slot_bits * level)) & slot_mask];
+            timer.wheel_ = this;
+            timer.slot_ = &head;
+            timer.prev_ = nullptr;
+            timer.next_ = head;
+            if (head) {
+                head->prev_ = &timer;
+            }
+            head = &timer;
+        }
+        /**
+         * @brief Take a timer out of its slot.
+         */
+        void unlink(WheelTimer& timer) {
+            if (timer.prev_) {
+                timer.prev_->next_ = timer.next_;
+            } else {
+                *timer.slot_ = timer.next_;
+            }
+            if (timer.next_) {
+                timer.next_->prev_ = timer.prev_;
+            }
+            timer.prev_ = timer.next_ = nullptr;
+            timer.slot_ = nullptr;
+            timer.wheel_ = nullptr;
+            --size_;
+        }
+        /**
+         * @brief Move timers of the outer levels down when the inner level wrapped.
+         */
+        void cascade() {
+            for (int level = 1; level < levels; ++level) {
+                if ((now_ & ((std::uint64_t(1) << (slot_bits * level)) - 1)) != 0) {
+                    break;
+                }
+                WheelTimer* timer = std::exchange(slots_[level][(now_ >> (slot_bits * level)) & slot_mask], nullptr);
+                while (timer) {
+                    WheelTimer* next = timer->next_;
+                    timer->prev_ = timer->next_ = nullptr;
+                    link(*timer);
+                    timer = next;
+                }
+            }
+        }
+        /**
+         * @brief Fire every timer of a level-0 slot.
+         * Callbacks may arm or cancel any timer, including the ones still in the slot.
+         */
+        void expire(WheelTimer*& head) {
+            while (head) {
+                WheelTimer* timer = head;
+                head = timer->next_;
+                if (head) {
+                    head->prev_ = nullptr;
+                }
+                timer->prev_ = timer->next_ = nullptr;
+                timer->slot_ = nullptr;
+                timer->wheel_ = nullptr;
+                --size_;
+                auto callback = std::move(timer->callback_);
+                callback();
+            }
+        }
+
+        clock::duration tick_;
+        clock::time_point start_;
+        std::uint64_t now_ = 0;
+        std::size_t size_ = 0;
+        std::array<std::array<WheelTimer*, 256>, levels> slots_;
+};
+
+inline void WheelTimer::cancel() {
+    if (wheel_) {
+        wheel_->unlink(*this);
+    }
+    callback_ = nullptr;
+}
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "message.hpp"
+
+#ifdef CHAT_TRACING
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+
+/**
+ * @brief Collector of sampled lifecycle spans, written as a Chrome trace (JSON) file
+ * that chrome://tracing and Perfetto open. Spans of one message share its trace id.
+ * Only sampled messages are recorded, so the lock is taken rarely.
+ */
+class Tracer {
+    public:
+        static Tracer& instance() {
+            static Tracer tracer;
+            return tracer;
+        }
+        /**
+         * @brief Start recording.
+         * @param path File written by flush().
+         * @param every One message or connection out of this many is sampled, 0 samples none.
+         */
+        void start(std::string path, std::size_t every) {
+            path_ = std::move(path);
+            epoch_ = std::chrono::steady_clock::now();
+            every_.store(every, std::memory_order_relaxed);
+        }
+        bool active() const {
+            return every_.load(std::memory_order_relaxed) != 0;
+        }
+        /**
+         * @brief Decide whether to trace the next message or connection of the calling thread.
+         * @return std::uint64_t Trace id, 0 if not sampled.
+         */
+        std::uint64_t sample() {
+            std::size_t every = every_.load(std::memory_order_relaxed);
+            if (every == 0) {
+                return 0;
+            }
+            thread_local std::uint64_t seen = 0;
+            std::uint64_t n = seen++;
+            if (n % every != 0) {
+                return 0;
+            }
+            // Unique without a shared counter: the thread index in the high bits.
+            return (std::uint64_t(thread_index() + 1) << 40) | (n / every + 1);
+        }
+        /**
+         * @brief Record a finished span.
+         * @param name Stage of the lifecycle.
+         * @param id Trace id of the message or connection.
+         * @param begin Start of the span.
+         * @param end End of the span.
+         */
+        void record(const char* name, std::uint64_t id,
+                    std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end) {
+            std::size_t thread = thread_index();
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (events_.size() >= max_events_) {
+                ++dropped_;
+                return;
+            }
+            events_.push_back({name, id, begin, end, thread});
+        }
+        /**
+         * @brief Write the recorded spans to the trace file.
+         */
+        void flush() {
+            if (path_.empty()) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::ofstream out(path_);
+            if (!out) {
+                std::cerr << "Cannot write trace file " << path_ << std::endl;
+                return;
+            }
+            out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+            for (std::size_t i = 0; i < events_.size(); ++i) {
+                const Event& event = events_[i];
+                out << (i == 0 ? "\n" : ",\n")
+                    << "{\"name\":\"" << event.name << "\",\"cat\":\"chat\",\"ph\":\"X\""
+                    << ",\"ts\":" << micros(event.begin - epoch_)
+                    << ",\"dur\":" << micros(event.end - event.begin)
+                    << ",\"pid\":0,\"tid\":" << event.thread
+                    << ",\"args\":{\"id\":" << event.id << "}}";
+            }
+            out << "\n]}\n";
+            std::cerr << "Wrote " << events_.size() << " trace spans to " << path_;
+            if (dropped_ > 0) {
+                std::cerr << ", " << dropped_ << " dropped";
+            }
+            std::cerr << std::endl;
+        }
+    private:
+        struct Event {
+            const char* name;
+            std::uint64_t id;
+            std::chrono::steady_clock::time_point begin;
+            std::chrono::steady_clock::time_point end;
+            std::size_t thread;
+        };
+        static double micros(std::chrono::steady_clock::duration duration) {
+            return std::chrono::duration<double, std::micro>(duration).count();
+        }
+        /**
+         * @brief Small stable number of the calling thread, used as the trace's tid.
+         */
+        std::size_t thread_index() {
+            thread_local std::size_t index = threads_.fetch_add(1, std::memory_order_relaxed);
+            return index;
+        }
+
+        // Bounds the memory of a long trace, later spans are counted and dropped.
+        static constexpr std::size_t max_events_ = std::size_t(1) << 22;
+        std::string path_;
+        std::chrono::steady_clock::time_point epoch_;
+        std::atomic<std::size_t> every_{0};
+        std::atomic<std::size_t> threads_{0};
+        std::mutex mutex_;
+        std::vector<Event> events_;
+        std::size_t dropped_ = 0;
+};
+
+/**
+ * @brief Scoped span of one message, or of every sampled message of a batch.
+ * Recorded when it ends, and only if it carries a trace id.
+ */
+class TraceSpan {
+    public:
+        /**
+         * @brief Start a span.
+         * @param name Stage of the lifecycle.
+         * @param id Trace id, may be set later by end().
+         */
+        explicit TraceSpan(const char* name, std::uint64_t id = 0) : name_(name), id_(id) {
+            if (Tracer::instance().active()) {
+                begin_ = std::chrono::steady_clock::now();
+            }
+        }
+        /**
+         * @brief Start a span shared by the messages of a batch.
+         * @param name Stage of the lifecycle.
+         * @param batch Messages, must outlive the span.
+         */
+        TraceSpan(const char* name, const std::vector<MessagePtr>& batch) : TraceSpan(name) {
+            batch_ = &batch;
+        }
+        TraceSpan(const TraceSpan&) = delete;
+        TraceSpan& operator=(const TraceSpan&) = delete;
+        ~TraceSpan() {
+            end(id_);
+        }
+        /**
+         * @brief End the span early.
+         * @param id Trace id, 0 keeps the one given to the constructor.
+         */
+        void end(std::uint64_t id = 0) {
+            if (ended_ || !Tracer::instance().active()) {
+                ended_ = true;
+                return;
+            }
+            ended_ = true;
+            auto now = std::chrono::steady_clock::now();
+            if (id == 0) {
+                id = id_;
+            }
+            if (id != 0) {
+                Tracer::instance().record(name_, id, begin_, now);
+            }
+            if (batch_) {
+                for (auto& message : *batch_) {
+                    if (message->trace_id != 0) {
+                        Tracer::instance().record(name_, message->trace_id, begin_, now);
+                    }
+                }
+            }
+        }
+    private:
+        const char* name_;
+        std::uint64_t id_;
+        const std::vector<MessagePtr>* batch_ = nullptr;
+        std::chrono::steady_clock::time_point begin_;
+        bool ended_ = false;
+};
+
+inline void trace_start(std::string path, std::size_t every) {
+    Tracer::instance().start(std::move(path), every);
+}
+inline std::uint64_t trace_sample() {
+    return Tracer::instance().sample();
+}
+inline void trace_flush() {
+    Tracer::instance().flush();
+}
+
+#else
+
+// Built without CHAT_TRACING: every hook is empty and compiles away.
+class TraceSpan {
+    public:
+        explicit TraceSpan(const char*, std::uint64_t = 0) {}
+        TraceSpan(const char*, const std::vector<MessagePtr>&) {}
+        void end(std::uint64_t = 0) {}
+};
+
+inline void trace_start(const std::string&, std::size_t) {}
+inline std::uint64_t trace_sample() {
+    return 0;
+}
+inline void trace_flush() {}
+
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <vector>
+
+#include "message.hpp"
+
+/**
+ * @brief Interface for chat users.
+ */
+class Users {
+    public:
+        /**
+         * @brief Send a message to users.
+         * @param msg Message to send.
+         */
+        virtual void deliver(const MessagePtr& msg) = 0;
+        /**
+         * @brief Send replayed history to users.
+         * @param messages Messages in order.
+         */
+        virtual void deliver_history(std::vector<MessagePtr> messages) {
+            for (auto& message : messages) {
+                deliver(message);
+            }
+        }
+        virtual ~Users() {}
+};
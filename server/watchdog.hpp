@@ -0,0 +1,127 @@
+#pragma once
+
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "shard.hpp"
+
+/**
+ * @brief Watches the lag probes of all shards from a thread of its own.
+ * A shard whose probe is overdue by more than the threshold is stuck in a handler: the
+ * watchdog interrupts its thread with SIGUSR2, the signal handler takes a backtrace of
+ * whatever is running, and the watchdog prints it. Every stall is reported once.
+ */
+class StallWatchdog {
+    public:
+        /**
+         * @brief Constructor for stall watchdog, starts its thread.
+         * @param shards Shards to watch, their lag probes must be running.
+         * @param threshold Overdue time that counts as a stall.
+         */
+        StallWatchdog(ShardGroup& shards, std::chrono::milliseconds threshold) :
+            shards_(shards), threshold_(threshold), reported_(shards.size(), 0) {
+            // backtrace() loads libgcc on first use, which must not happen inside the handler.
+            void* frame;
+            backtrace(&frame, 1);
+            struct sigaction action{};
+            action.sa_handler = &StallWatchdog::capture;
+            sigemptyset(&action.sa_mask);
+            action.sa_flags = SA_RESTART;
+            sigaction(SIGUSR2, &action, nullptr);
+            thread_ = std::thread([this]{ run(); });
+        }
+        StallWatchdog(const StallWatchdog&) = delete;
+        StallWatchdog& operator=(const StallWatchdog&) = delete;
+        ~StallWatchdog() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            wakeup_.notify_all();
+            thread_.join();
+        }
+    private:
+        /**
+         * @brief Backtrace written by the signal handler on the stalled thread.
+         */
+        struct Capture {
+            void* frames[64];
+            std::atomic<int> size{-1};
+        };
+        static Capture& slot() {
+            static Capture capture;
+            return capture;
+        }
+        static void capture(int) {
+            Capture& capture = slot();
+            capture.size.store(backtrace(capture.frames, 64), std::memory_order_release);
+        }
+        void run() {
+            auto period = std::max<std::chrono::milliseconds>(threshold_ / 4, std::chrono::milliseconds(1));
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (!wakeup_.wait_for(lock, period, [this]{ return stopping_; })) {
+                for (std::size_t i = 0; i < shards_.size(); ++i) {
+                    check(i);
+                }
+            }
+        }
+        /**
+         * @brief Report the shard if its probe is overdue and the stall is new.
+         */
+        void check(std::size_t index) {
+            Shard& shard = shards_[index];
+            LoopHeartbeat& heartbeat = shard.context().heartbeat;
+            std::int64_t beat = heartbeat.beat_ns.load(std::memory_order_acquire);
+            if (beat == 0 || beat == reported_[index] || shard.io_context().stopped()) {
+                return;
+            }
+            auto due = std::chrono::steady_clock::time_point(std::chrono::nanoseconds(beat))
+                + shard.context().config.lag_probe_interval;
+            auto overdue = std::chrono::steady_clock::now() - due;
+            if (overdue < threshold_) {
+                return;
+            }
+            reported_[index] = beat;
+            shard.context().metrics.loop_stalls.add();
+            std::cerr << "Event loop of shard " << index << " stalled for "
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(overdue).count() << "ms";
+            Capture& capture = slot();
+            capture.size.store(-1, std::memory_order_relaxed);
+            if (pthread_kill(heartbeat.thread.load(std::memory_order_acquire), SIGUSR2) != 0) {
+                std::cerr << ", no backtrace" << std::endl;
+                return;
+            }
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+            int size;
+            while ((size = capture.size.load(std::memory_order_acquire)) < 0 && std::chrono::steady_clock::now() < deadline) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            if (size < 0) {
+                std::cerr << ", the thread did not answer" << std::endl;
+                return;
+            }
+            std::cerr << ", running:" << std::endl;
+            // Skip the frames of the signal handler itself.
+            backtrace_symbols_fd(capture.frames + 2, std::max(size - 2, 0), STDERR_FILENO);
+        }
+
+        ShardGroup& shards_;
+        std::chrono::milliseconds threshold_;
+        // Heartbeat of the last stall reported per shard.
+        std::vector<std::int64_t> reported_;
+        std::thread thread_;
+        std::mutex mutex_;
+        std::condition_variable wakeup_;
+        bool stopping_ = false;
+};
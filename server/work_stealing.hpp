@@ -0,0 +1,181 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Thread pool where every worker has its own task deque and idle workers steal.
+ * Owners take their newest task, thieves the oldest one of another worker, so a burst
+ * submitted to one worker spreads over the whole pool.
+ */
+class WorkStealingPool {
+    public:
+        using Task = std::function<void()>;
+
+        /**
+         * @brief Per-worker counters.
+         */
+        struct WorkerStats {
+            std::uint64_t tasks = 0;
+            std::uint64_t steals = 0;
+            std::chrono::steady_clock::duration busy{};
+        };
+
+        /**
+         * @brief Constructor for work stealing pool.
+         * @param workers Number of worker threads.
+         */
+        explicit WorkStealingPool(std::size_t workers) {
+            for (std::size_t i = 0; i < workers; ++i) {
+                workers_.push_back(std::make_unique<Worker>());
+            }
+            for (std::size_t i = 0; i < workers; ++i) {
+                threads_.emplace_back([this, i]{ run(i); });
+            }
+        }
+        WorkStealingPool(const WorkStealingPool&) = delete;
+        WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+        ~WorkStealingPool() {
+            {
+                std::lock_guard<std::mutex> lock(sleep_mutex_);
+                stopping_ = true;
+            }
+            wakeup_.notify_all();
+            for (auto& thread : threads_) {
+                thread.join();
+            }
+        }
+        std::size_t size() const {
+            return workers_.size();
+        }
+        /**
+         * @brief Queue a task on a worker, callable from any thread.
+         * @param task Task to run.
+         * @param hint Worker that should run it unless another one steals it.
+         */
+        void submit(Task task, std::size_t hint) {
+            Worker& worker = *workers_[hint % workers_.size()];
+            {
+                std::lock_guard<std::mutex> lock(worker.mutex);
+                worker.tasks.push_back(std::move(task));
+            }
+            queued_.fetch_add(1);
+            if (sleeping_.load() > 0) {
+                std::lock_guard<std::mutex> lock(sleep_mutex_);
+                wakeup_.notify_one();
+            }
+        }
+        /**
+         * @brief Snapshot of the counters of every worker.
+         */
+        std::vector<WorkerStats> stats() const {
+            std::vector<WorkerStats> result;
+            for (auto& worker : workers_) {
+                WorkerStats stats;
+                stats.tasks = worker->tasks_run.load(std::memory_order_relaxed);
+                stats.steals = worker->steals.load(std::memory_order_relaxed);
+                stats.busy = std::chrono::steady_clock::duration(worker->busy.load(std::memory_order_relaxed));
+                result.push_back(stats);
+            }
+            return result;
+        }
+        /**
+         * @brief Write the per-worker counters in the Prometheus text format.
+         * @param out Stream to print to.
+         */
+        void print(std::ostream& out) const {
+            auto all = stats();
+            out << "# HELP chat_fanout_worker_tasks_total Fan-out tasks run by each pool worker.\n"
+                << "# TYPE chat_fanout_worker_tasks_total counter\n";
+            for (std::size_t i = 0; i < all.size(); ++i) {
+                out << "chat_fanout_worker_tasks_total{worker=\"" << i << "\"} " << all[i].tasks << '\n';
+            }
+            out << "# HELP chat_fanout_worker_steals_total Tasks each pool worker took from another.\n"
+                << "# TYPE chat_fanout_worker_steals_total counter\n";
+            for (std::size_t i = 0; i < all.size(); ++i) {
+                out << "chat_fanout_worker_steals_total{worker=\"" << i << "\"} " << all[i].steals << '\n';
+            }
+            out << "# HELP chat_fanout_worker_busy_seconds_total Time each pool worker spent running tasks.\n"
+                << "# TYPE chat_fanout_worker_busy_seconds_total counter\n";
+            for (std::size_t i = 0; i < all.size(); ++i) {
+                out << "chat_fanout_worker_busy_seconds_total{worker=\"" << i << "\"} "
+                    << std::chrono::duration<double>(all[i].busy).count() << '\n';
+            }
+        }
+    private:
+        struct Worker {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+            std::atomic<std::uint64_t> tasks_run{0};
+            std::atomic<std::uint64_t> steals{0};
+            std::atomic<std::chrono::steady_clock::rep> busy{0};
+        };
+        /**
+         * @brief Take the newest task of the own deque or steal the oldest of another.
+         */
+        bool next(std::size_t self, Task& task) {
+            {
+                Worker& own = *workers_[self];
+                std::lock_guard<std::mutex> lock(own.mutex);
+                if (!own.tasks.empty()) {
+                    task = std::move(own.tasks.back());
+                    own.tasks.pop_back();
+                    return true;
+                }
+            }
+            for (std::size_t i = 1; i < workers_.size(); ++i) {
+                Worker& victim = *workers_[(self + i) % workers_.size()];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (!victim.tasks.empty()) {
+                    task = std::move(victim.tasks.front());
+                    victim.tasks.pop_front();
+                    workers_[self]->steals.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+            return false;
+        }
+        /**
+         * @brief Worker thread body.
+         */
+        void run(std::size_t self) {
+            Worker& worker = *workers_[self];
+            Task task;
+            while (true) {
+                if (next(self, task)) {
+                    queued_.fetch_sub(1);
+                    auto started = std::chrono::steady_clock::now();
+                    task();
+                    task = nullptr;
+                    worker.busy.fetch_add((std::chrono::steady_clock::now() - started).count(), std::memory_order_relaxed);
+                    worker.tasks_run.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(sleep_mutex_);
+                sleeping_.fetch_add(1);
+                wakeup_.wait(lock, [this]{ return stopping_ || queued_.load() > 0; });
+                sleeping_.fetch_sub(1);
+                if (stopping_) {
+                    return;
+                }
+            }
+        }
+
+        std::vector<std::unique_ptr<Worker>> workers_;
+        std::vector<std::thread> threads_;
+        // Tasks submitted but not yet taken by a worker.
+        std::atomic<std::size_t> queued_{0};
+        std::atomic<std::size_t> sleeping_{0};
+        std::mutex sleep_mutex_;
+        std::condition_variable wakeup_;
+        bool stopping_ = false;
+};
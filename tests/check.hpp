@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+
+/**
+ * @brief Number of failed checks of the running test.
+ */
+inline int& check_failures() {
+    static int failures = 0;
+    return failures;
+}
+
+/**
+ * @brief Report a condition that does not hold and go on, in every build type unlike assert.
+ */
+#define CHECK(condition)                                                                          \
+    do {                                                                                          \
+        if (!(condition)) {                                                                       \
+            std::cerr << __FILE__ << ':' << __LINE__ << ": CHECK(" #condition ") failed" << std::endl; \
+            ++check_failures();                                                                   \
+        }                                                                                         \
+    } while (0)
+
+/**
+ * @brief Exit status of a test: 0 if every check held.
+ */
+inline int check_result() {
+    if (check_failures() > 0) {
+        std::cerr << check_failures() << " checks failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Directory of its own under /tmp, removed with everything in it.
+ */
+struct TemporaryDir {
+    std::string path;
+
+    TemporaryDir() {
+        std::string name = (std::filesystem::temp_directory_path() / "chat-test-XXXXXX").string();
+        path = ::mkdtemp(name.data()) ? name : std::string();
+    }
+    TemporaryDir(const TemporaryDir&) = delete;
+    TemporaryDir& operator=(const TemporaryDir&) = delete;
+    ~TemporaryDir() {
+        std::error_code ec;
+        std::filesystem::remove_all(path, ec);
+    }
+};
+
+/**
+ * @brief Whole content of a file, empty if it cannot be read.
+ */
+inline std::string read_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+/**
+ * @brief Replace the content of a file.
+ */
+inline void write_file(const std::string& path, const std::string& data) {
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << data;
+}
+
+/**
+ * @brief Overwrite the 64-bit number at a position of a file image.
+ */
+inline void put_number(std::string& data, std::size_t index, std::uint64_t value) {
+    data.replace(index * sizeof(value), sizeof(value), reinterpret_cast<const char*>(&value), sizeof(value));
+}
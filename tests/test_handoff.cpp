@@ -0,0 +1,202 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#include "check.hpp"
+#include "handoff.hpp"
+
+/**
+ * @brief Connected SOCK_SEQPACKET pair, the old process's end and the new one's.
+ */
+struct SocketPair {
+    int old_end = -1;
+    int new_end = -1;
+
+    SocketPair() {
+        int fds[2];
+        if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == 0) {
+            old_end = fds[0];
+            new_end = fds[1];
+        }
+    }
+    ~SocketPair() {
+        close_old();
+        ::close(new_end);
+    }
+    void close_old() {
+        if (old_end >= 0) {
+            ::close(old_end);
+            old_end = -1;
+        }
+    }
+    /**
+     * @brief Send a raw packet, as a broken or hostile old process might.
+     */
+    void raw(const std::string& packet, int fd = -1) {
+        iovec io{const_cast<char*>(packet.data()), packet.size()};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr message{};
+        message.msg_iov = &io;
+        message.msg_iovlen = 1;
+        if (fd >= 0) {
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            cmsghdr* c = CMSG_FIRSTHDR(&message);
+            c->cmsg_level = SOL_SOCKET;
+            c->cmsg_type = SCM_RIGHTS;
+            c->cmsg_len = CMSG_LEN(sizeof(int));
+            std::memcpy(CMSG_DATA(c), &fd, sizeof(int));
+        }
+        CHECK(::sendmsg(old_end, &message, 0) == static_cast<ssize_t>(packet.size()));
+    }
+};
+
+/**
+ * @brief True if a file descriptor is open.
+ */
+bool is_open(int fd) {
+    return fd >= 0 && ::fcntl(fd, F_GETFD) != -1;
+}
+
+/**
+ * @brief Listeners, sessions and rooms arrive as sent, with their descriptors.
+ */
+void round_trip() {
+    SocketPair pair;
+    HandoffChannel sender(pair.old_end);
+    int pipe_fds[2];
+    CHECK(::pipe(pipe_fds) == 0);
+    CHECK(sender.send(HandoffListener{HandoffListener::Kind::metrics, 9100, pipe_fds[0]}));
+    HandoffSession session;
+    session.fd = pipe_fds[1];
+    session.port = 8080;
+    session.username = "alice";
+    session.pending = "half a li";
+    session.last_seq = 77;
+    session.compress = true;
+    session.dictionary = 0xdeadbeef;
+    session.queued = {{76, "bob", 123, "hi"}, {77, "", 124, "notice"}};
+    CHECK(sender.send(session));
+    CHECK(sender.send(HandoffRoom{8080, 77, {{75, "carol", 122, "first"}}}));
+    CHECK(sender.send_end());
+    ::close(pipe_fds[0]);
+    ::close(pipe_fds[1]);
+
+    HandoffState state;
+    HandoffChannel(pair.new_end).receive(state);
+    CHECK(state.complete);
+    CHECK(state.listeners.size() == 1 && state.sessions.size() == 1 && state.rooms.size() == 1);
+    if (state.listeners.size() != 1 || state.sessions.size() != 1 || state.rooms.size() != 1) {
+        return;
+    }
+    CHECK(state.listeners[0].kind == HandoffListener::Kind::metrics && state.listeners[0].port == 9100);
+    CHECK(is_open(state.listeners[0].fd));
+    auto& received = state.sessions[0];
+    CHECK(is_open(received.fd) && received.fd != state.listeners[0].fd);
+    CHECK(received.port == 8080 && received.username == "alice" && received.pending == "half a li");
+    CHECK(received.last_seq == 77 && received.compress && received.dictionary == 0xdeadbeef);
+    CHECK(received.queued.size() == 2);
+    if (received.queued.size() == 2) {
+        CHECK(received.queued[0].sender == "bob" && received.queued[0].text == "hi" && received.queued[0].sent_ms == 123);
+        CHECK(received.queued[1].seq == 77 && received.queued[1].sender.empty());
+    }
+    CHECK(state.rooms[0].last_seq == 77 && state.rooms[0].history.size() == 1);
+    ::close(state.listeners[0].fd);
+    ::close(received.fd);
+}
+
+/**
+ * @brief Little-endian fields of a raw packet.
+ */
+template <typename T>
+void put(std::string& packet, T value) {
+    packet.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+/**
+ * @brief Truncated, oversized, misplaced and unknown packets are survived and skipped.
+ */
+void survives_garbage() {
+    SocketPair pair;
+    // Messages before the session or room they belong to.
+    pair.raw("Q" + std::string(30, '\x01'));
+    pair.raw("H" + std::string(30, '\x01'));
+    // A session cut short in its fixed fields, its half a port read as none, and one whose name claims 4 GB.
+    pair.raw("S\x50");
+    std::string huge = "S";
+    put<unsigned short>(huge, 1);
+    put<std::uint64_t>(huge, 2);
+    put<bool>(huge, false);
+    put<std::uint32_t>(huge, 0xffffffff);
+    huge += "bob";
+    pair.raw(huge);
+    // A session of an older version, without the dictionary id.
+    std::string old = "S";
+    put<unsigned short>(old, 3);
+    put<std::uint64_t>(old, 4);
+    put<bool>(old, true);
+    put<std::uint32_t>(old, 5);
+    old += "carol";
+    put<std::uint32_t>(old, 0);
+    pair.raw(old);
+    // A queued message whose text runs past the packet.
+    std::string queued = "Q";
+    put<std::uint64_t>(queued, 5);
+    put<std::int64_t>(queued, 6);
+    put<std::uint32_t>(queued, 0);
+    put<std::uint32_t>(queued, 1000);
+    queued += "short";
+    pair.raw(queued);
+    // An unknown packet carrying a descriptor, which must be closed rather than leaked.
+    int pipe_fds[2];
+    CHECK(::pipe(pipe_fds) == 0);
+    pair.raw("Zzz", pipe_fds[0]);
+    ::close(pipe_fds[0]);
+    pair.raw("E");
+
+    HandoffState state;
+    HandoffChannel(pair.new_end).receive(state);
+    CHECK(state.complete);
+    CHECK(state.listeners.empty() && state.rooms.empty());
+    CHECK(state.sessions.size() == 3);
+    if (state.sessions.size() == 3) {
+        CHECK(state.sessions[0].port == 0 && state.sessions[0].username.empty());
+        CHECK(state.sessions[1].username == "bob" && state.sessions[1].pending.empty());
+        CHECK(state.sessions[2].username == "carol" && state.sessions[2].compress && state.sessions[2].dictionary == 0);
+        CHECK(state.sessions[2].queued.size() == 1 && state.sessions[2].queued[0].text == "short");
+    }
+    // The last reference to the pipe's read end was in the unknown packet.
+    CHECK(::write(pipe_fds[1], "x", 1) == -1 && errno == EPIPE);
+    ::close(pipe_fds[1]);
+}
+
+/**
+ * @brief An old process that goes away early leaves an incomplete but usable state.
+ */
+void truncated_handoff() {
+    SocketPair pair;
+    HandoffChannel sender(pair.old_end);
+    HandoffSession session;
+    session.username = "dave";
+    CHECK(sender.send(session));
+    pair.close_old();
+    HandoffState state;
+    HandoffChannel(pair.new_end).receive(state);
+    CHECK(!state.complete);
+    CHECK(state.sessions.size() == 1 && state.sessions[0].fd == -1);
+}
+
+int main() {
+    // Writing to the pipe without a reader must fail with EPIPE, not end the test.
+    ::signal(SIGPIPE, SIG_IGN);
+    round_trip();
+    survives_garbage();
+    truncated_handoff();
+    return check_result();
+}
@@ -0,0 +1,82 @@
+#include <cstdint>
+#include <vector>
+
+#include "check.hpp"
+#include "histogram.hpp"
+
+/**
+ * @brief Every value lies in the bucket whose range holds it, at every bucket edge.
+ */
+void buckets_hold_their_values() {
+    std::vector<std::uint64_t> values;
+    for (std::uint64_t v = 0; v < 1024; ++v) {
+        values.push_back(v);
+    }
+    for (unsigned bit = 10; bit < LatencyHistogram::max_bits; ++bit) {
+        std::uint64_t power = std::uint64_t(1) << bit;
+        values.insert(values.end(), {power - 1, power, power + 1, power + power / 3});
+    }
+    for (auto value : values) {
+        std::size_t index = LatencyHistogram::index(value);
+        CHECK(index < LatencyHistogram::bucket_count);
+        CHECK(LatencyHistogram::highest(index) >= value);
+        CHECK(index == 0 || LatencyHistogram::highest(index - 1) < value);
+    }
+}
+
+/**
+ * @brief Values below the sub-bucket count are exact, larger ones known to within 1/64.
+ */
+void precision() {
+    for (std::uint64_t v = 0; v < LatencyHistogram::sub_count; ++v) {
+        CHECK(LatencyHistogram::index(v) == v);
+        CHECK(LatencyHistogram::highest(v) == v);
+    }
+    for (std::uint64_t v = LatencyHistogram::sub_count; v < (std::uint64_t(1) << 40); v = v * 3 / 2 + 1) {
+        std::uint64_t highest = LatencyHistogram::highest(LatencyHistogram::index(v));
+        CHECK((highest - v) * 64 <= v);
+    }
+}
+
+/**
+ * @brief Buckets are in value order and the last one takes everything beyond the range.
+ */
+void monotonic_and_clamped() {
+    for (std::size_t i = 1; i < LatencyHistogram::bucket_count; ++i) {
+        CHECK(LatencyHistogram::highest(i) > LatencyHistogram::highest(i - 1));
+    }
+    std::size_t last = LatencyHistogram::bucket_count - 1;
+    CHECK(LatencyHistogram::index((std::uint64_t(1) << LatencyHistogram::max_bits) - 1) == last);
+    CHECK(LatencyHistogram::index(std::uint64_t(1) << LatencyHistogram::max_bits) == last);
+    CHECK(LatencyHistogram::index(~std::uint64_t(0)) == last);
+}
+
+/**
+ * @brief Quantiles of merged histograms name the bucket of the ranked sample, capped at the maximum.
+ */
+void quantiles() {
+    LatencyHistogram first, second;
+    for (std::uint64_t v = 1; v <= 100; ++v) {
+        first.record(v);
+    }
+    second.record(1000000);
+    LatencyHistogram::Snapshot snapshot;
+    CHECK(snapshot.quantile(0.5) == 0);
+    snapshot.merge(first);
+    snapshot.merge(second);
+    CHECK(snapshot.total == 101);
+    CHECK(snapshot.max == 1000000);
+    CHECK(snapshot.sum == 5050 + 1000000);
+    CHECK(snapshot.quantile(0.5) == 51);
+    CHECK(snapshot.quantile(100.0 / 101) == 100);
+    std::uint64_t top = snapshot.quantile(1.0);
+    CHECK(top == 1000000);
+}
+
+int main() {
+    buckets_hold_their_values();
+    precision();
+    monotonic_and_clamped();
+    quantiles();
+    return check_result();
+}
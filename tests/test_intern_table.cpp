@@ -0,0 +1,104 @@
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "check.hpp"
+#include "intern_table.hpp"
+
+/**
+ * @brief A full table refuses new names until a held one is released, then gives its id away.
+ */
+void frees_released_names() {
+    InternTable table(2);
+    NameRef alice = table.acquire("alice");
+    NameRef bob = table.acquire("bob");
+    CHECK(alice && bob && alice.id() != bob.id());
+    CHECK(!table.acquire("carol"));
+    CHECK(table.size() == 2);
+    // A name already held is never refused.
+    NameRef again = table.acquire("alice");
+    CHECK(again.id() == alice.id());
+
+    std::uint32_t id = alice.id();
+    std::uint32_t generation = table.generation(id);
+    alice = NameRef();
+    CHECK(table.find("alice") == id);
+    again = NameRef();
+    CHECK(table.find("alice") == 0);
+    CHECK(table.size() == 1);
+    NameRef carol = table.acquire("carol");
+    CHECK(carol.id() == id);
+    CHECK(table.name(id) == "carol");
+    CHECK(table.generation(id) != generation);
+}
+
+/**
+ * @brief Copies share a name, it lives until the last one goes.
+ */
+void copies_hold_the_name() {
+    InternTable table(1);
+    std::vector<NameRef> copies;
+    {
+        NameRef first = table.acquire("dave");
+        copies.assign(5, first);
+    }
+    NameRef moved = std::move(copies.back());
+    copies.pop_back();
+    CHECK(copies.back().id() == moved.id());
+    copies.clear();
+    CHECK(table.name(moved.id()) == "dave");
+    CHECK(!table.acquire("erin"));
+    moved = NameRef();
+    CHECK(table.acquire("erin"));
+}
+
+/**
+ * @brief Names interned for the table's lifetime never count as released.
+ */
+void pinned_names_stay() {
+    InternTable table(2);
+    std::uint32_t room = table.intern("8080");
+    CHECK(table.intern("8080") == room);
+    {
+        NameRef held = table.acquire("8080");
+        CHECK(held.id() == room);
+    }
+    CHECK(table.name(room) == "8080");
+    NameRef frank = table.acquire("frank");
+    CHECK(frank && table.size() == 2);
+    CHECK(!table.acquire("grace"));
+}
+
+/**
+ * @brief Threads taking and dropping overlapping names keep every held name intact and free all of them.
+ */
+void concurrent_churn() {
+    InternTable table(64);
+    std::vector<std::thread> threads;
+    std::vector<int> broken(4, 0);
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&table, &broken, t] {
+            for (int i = 0; i < 20000; ++i) {
+                std::string name = "user" + std::to_string(i % 40);
+                NameRef ref = table.acquire(name);
+                NameRef copy = ref;
+                if (!ref || table.name(copy.id()) != name) {
+                    ++broken[t];
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    CHECK(broken == std::vector<int>(4, 0));
+    CHECK(table.size() == 0);
+}
+
+int main() {
+    frees_released_names();
+    copies_hold_the_name();
+    pinned_names_stay();
+    concurrent_churn();
+    return check_result();
+}
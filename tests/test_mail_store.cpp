@@ -0,0 +1,121 @@
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "check.hpp"
+#include "mailbox.hpp"
+
+/**
+ * @brief Mailbox files under a store directory.
+ */
+std::vector<std::string> mailbox_files(const std::string& dir) {
+    std::vector<std::string> files;
+    for (auto& entry : std::filesystem::recursive_directory_iterator(dir)) {
+        if (entry.is_regular_file() && entry.path().filename() != "members") {
+            files.push_back(entry.path().string());
+        }
+    }
+    return files;
+}
+
+/**
+ * @brief Messages come back in order in batches, and a mailbox delivered to its end is deleted.
+ */
+void delivers_in_batches() {
+    TemporaryDir dir;
+    MailStore store(dir.path);
+    for (int i = 0; i < 5; ++i) {
+        CHECK(store.append("alice", "message " + std::to_string(i)));
+    }
+    std::vector<std::string> messages;
+    std::uint64_t offset = store.read("alice", 3, messages);
+    CHECK(messages == std::vector<std::string>({"message 0", "message 1", "message 2"}));
+    store.commit("alice", offset);
+    messages.clear();
+    offset = store.read("alice", 3, messages);
+    CHECK(messages == std::vector<std::string>({"message 3", "message 4"}));
+    store.commit("alice", offset);
+    CHECK(mailbox_files(dir.path).empty());
+    messages.clear();
+    store.read("alice", 3, messages);
+    CHECK(messages.empty());
+}
+
+/**
+ * @brief A file whose header names someone else is never read as the user's mailbox.
+ * Stands in for two names with the same hash: the user gets a numbered file of its own.
+ */
+void checks_the_owner() {
+    TemporaryDir dir;
+    MailStore store(dir.path);
+    CHECK(store.append("alice", "for alice"));
+    auto files = mailbox_files(dir.path);
+    CHECK(files.size() == 1);
+    if (files.size() != 1) {
+        return;
+    }
+    // Rename the owner to a name of the same length.
+    std::string data = read_file(files[0]);
+    data.replace(data.find("alice"), 5, "amber");
+    write_file(files[0], data);
+
+    std::vector<std::string> messages;
+    store.read("alice", 10, messages);
+    CHECK(messages.empty());
+    CHECK(store.append("alice", "again for alice"));
+    CHECK(mailbox_files(dir.path).size() == 2);
+    store.read("alice", 10, messages);
+    CHECK(messages == std::vector<std::string>({"again for alice"}));
+}
+
+/**
+ * @brief A record longer than the rest of the file ends the mailbox without allocating its length.
+ */
+void rejects_oversized_records() {
+    TemporaryDir dir;
+    MailStore store(dir.path);
+    CHECK(store.append("bob", "first"));
+    CHECK(store.append("bob", "second"));
+    auto files = mailbox_files(dir.path);
+    CHECK(files.size() == 1);
+    if (files.size() != 1) {
+        return;
+    }
+    std::string data = read_file(files[0]);
+    // The length of the second record, after the header, the first length and "first".
+    std::size_t at = 8 + 4 + 3 + 4 + 5;
+    std::uint32_t huge = 0xfffffff0;
+    data.replace(at, 4, reinterpret_cast<const char*>(&huge), 4);
+    write_file(files[0], data);
+    std::vector<std::string> messages;
+    store.read("bob", 10, messages);
+    CHECK(messages == std::vector<std::string>({"first"}));
+}
+
+/**
+ * @brief Rooms joined are read back, a torn last line is dropped.
+ */
+void remembers_members() {
+    TemporaryDir dir;
+    {
+        MailStore store(dir.path);
+        CHECK(store.add_member("8080", "alice"));
+        CHECK(store.add_member("8081", "bob smith"));
+    }
+    std::string members = read_file(dir.path + "/members");
+    write_file(dir.path + "/members", members + "8082 tor");
+    MailStore store(dir.path);
+    auto pairs = store.members();
+    CHECK(pairs.size() == 2);
+    CHECK(pairs.size() == 2 && pairs[1] == std::make_pair(std::string("8081"), std::string("bob smith")));
+}
+
+int main() {
+    delivers_in_batches();
+    checks_the_owner();
+    rejects_oversized_records();
+    remembers_members();
+    return check_result();
+}
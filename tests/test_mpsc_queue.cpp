@@ -0,0 +1,62 @@
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "check.hpp"
+#include "mpsc_queue.hpp"
+
+/**
+ * @brief Values of every producer arrive, each producer's in its own order.
+ */
+void mpsc_keeps_order_per_producer() {
+    MpscQueue<std::pair<int, int>> queue;
+    constexpr int producers = 4, count = 50000;
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&queue, p] {
+            for (int i = 0; i < count; ++i) {
+                queue.push({p, i});
+            }
+        });
+    }
+    std::vector<int> next(producers, 0);
+    bool ordered = true;
+    int received = 0;
+    std::pair<int, int> value;
+    while (received < producers * count) {
+        if (queue.pop(value)) {
+            ordered = ordered && value.second == next[value.first];
+            ++next[value.first];
+            ++received;
+        }
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    CHECK(ordered);
+    CHECK(queue.empty());
+}
+
+/**
+ * @brief A queue destroyed with values in it releases them.
+ */
+void mpsc_releases_on_destruction() {
+    auto shared = std::make_shared<int>(1);
+    {
+        MpscQueue<std::shared_ptr<int>> queue;
+        queue.push(shared);
+        queue.push(shared);
+        std::shared_ptr<int> value;
+        CHECK(queue.pop(value));
+        CHECK(*value == 1);
+        CHECK(shared.use_count() == 3);
+    }
+    CHECK(shared.use_count() == 1);
+}
+
+int main() {
+    mpsc_keeps_order_per_producer();
+    mpsc_releases_on_destruction();
+    return check_result();
+}
@@ -0,0 +1,177 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "check.hpp"
+
+/**
+ * @brief A port nobody listens on right now.
+ */
+unsigned short free_port() {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    ::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+    ::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length);
+    ::close(fd);
+    return ntohs(address.sin_port);
+}
+
+/**
+ * @brief Connect to a port of this host, retrying while the server starts.
+ * @return int Connected socket, -1 if nobody answered within five seconds.
+ */
+int connect_to(unsigned short port) {
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return -1;
+}
+
+/**
+ * @brief Write all of a buffer, false if the connection failed.
+ */
+bool send_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t n = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        data.remove_prefix(static_cast<std::size_t>(n));
+    }
+    return true;
+}
+
+/**
+ * @brief A chat server run from its executable for the length of a test.
+ */
+struct ServerProcess {
+    pid_t pid = -1;
+    unsigned short port = free_port();
+    unsigned short metrics_port = free_port();
+
+    explicit ServerProcess(const char* executable) {
+        std::string metrics = "--metrics-port=" + std::to_string(metrics_port);
+        std::string room = std::to_string(port);
+        pid = ::fork();
+        if (pid == 0) {
+            int null = ::open("/dev/null", O_WRONLY);
+            ::dup2(null, STDOUT_FILENO);
+            ::dup2(null, STDERR_FILENO);
+            // One shard, so the chatty and the quiet reader share an event loop.
+            ::execl(executable, executable, room.c_str(), "--shards=1", metrics.c_str(), static_cast<char*>(nullptr));
+            ::_exit(127);
+        }
+    }
+    ~ServerProcess() {
+        if (pid > 0) {
+            ::kill(pid, SIGKILL);
+            ::waitpid(pid, nullptr, 0);
+        }
+    }
+};
+
+/**
+ * @brief Value of a counter on the metrics endpoint, -1 if it could not be read.
+ */
+double scrape(unsigned short port, std::string_view name) {
+    int fd = connect_to(port);
+    if (fd < 0 || !send_all(fd, "GET /metrics HTTP/1.0\r\n\r\n")) {
+        return -1;
+    }
+    std::string page;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = ::recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        page.append(buffer, static_cast<std::size_t>(n));
+    }
+    ::close(fd);
+    std::size_t at = page.find("\n" + std::string(name) + ' ');
+    return at == std::string::npos ? -1 : std::stod(page.substr(at + name.size() + 2));
+}
+
+/**
+ * @brief A line sent by a quiet session comes through while another session floods the same room.
+ * Without the reader budget a flood already buffered by the server is handled to its end first.
+ */
+void quiet_session_not_starved(const char* executable) {
+    ServerProcess server(executable);
+    int listener = connect_to(server.port);
+    CHECK(listener >= 0);
+    if (listener < 0) {
+        return;
+    }
+    int chatty = connect_to(server.port);
+    int quiet = connect_to(server.port);
+    CHECK(send_all(listener, "listener\n") && send_all(chatty, "chatty\n") && send_all(quiet, "quiet\n"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    constexpr int flood = 200000;
+    std::string lines;
+    for (int i = 0; i < flood; ++i) {
+        lines += "c" + std::to_string(i) + '\n';
+    }
+    std::thread sender([&] { send_all(chatty, lines); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CHECK(send_all(quiet, "hello from the quiet one\n"));
+
+    // Count the flood's lines the listener got before the quiet one.
+    timeval timeout{10, 0};
+    ::setsockopt(listener, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::string pending;
+    int before = 0;
+    bool found = false;
+    char buffer[65536];
+    ssize_t n;
+    while (!found && (n = ::recv(listener, buffer, sizeof(buffer), 0)) > 0) {
+        pending.append(buffer, static_cast<std::size_t>(n));
+        std::size_t start = 0, end;
+        while (!found && (end = pending.find('\n', start)) != std::string::npos) {
+            std::string_view line(pending.data() + start, end - start);
+            if (line.ends_with(" hello from the quiet one")) {
+                found = true;
+            } else if (line.find(" c") != std::string_view::npos) {
+                ++before;
+            }
+            start = end + 1;
+        }
+        pending.erase(0, start);
+    }
+    CHECK(found);
+    CHECK(before < flood / 4);
+    CHECK(scrape(server.metrics_port, "chat_reader_yields_total") > 0);
+
+    ::shutdown(chatty, SHUT_RDWR);
+    sender.join();
+    ::close(chatty);
+    ::close(quiet);
+    ::close(listener);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: test_reader_fairness <chat_server executable>" << std::endl;
+        return 2;
+    }
+    quiet_session_not_starved(argv[1]);
+    return check_result();
+}
@@ -0,0 +1,110 @@
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "check.hpp"
+#include "room_snapshot.hpp"
+
+/**
+ * @brief State of two rooms, one with history and index roots.
+ */
+std::vector<RoomState> sample_rooms() {
+    std::vector<RoomState> rooms(2);
+    rooms[0].name = "lobby";
+    rooms[0].last_seq = 42;
+    rooms[0].index_roots = {1, 1001};
+    rooms[0].history = {{41, "alice", 1000, "hello"}, {42, "", 2000, "server notice"}};
+    rooms[1].name = "empty";
+    return rooms;
+}
+
+/**
+ * @brief Rooms read back as written, found by name.
+ */
+void round_trip() {
+    TemporaryDir dir;
+    std::string path = dir.path + "/rooms";
+    auto rooms = sample_rooms();
+    CHECK(RoomSnapshot::write(path, rooms));
+    auto snapshot = RoomSnapshot::open(path);
+    CHECK(snapshot != nullptr);
+    if (!snapshot) {
+        return;
+    }
+    CHECK(snapshot->rooms() == 2);
+    CHECK(!snapshot->find("missing"));
+    auto lobby = snapshot->find("lobby");
+    CHECK(lobby.has_value());
+    if (!lobby) {
+        return;
+    }
+    RoomState state = snapshot->state(*lobby);
+    CHECK(state.name == "lobby" && state.last_seq == 42);
+    CHECK((state.index_roots == std::vector<std::uint64_t>{1, 1001}));
+    CHECK(state.history.size() == 2);
+    if (state.history.size() == 2) {
+        CHECK(state.history[0].seq == 41 && state.history[0].sender == "alice" && state.history[0].sent_ms == 1000);
+        CHECK(state.history[1].sender.empty() && state.history[1].text == "server notice");
+    }
+    auto empty = snapshot->find("empty");
+    CHECK(empty && snapshot->state(*empty).history.empty());
+}
+
+/**
+ * @brief Damaged snapshot files are refused as a whole when mapped.
+ * The room table starts after the four header numbers, each room holding the offset and length
+ * of its name, its last sequence number, then the index and count of its history and roots.
+ */
+void rejects_corrupt_snapshots() {
+    TemporaryDir dir;
+    std::string path = dir.path + "/rooms";
+    auto rooms = sample_rooms();
+    CHECK(RoomSnapshot::write(path, rooms));
+    const std::string valid = read_file(path);
+
+    auto refused = [&](const std::string& data) {
+        write_file(path, data);
+        return RoomSnapshot::open(path) == nullptr;
+    };
+    CHECK(!refused(valid));
+    std::string data = valid;
+    put_number(data, 0, 0x31504e53544149ull);
+    CHECK(refused(data));
+    CHECK(refused(""));
+    CHECK(refused(valid.substr(0, 24)));
+    CHECK(refused(valid.substr(0, valid.size() - 1)));
+    for (std::size_t count = 1; count <= 3; ++count) {
+        data = valid;
+        put_number(data, count, ~std::uint64_t(0) / 8);
+        CHECK(refused(data));
+    }
+    // The second room, "lobby" after sorting: name out of the file, history and roots out of their tables.
+    const std::size_t lobby = 4 + 7;
+    data = valid;
+    put_number(data, lobby, valid.size());
+    put_number(data, lobby + 1, 1);
+    CHECK(refused(data));
+    data = valid;
+    put_number(data, lobby + 1, ~std::uint64_t(0));
+    CHECK(refused(data));
+    data = valid;
+    put_number(data, lobby + 4, 3);
+    CHECK(refused(data));
+    data = valid;
+    put_number(data, lobby + 3, ~std::uint64_t(0));
+    CHECK(refused(data));
+    data = valid;
+    put_number(data, lobby + 6, 3);
+    CHECK(refused(data));
+    // A history message whose text points into the tables.
+    data = valid;
+    put_number(data, 4 + 2 * 7 + 4, 8);
+    CHECK(refused(data));
+}
+
+int main() {
+    round_trip();
+    rejects_corrupt_snapshots();
+    return check_result();
+}
@@ -0,0 +1,216 @@
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "check.hpp"
+#include "search_index.hpp"
+
+/**
+ * @brief Posting lists decode to the sequence numbers they were encoded from, at any gap size.
+ */
+void postings_round_trip() {
+    std::vector<std::uint64_t> seqs = {1, 2, 3, 127, 128, 129, 16383, 16384, 1000000, std::uint64_t(1) << 35,
+                                       (std::uint64_t(1) << 63) + 1, ~std::uint64_t(0)};
+    std::string bytes;
+    std::uint64_t last = 0;
+    for (auto seq : seqs) {
+        put_varint(bytes, seq - last);
+        last = seq;
+    }
+    std::vector<std::uint64_t> decoded = {42};
+    decode_postings(bytes, decoded);
+    CHECK(decoded == seqs);
+    decode_postings({}, decoded);
+    CHECK(decoded.empty());
+    // A list cut in the middle of a varint drops the incomplete number.
+    bytes.clear();
+    put_varint(bytes, 5);
+    put_varint(bytes, 300);
+    decode_postings(std::string_view(bytes).substr(0, 2), decoded);
+    CHECK(decoded == std::vector<std::uint64_t>{5});
+}
+
+/**
+ * @brief Terms are lowercased runs of letters and digits.
+ */
+void splits_terms() {
+    std::vector<std::string> terms;
+    for_each_term("Hello, WORLD: 42 times\xc3\xa9t\xc3\xa9!", [&](std::string_view term) { terms.emplace_back(term); });
+    CHECK((terms == std::vector<std::string>{"hello", "world", "42", "times\xc3\xa9t\xc3\xa9"}));
+}
+
+/**
+ * @brief Sequence numbers of the matches of a query.
+ */
+std::vector<std::uint64_t> found(RoomIndex& index, std::string_view query, std::size_t limit = 100) {
+    std::vector<std::uint64_t> seqs;
+    for (auto& match : index.search(query, limit)) {
+        seqs.push_back(match.seq);
+    }
+    return seqs;
+}
+
+/**
+ * @brief Fill an index with 25 messages over segments of 10: every third mentions apples, every fifth pears.
+ */
+void fill(RoomIndex& index) {
+    for (std::uint64_t seq = 1; seq <= 25; ++seq) {
+        std::string text = "message " + std::to_string(seq);
+        if (seq % 3 == 0) {
+            text += " Apples";
+        }
+        if (seq % 5 == 0) {
+            text += " pears";
+        }
+        index.add(seq, text);
+    }
+}
+
+/**
+ * @brief Matches across written, sealing and in-memory segments, newest first, before and after reopening.
+ */
+void searches_across_segments(IndexWriter* writer) {
+    TemporaryDir dir;
+    const std::vector<std::uint64_t> apples = {24, 21, 18, 15, 12, 9, 6, 3};
+    std::vector<std::uint64_t> roots;
+    {
+        RoomIndex index(dir.path, 10, writer);
+        fill(index);
+        CHECK(index.last_seq() == 25);
+        CHECK(found(index, "apples") == apples);
+        CHECK(found(index, "APPLES pears") == (std::vector<std::uint64_t>{15}));
+        CHECK(found(index, "apples", 3) == (std::vector<std::uint64_t>{24, 21, 18}));
+        CHECK(found(index, "bananas").empty());
+        CHECK(found(index, "!!").empty());
+        auto matches = index.search("pears", 1);
+        CHECK(matches.size() == 1 && matches[0].seq == 25 && matches[0].text == "message 25 pears");
+        index.flush();
+        roots = index.roots();
+        // The last five are written but stay the open in-memory segment, found by the chain.
+        CHECK((roots == std::vector<std::uint64_t>{1, 11}));
+        CHECK(found(index, "apples") == apples);
+    }
+    RoomIndex scanned(dir.path, 10);
+    CHECK(scanned.last_seq() == 25);
+    CHECK(found(scanned, "apples") == apples);
+    RoomIndex listed(dir.path, 10, {1});
+    CHECK(listed.roots() == roots);
+    CHECK(found(listed, "message 7").size() == 1);
+    // The reopened index carries on after the last segment.
+    listed.add(26, "apples again");
+    CHECK(found(listed, "apples", 2) == (std::vector<std::uint64_t>{26, 24}));
+}
+
+/**
+ * @brief Segment files in a directory.
+ */
+std::size_t segment_files(const std::string& dir) {
+    std::size_t files = 0;
+    for (auto& entry : std::filesystem::directory_iterator(dir)) {
+        files += entry.path().extension() == ".seg";
+    }
+    return files;
+}
+
+/**
+ * @brief Flushing and reopening a short index rewrites its one file instead of adding small ones.
+ */
+void flushes_keep_one_open_segment() {
+    TemporaryDir dir;
+    std::uint64_t seq = 0;
+    for (int round = 0; round < 3; ++round) {
+        RoomIndex index(dir.path, 10);
+        CHECK(index.last_seq() == seq);
+        for (int i = 0; i < 3; ++i) {
+            ++seq;
+            index.add(seq, "message " + std::to_string(seq));
+        }
+        index.flush();
+        index.flush();
+        CHECK(segment_files(dir.path) == 1);
+    }
+    {
+        RoomIndex index(dir.path, 10);
+        CHECK(index.roots().empty());
+        CHECK(found(index, "message").size() == 9);
+        for (int i = 0; i < 2; ++i) {
+            ++seq;
+            index.add(seq, "message " + std::to_string(seq));
+        }
+        // The full segment replaced the flushed one under the same name, the eleventh starts the next.
+        CHECK((index.roots() == std::vector<std::uint64_t>{1}));
+    }
+    CHECK(segment_files(dir.path) == 2);
+    RoomIndex index(dir.path, 10, {1});
+    CHECK(index.last_seq() == 11);
+    CHECK(found(index, "message", 20).size() == 11);
+}
+
+/**
+ * @brief Damaged segment files are refused when mapped and skipped by the room index.
+ */
+void rejects_corrupt_segments() {
+    TemporaryDir dir;
+    std::string path = dir.path + "/segment";
+    std::unordered_map<std::string, std::string> postings;
+    put_varint(postings["hello"], 7);
+    put_varint(postings["world"], 7);
+    CHECK(IndexSegment::write(path, {7}, {"hello world"}, postings));
+    auto segment = IndexSegment::open(path);
+    CHECK(segment && segment->text(7) == "hello world" && segment->last_seq() == 7);
+    const std::string valid = read_file(path);
+
+    auto refused = [&](const std::string& data) {
+        write_file(path, data);
+        return IndexSegment::open(path) == nullptr;
+    };
+    std::string data = valid;
+    put_number(data, 0, 0);
+    CHECK(refused(data));
+    CHECK(refused(valid.substr(0, valid.size() - 1)));
+    CHECK(refused(valid.substr(0, 16)));
+    CHECK(refused(""));
+    data = valid;
+    put_number(data, 1, ~std::uint64_t(0));
+    CHECK(refused(data));
+    data = valid;
+    put_number(data, 2, 1000);
+    CHECK(refused(data));
+    // Text offset past the end, length wrapping around, offset into the table.
+    data = valid;
+    put_number(data, 4, valid.size() + 1);
+    CHECK(refused(data));
+    data = valid;
+    put_number(data, 5, ~std::uint64_t(0));
+    CHECK(refused(data));
+    data = valid;
+    put_number(data, 4, 0);
+    CHECK(refused(data));
+    CHECK(!refused(valid));
+
+    TemporaryDir room;
+    {
+        RoomIndex index(room.path, 2);
+        for (std::uint64_t seq = 1; seq <= 4; ++seq) {
+            index.add(seq, "hello");
+        }
+    }
+    write_file(room.path + "/00000000000000000003.seg", "garbage");
+    RoomIndex index(room.path, 2);
+    CHECK((found(index, "hello") == std::vector<std::uint64_t>{2, 1}));
+}
+
+int main() {
+    postings_round_trip();
+    splits_terms();
+    searches_across_segments(nullptr);
+    {
+        IndexWriter writer;
+        searches_across_segments(&writer);
+    }
+    flushes_keep_one_open_segment();
+    rejects_corrupt_segments();
+    return check_result();
+}
@@ -0,0 +1,206 @@
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "check.hpp"
+#include "shm_ring.hpp"
+
+/**
+ * @brief Both ends of a ring, and its memory mapped a third time to play a misbehaving producer.
+ */
+struct RingPair {
+    std::unique_ptr<ShmRing> consumer = ShmRing::create(4096);
+    std::unique_ptr<ShmRing> producer;
+    char* memory = nullptr;
+    std::size_t size = 0;
+
+    RingPair() {
+        int sockets[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) != 0) {
+            return;
+        }
+        consumer->send(sockets[0], "ring\n");
+        std::string line;
+        producer = ShmRing::receive(sockets[1], line);
+        CHECK(line == "ring");
+        ::close(sockets[0]);
+        ::close(sockets[1]);
+        struct stat st;
+        int fd = dup_memory();
+        if (fd >= 0 && ::fstat(fd, &st) == 0) {
+            size = static_cast<std::size_t>(st.st_size);
+            void* mapped = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            memory = mapped == MAP_FAILED ? nullptr : static_cast<char*>(mapped);
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    ~RingPair() {
+        if (memory) {
+            ::munmap(memory, size);
+        }
+    }
+    /**
+     * @brief Another descriptor of the ring's memfd, passed over a socket like to a producer.
+     */
+    int dup_memory() {
+        int sockets[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) != 0) {
+            return -1;
+        }
+        consumer->send(sockets[0], "x");
+        int fds[2] = {-1, -1};
+        char byte;
+        iovec io{&byte, 1};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))];
+        msghdr message{};
+        message.msg_iov = &io;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        if (::recvmsg(sockets[1], &message, MSG_CMSG_CLOEXEC) > 0 && CMSG_FIRSTHDR(&message)) {
+            std::memcpy(fds, CMSG_DATA(CMSG_FIRSTHDR(&message)), sizeof(fds));
+        }
+        ::close(sockets[0]);
+        ::close(sockets[1]);
+        if (fds[1] >= 0) {
+            ::close(fds[1]);
+        }
+        return fds[0];
+    }
+    /**
+     * @brief Header fields as laid out by ShmRing: capacity, then head and tail on cache lines of their own.
+     */
+    std::atomic<std::uint64_t>& head() {
+        return *reinterpret_cast<std::atomic<std::uint64_t>*>(memory + 64);
+    }
+    std::atomic<std::uint64_t>& tail() {
+        return *reinterpret_cast<std::atomic<std::uint64_t>*>(memory + 128);
+    }
+    char* data() {
+        return memory + size - consumer->capacity();
+    }
+};
+
+/**
+ * @brief Messages come out whole and in order while records wrap around the end of the ring.
+ */
+void wraps_around() {
+    RingPair ring;
+    CHECK(ring.producer && ring.consumer->capacity() == 4096);
+    std::string scratch;
+    std::string_view text;
+    std::size_t sent = 0, received = 0;
+    for (int round = 0; round < 2000; ++round) {
+        // Lengths that are not multiples of 4 and up to a quarter of the ring.
+        std::string message(static_cast<std::size_t>(round * 37 % 1021), static_cast<char>('a' + round % 26));
+        message += std::to_string(round);
+        CHECK(ring.producer->push(message));
+        sent += message.size();
+        CHECK(ring.consumer->front(text, scratch, 4096));
+        CHECK(text == message);
+        received += text.size();
+        ring.consumer->pop();
+    }
+    CHECK(sent == received);
+    CHECK(!ring.consumer->front(text, scratch, 4096));
+    // A full ring refuses more until the consumer made room.
+    int pushed = 0;
+    while (ring.producer->push(std::string(100, 'x'))) {
+        ++pushed;
+    }
+    CHECK(pushed == 4096 / 104);
+    CHECK(ring.consumer->front(text, scratch, 4096));
+    ring.consumer->pop();
+    CHECK(ring.producer->push(std::string(100, 'y')));
+    CHECK(!ring.producer->push(std::string(5000, 'z')));
+}
+
+/**
+ * @brief Message of the consumer's complaint about the ring, empty if it read a message.
+ */
+std::string refusal(ShmRing& ring, std::size_t limit = 4096) {
+    std::string scratch;
+    std::string_view text;
+    try {
+        ring.front(text, scratch, limit);
+    } catch (const std::runtime_error& error) {
+        return error.what();
+    }
+    return {};
+}
+
+/**
+ * @brief Head and length fields the producer wrote wrong are refused, never read past.
+ */
+void rejects_corrupt_records() {
+    RingPair ring;
+    CHECK(ring.memory != nullptr);
+    if (!ring.memory) {
+        return;
+    }
+    ring.producer->push("hello");
+    std::uint64_t tail = ring.tail().load();
+    std::uint64_t head = ring.head().load();
+    CHECK(head == tail + 12);
+
+    ring.head().store(tail + 4096 + 4);
+    CHECK(refusal(*ring.consumer) == "Corrupt shared ring");
+    ring.head().store(tail + 2);
+    CHECK(refusal(*ring.consumer) == "Corrupt shared ring");
+    // Behind the tail counts as far ahead.
+    ring.head().store(tail - 4);
+    CHECK(refusal(*ring.consumer) == "Corrupt shared ring");
+    ring.head().store(head);
+
+    std::uint32_t length = 0xffffffff;
+    std::memcpy(ring.data(), &length, sizeof(length));
+    CHECK(refusal(*ring.consumer) == "Oversized message in shared ring");
+    // Within the limit but longer than what was written.
+    length = 100;
+    std::memcpy(ring.data(), &length, sizeof(length));
+    CHECK(refusal(*ring.consumer) == "Oversized message in shared ring");
+    length = 5;
+    std::memcpy(ring.data(), &length, sizeof(length));
+    CHECK(refusal(*ring.consumer, 4) == "Oversized message in shared ring");
+    CHECK(refusal(*ring.consumer).empty());
+}
+
+/**
+ * @brief Memory too small for the header, or no descriptors at all, make no ring.
+ */
+void rejects_bad_memory() {
+    int memory = ::memfd_create("small", MFD_CLOEXEC);
+    CHECK(memory >= 0 && ::ftruncate(memory, 16) == 0);
+    bool thrown = false;
+    try {
+        ShmRing ring(memory, -1);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+
+    int sockets[2];
+    CHECK(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) == 0);
+    CHECK(::write(sockets[0], "line\n", 5) == 5);
+    std::string line;
+    CHECK(ShmRing::receive(sockets[1], line) == nullptr);
+    CHECK(line == "line");
+    ::close(sockets[0]);
+    ::close(sockets[1]);
+}
+
+int main() {
+    wraps_around();
+    rejects_corrupt_records();
+    rejects_bad_memory();
+    return check_result();
+}
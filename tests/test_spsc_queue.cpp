@@ -0,0 +1,73 @@
+#include <memory>
+#include <thread>
+
+#include "check.hpp"
+#include "spsc_queue.hpp"
+
+/**
+ * @brief Values come out in order across many rounds, each reusing the nodes the last one freed.
+ */
+void spsc_recycles_nodes() {
+    SpscQueue<int> queue;
+    int value = -1;
+    CHECK(queue.empty());
+    CHECK(!queue.pop(value));
+    int next = 0, expected = 0;
+    for (int round = 0; round < 100; ++round) {
+        // Rounds of different lengths recycle some nodes and allocate others.
+        for (int i = 0; i < round % 7 + 1; ++i) {
+            queue.push(next++);
+        }
+        while (queue.pop(value)) {
+            CHECK(value == expected);
+            ++expected;
+        }
+        CHECK(queue.empty());
+    }
+    CHECK(expected == next);
+}
+
+/**
+ * @brief A popped value is released at once, not when its node is reused.
+ */
+void spsc_releases_popped_values() {
+    SpscQueue<std::shared_ptr<int>> queue;
+    auto shared = std::make_shared<int>(7);
+    queue.push(shared);
+    CHECK(shared.use_count() == 2);
+    std::shared_ptr<int> value;
+    CHECK(queue.pop(value));
+    value.reset();
+    CHECK(shared.use_count() == 1);
+}
+
+/**
+ * @brief A producer and a consumer thread pass a long stream through in order.
+ */
+void spsc_across_threads() {
+    SpscQueue<int> queue;
+    constexpr int count = 200000;
+    std::thread producer([&queue] {
+        for (int i = 0; i < count; ++i) {
+            queue.push(i);
+        }
+    });
+    int expected = 0, value;
+    bool ordered = true;
+    while (expected < count) {
+        if (queue.pop(value)) {
+            ordered = ordered && value == expected;
+            ++expected;
+        }
+    }
+    producer.join();
+    CHECK(ordered);
+    CHECK(queue.empty());
+}
+
+int main() {
+    spsc_recycles_nodes();
+    spsc_releases_popped_values();
+    spsc_across_threads();
+    return check_result();
+}
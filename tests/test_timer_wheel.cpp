@@ -0,0 +1,119 @@
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "check.hpp"
+#include "timer_wheel.hpp"
+
+using namespace std::chrono_literals;
+
+/**
+ * @brief Wheel driven tick by tick from a fixed origin, independent of the real clock.
+ * Ticks are a second long and the wheel is advanced to the middle of a tick, so the few
+ * microseconds between taking the origin and building the wheel never shift a tick.
+ */
+struct ManualWheel {
+    TimerWheel::clock::time_point origin = TimerWheel::clock::now();
+    TimerWheel wheel{1000ms};
+
+    void advance_to(std::uint64_t tick) {
+        wheel.advance(origin + std::chrono::seconds(tick) + 500ms);
+    }
+};
+
+/**
+ * @brief Timers fire on their tick and not one before, whichever level they start on.
+ * The delays straddle the boundaries where a timer is cascaded from one level to the next.
+ */
+void fires_on_time_across_levels() {
+    const std::vector<std::uint64_t> delays = {1, 2, 255, 256, 257, 511, 512, 4000, 65535, 65536, 65537, 70000, 16777216 + 5};
+    for (auto delay : delays) {
+        ManualWheel manual;
+        WheelTimer timer;
+        bool fired = false;
+        manual.wheel.schedule(timer, std::chrono::seconds(delay), [&fired] { fired = true; });
+        CHECK(manual.wheel.size() == 1);
+        manual.advance_to(delay - 1);
+        CHECK(!fired);
+        CHECK(timer.armed());
+        manual.advance_to(delay);
+        CHECK(fired);
+        CHECK(!timer.armed());
+        CHECK(manual.wheel.size() == 0);
+    }
+}
+
+/**
+ * @brief Timers cascaded from outer levels keep their order and leave the others alone.
+ */
+void cascades_many_timers() {
+    ManualWheel manual;
+    constexpr std::uint64_t count = 1000;
+    std::vector<WheelTimer> timers(count);
+    std::vector<std::uint64_t> fired_at(count, 0);
+    std::uint64_t now = 0;
+    for (std::uint64_t i = 0; i < count; ++i) {
+        // Spread over the first three levels.
+        std::uint64_t delay = 1 + i * 97 % 70000;
+        manual.wheel.schedule(timers[i], std::chrono::seconds(delay), [&fired_at, &now, i] { fired_at[i] = now; });
+    }
+    for (now = 1; now <= 70000; ++now) {
+        manual.advance_to(now);
+    }
+    bool on_time = true;
+    for (std::uint64_t i = 0; i < count; ++i) {
+        on_time = on_time && fired_at[i] == 1 + i * 97 % 70000;
+    }
+    CHECK(on_time);
+    CHECK(manual.wheel.size() == 0);
+}
+
+/**
+ * @brief Cancelled and re-armed timers, including ones cancelled from another timer's callback.
+ */
+void cancel_and_rearm() {
+    ManualWheel manual;
+    WheelTimer first, second, third;
+    int fired = 0;
+    manual.wheel.schedule(first, 300s, [&] { ++fired; third.cancel(); });
+    manual.wheel.schedule(second, 10s, [&] { fired += 10; });
+    manual.wheel.schedule(third, 300s, [&] { fired += 100; });
+    second.cancel();
+    CHECK(!second.armed());
+    CHECK(manual.wheel.size() == 2);
+    // Re-arming moves the timer, it fires once at its new time.
+    manual.wheel.schedule(second, 20s, [&] { fired += 1000; });
+    manual.wheel.schedule(second, 30s, [&] { fired += 10000; });
+    manual.advance_to(29);
+    CHECK(fired == 0);
+    manual.advance_to(30);
+    CHECK(fired == 10000);
+    manual.advance_to(300);
+    CHECK(fired == 10001);
+    CHECK(manual.wheel.size() == 0);
+}
+
+/**
+ * @brief Delays are rounded up to whole ticks and never fire on the current one.
+ */
+void rounds_up() {
+    ManualWheel manual;
+    WheelTimer zero, partial;
+    bool zero_fired = false, partial_fired = false;
+    manual.wheel.schedule(zero, 0ms, [&] { zero_fired = true; });
+    manual.wheel.schedule(partial, 1500ms, [&] { partial_fired = true; });
+    manual.advance_to(1);
+    CHECK(zero_fired);
+    CHECK(!partial_fired);
+    manual.advance_to(2);
+    CHECK(partial_fired);
+}
+
+int main() {
+    fires_on_time_across_levels();
+    cascades_many_timers();
+    cancel_and_rearm();
+    rounds_up();
+    return check_result();
+}